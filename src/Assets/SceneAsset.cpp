@@ -9,6 +9,7 @@
 #include "ConfigAsset.hpp"
 #include "SceneAsset.h"
 #include "Render/Materials/GltfMaterialInfo.h"
+#include "Utils/myn/JobSystem.h"
 
 #include <glm/gtx/matrix_decompose.hpp>
 #include <tinygltf/tiny_gltf.h>
@@ -265,63 +266,80 @@ void load_mesh_buffers(
 		if (component_type) *component_type = accessor.componentType;
 	};
 
-	// cpu
+	// cpu: lay out every primitive's range in the combined buffers first, then copy them all in parallel
+	struct PrimitiveCopy {
+		const vec3* positions;
+		const vec3* normals;
+		const vec4* tangents;
+		const vec2* uvs;
+		const VERTEX_INDEX_TYPE* indices_data;
+		uint32_t offset_num_vertices, num_vertices;
+		uint32_t offset_num_indices, num_indices;
+	};
+	std::vector<PrimitiveCopy> copies;
+	uint32_t total_num_vertices = vertex_buffer_cpu.size();
+	uint32_t total_num_indices = index_buffer_cpu.size();
 	for (auto& mesh : model.meshes) {
 		for (auto& prim : mesh.primitives) {
 			PrimitiveBufferIndex prim_buf_idx = primitive_buffer_indices(prim);
 			if (!cpu_buffer_indices_map.contains(prim_buf_idx)) {
 
-				uint32_t offset_num_vertices = vertex_buffer_cpu.size();
-				uint32_t offset_num_indices = index_buffer_cpu.size();
+				PrimitiveCopy copy;
 
 				// vertices
-				const vec3* positions;
-				const vec3* normals;
-				const vec4* tangents;
-				const vec2* uvs;
 				uint32_t positions_cnt, normals_cnt, tangents_cnt, uvs_cnt;
 				// TODO: can check for data types for safety (now assuming correct #components; all floats)
-				get_data(prim_buf_idx.vb_idx.position_acc_idx, reinterpret_cast<const uint8_t**>(&positions), &positions_cnt);
-				get_data(prim_buf_idx.vb_idx.normal_acc_idx, reinterpret_cast<const uint8_t**>(&normals), &normals_cnt);
-				get_data(prim_buf_idx.vb_idx.tangent_acc_idx, reinterpret_cast<const uint8_t**>(&tangents), &tangents_cnt);
-				get_data(prim_buf_idx.vb_idx.uv_acc_idx, reinterpret_cast<const uint8_t**>(&uvs), &uvs_cnt);
+				get_data(prim_buf_idx.vb_idx.position_acc_idx, reinterpret_cast<const uint8_t**>(&copy.positions), &positions_cnt);
+				get_data(prim_buf_idx.vb_idx.normal_acc_idx, reinterpret_cast<const uint8_t**>(&copy.normals), &normals_cnt);
+				get_data(prim_buf_idx.vb_idx.tangent_acc_idx, reinterpret_cast<const uint8_t**>(&copy.tangents), &tangents_cnt);
+				get_data(prim_buf_idx.vb_idx.uv_acc_idx, reinterpret_cast<const uint8_t**>(&copy.uvs), &uvs_cnt);
 
 				EXPECT_M(positions_cnt == normals_cnt && normals_cnt == tangents_cnt && tangents_cnt == uvs_cnt, true,
 						 "Mesh prims should have the same number of each attribute!");
 
-				for (auto i = 0; i < positions_cnt; i++) {
-					vertex_buffer_cpu.emplace_back();
-					Vertex& v = vertex_buffer_cpu.back();
-					v.position = positions[i];
-					v.normal = normals[i];
-					v.tangent = tangents[i];
-					v.uv = uvs[i];
-				}
-
 				// faces
-				const VERTEX_INDEX_TYPE* indices_data;
 				uint32_t indices_cnt, num_components, component_type;
-				get_data(prim_buf_idx.ib_idx, reinterpret_cast<const uint8**>(&indices_data), &indices_cnt, &num_components, &component_type);
+				get_data(prim_buf_idx.ib_idx, reinterpret_cast<const uint8**>(&copy.indices_data), &indices_cnt, &num_components, &component_type);
 				ASSERT_M(component_type == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT, "Indices are not 16-bit unsigned ints!")
 				ASSERT_M(indices_cnt % 3 == 0, "Num indices is not a multiply of 3!")
 
-				for (auto i = 0; i < indices_cnt; i++) {
-					index_buffer_cpu.push_back(indices_data[i]);
-				}
+				copy.offset_num_vertices = total_num_vertices;
+				copy.num_vertices = positions_cnt;
+				copy.offset_num_indices = total_num_indices;
+				copy.num_indices = indices_cnt;
+				total_num_vertices += positions_cnt;
+				total_num_indices += indices_cnt;
+				copies.push_back(copy);
 
 				Mesh::CpuDataAccessor cpu_accessor = {
 					.vertices = &vertex_buffer_cpu,
-					.num_vertices = static_cast<uint32_t>(vertex_buffer_cpu.size() - offset_num_vertices),
-					.offset_num_vertices = offset_num_vertices,
+					.num_vertices = copy.num_vertices,
+					.offset_num_vertices = copy.offset_num_vertices,
 					.faces = &index_buffer_cpu,
-					.num_indices = static_cast<uint32_t>(index_buffer_cpu.size() - offset_num_indices),
-					.offset_num_indices = offset_num_indices
+					.num_indices = copy.num_indices,
+					.offset_num_indices = copy.offset_num_indices
 				};
 				cpu_buffer_indices_map[prim_buf_idx] = cpu_accessor;
 			}
 		}
 	}
 
+	vertex_buffer_cpu.resize(total_num_vertices);
+	index_buffer_cpu.resize(total_num_indices);
+	myn::jobs::parallel_for(0, copies.size(), 1, [&](uint32_t first, uint32_t last) {
+		for (uint32_t c = first; c < last; c++) {
+			const PrimitiveCopy& copy = copies[c];
+			for (uint32_t i = 0; i < copy.num_vertices; i++) {
+				Vertex& v = vertex_buffer_cpu[copy.offset_num_vertices + i];
+				v.position = copy.positions[i];
+				v.normal = copy.normals[i];
+				v.tangent = copy.tangents[i];
+				v.uv = copy.uvs[i];
+			}
+			std::copy(copy.indices_data, copy.indices_data + copy.num_indices, index_buffer_cpu.begin() + copy.offset_num_indices);
+		}
+	});
+
 #if GRAPHICS_DISPLAY
 	// also load gpu resources:
 	if (gpu_buffer_indices_map && vbo && ibo) {
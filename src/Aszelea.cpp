@@ -1,17 +1,143 @@
 //
 // Created by raind on 5/24/2022.
 //
+// (before Asset.h, which redefines time_t on macOS)
+#include <mutex>
+#include <deque>
 #include "Utils/myn/Log.h"
 #include "Scene/SceneObject.hpp"
 #include "Pathtracer/Pathtracer.hpp"
 #include "Assets/ConfigAsset.hpp"
 #include "Assets/SceneAsset.h"
 #include "Scene/SkyAtmosphere/SkyAtmosphere.h"
+#include "Utils/myn/Sample.h"
+#include "Utils/myn/JobSystem.h"
+#include "Utils/myn/ThreadSafeQueue.h"
 #include <cxxopts/cxxopts.hpp>
+#include <chrono>
+#include <thread>
 #if WINOS
 #include <windows.h>
 #endif
 
+// samples/s of libc rand() vs myn::sample::rand01 with 1, 2, 4, ... max_threads threads all drawing at once
+static void benchmark_rng(int max_threads)
+{
+	const uint32_t samples_per_thread = 1 << 22;
+	auto measure = [&](int num_threads, auto&& draw) {
+		std::vector<std::thread> threads;
+		std::vector<float> sinks(num_threads);
+		auto begin = std::chrono::steady_clock::now();
+		for (int t = 0; t < num_threads; t++) {
+			threads.emplace_back([&, t]() {
+				float sum = 0;
+				for (uint32_t i = 0; i < samples_per_thread; i++) sum += draw(t, i);
+				sinks[t] = sum; // keeps the loop from being optimized away
+			});
+		}
+		for (auto& thread : threads) thread.join();
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+		return double(samples_per_thread) * num_threads / seconds.count();
+	};
+	LOG("random samples/s (millions), %u per thread:", samples_per_thread)
+	for (int n = 1; n <= max_threads; n *= 2) {
+		double libc = measure(n, [](int, uint32_t) { return float(rand()) / float(RAND_MAX); });
+		double pcg = measure(n, [](int t, uint32_t i) {
+			if (i == 0) myn::sample::seed(t, 0);
+			return myn::sample::rand01();
+		});
+		LOG("\t%2d threads: rand() %8.1f, pcg32 %8.1f (%.1fx)", n, libc * 1e-6, pcg * 1e-6, pcg / libc)
+		if (n < max_threads && n * 2 > max_threads) n = max_threads / 2;
+	}
+}
+
+// enqueue + dequeue pairs/s of myn::ThreadSafeQueue vs. a mutex around a std::deque, with 1, 2, 4, ... max_threads threads
+// all pushing and popping the same queue. Doubles as a stress test (best run in a TSAN build):
+// every value pushed must come out exactly once.
+static void benchmark_queue(int max_threads)
+{
+	const uint32_t ops_per_thread = 1 << 19;
+	struct LockedQueue {
+		std::mutex m;
+		std::deque<uint64_t> queue;
+		bool enqueue(uint64_t v) {
+			std::lock_guard<std::mutex> lock(m);
+			queue.push_back(v);
+			return true;
+		}
+		bool dequeue(uint64_t& v) {
+			std::lock_guard<std::mutex> lock(m);
+			if (queue.empty()) return false;
+			v = queue.front();
+			queue.pop_front();
+			return true;
+		}
+		size_t dequeue_n(uint64_t* out, size_t max_count) {
+			std::lock_guard<std::mutex> lock(m);
+			size_t n = std::min(max_count, queue.size());
+			for (size_t i = 0; i < n; i++) out[i] = queue[i];
+			queue.erase(queue.begin(), queue.begin() + n);
+			return n;
+		}
+	};
+	auto measure = [&](int num_threads, auto& queue, bool& all_once) {
+		std::vector<std::thread> threads;
+		std::vector<uint64_t> sums(num_threads, 0), counts(num_threads, 0);
+		auto begin = std::chrono::steady_clock::now();
+		for (int t = 0; t < num_threads; t++) {
+			threads.emplace_back([&, t]() {
+				uint64_t sum = 0, count = 0, batch[8];
+				auto pop = [&](uint32_t i) {
+					if (i % 4 == 3) {
+						size_t n = queue.dequeue_n(batch, 8);
+						for (size_t k = 0; k < n; k++) sum += batch[k];
+						count += n;
+					} else if (queue.dequeue(batch[0])) {
+						sum += batch[0];
+						count++;
+					}
+				};
+				for (uint32_t i = 0; i < ops_per_thread; i++) {
+					// full: help drain it, and let a producer that was preempted halfway through its push finish it
+					while (!queue.enqueue((uint64_t(t) << 32) | i)) {
+						pop(i);
+						std::this_thread::yield();
+					}
+					pop(i);
+				}
+				sums[t] = sum;
+				counts[t] = count;
+			});
+		}
+		for (auto& thread : threads) thread.join();
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+
+		uint64_t sum = 0, count = 0, expected_sum = 0, v;
+		while (queue.dequeue(v)) {
+			sum += v;
+			count++;
+		}
+		for (int t = 0; t < num_threads; t++) {
+			sum += sums[t];
+			count += counts[t];
+			expected_sum += (uint64_t(t) << 32) * ops_per_thread + uint64_t(ops_per_thread) * (ops_per_thread - 1) / 2;
+		}
+		all_once = count == uint64_t(ops_per_thread) * num_threads && sum == expected_sum;
+		return double(ops_per_thread) * num_threads / seconds.count();
+	};
+	LOG("queue enqueue + dequeue pairs/s (millions), %u per thread:", ops_per_thread)
+	for (int n = 1; n <= max_threads; n *= 2) {
+		LockedQueue locked;
+		myn::ThreadSafeQueue<uint64_t> lock_free(64); // small, so threads also run into it being full
+		bool locked_ok, lock_free_ok;
+		double locked_rate = measure(n, locked, locked_ok);
+		double lock_free_rate = measure(n, lock_free, lock_free_ok);
+		LOG("\t%2d threads: mutex %8.2f, lock-free %8.2f (%.1fx)", n, locked_rate * 1e-6, lock_free_rate * 1e-6, lock_free_rate / locked_rate)
+		if (!locked_ok || !lock_free_ok) ERR("\t%s queue lost or duplicated values!", lock_free_ok ? "mutex" : "lock-free")
+		if (n < max_threads && n * 2 > max_threads) n = max_threads / 2;
+	}
+}
+
 int main(int argc, const char * argv[])
 {
 	cxxopts::Options options("aszelea", "pathtrace to file");
@@ -19,10 +145,29 @@ int main(int argc, const char * argv[])
 	options.add_options()
 		("w,width", "window width", cxxopts::value<int>())
 		("h,height", "window height", cxxopts::value<int>())
-		("o,output", "output relative_path", cxxopts::value<std::string>());
+		("o,output", "output relative_path", cxxopts::value<std::string>())
+		("spp", "samples per pixel, traced in passes of MinRaysPerPixel (default: one pass)", cxxopts::value<int>())
+		("time-limit", "stop refining after this many seconds (the first pass always completes)", cxxopts::value<float>())
+		("half", "write .exr output as half float instead of float")
+		("aovs", "also write albedo, normal, depth, direct/indirect and sample count layers to .exr output")
+		("denoise", "filter the result with the feature guided denoiser, even if Denoise in pathtracer.ini is off")
+		("threads", "job system threads (default: NumThreads in global.ini)", cxxopts::value<int>())
+		("benchmark-rng", "measure random number throughput with up to N threads, then exit",
+			cxxopts::value<int>()->implicit_value(std::to_string(std::thread::hardware_concurrency())))
+		("benchmark-queue", "measure and stress test the lock-free queue with up to N threads (default 64), then exit",
+			cxxopts::value<int>()->implicit_value("64"));
 
 	auto optargs = options.parse(argc, argv);
 
+	if (optargs.count("benchmark-rng")) {
+		benchmark_rng(std::max(1, optargs["benchmark-rng"].as<int>()));
+		return 0;
+	}
+	if (optargs.count("benchmark-queue")) {
+		benchmark_queue(std::max(1, optargs["benchmark-queue"].as<int>()));
+		return 0;
+	}
+
 	if (!optargs.count("output") || !optargs.count("width") || !optargs.count("height")) {
 		ERR("required arguments not set.")
 		return 0;
@@ -34,6 +179,7 @@ int main(int argc, const char * argv[])
 
 	// load config
 	Config = new ConfigAsset("config/global.ini", false);
+	myn::jobs::initialize(std::max(0, optargs.count("threads") ? optargs["threads"].as<int>() : Config->lookup<int>("NumThreads")));
 
 	// load scene
 	auto scene_asset = new SceneAsset(
@@ -73,6 +219,15 @@ int main(int argc, const char * argv[])
 	auto pathtracer = Pathtracer::get(width, height);
 	pathtracer->drawable = scene_asset->get_root();
 	pathtracer->camera = camera;
+	pathtracer->set_render_budget(
+		optargs.count("spp") ? std::max(0, optargs["spp"].as<int>()) : 0,
+		optargs.count("time-limit") ? optargs["time-limit"].as<float>() : 0.0f);
+	bool exr = output_path.size() >= 4 && myn::lower(output_path.substr(output_path.size() - 4)) == ".exr";
+	if (!exr && (optargs.count("half") || optargs.count("aovs"))) {
+		WARN("--half and --aovs only apply to .exr output")
+	}
+	pathtracer->set_exr_options(exr && optargs.count("half"), exr && optargs.count("aovs"));
+	pathtracer->set_denoise(optargs.count("denoise"));
 
 	LOG("rendering pathtracer scene to file: %s", output_path.c_str());
 	pathtracer->render_to_file(output_path);
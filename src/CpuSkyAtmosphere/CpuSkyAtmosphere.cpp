@@ -643,7 +643,7 @@ CpuTexture CpuSkyAtmosphere::createSkyTexture(int width, int height) {
 	return outSkyTexture;
 }
 
-glm::vec3 CpuSkyAtmosphere::sampleSkyColor(const glm::vec3 &viewDir) {
+glm::vec3 CpuSkyAtmosphere::sampleSkyColor(const glm::vec3 &viewDir, bool includeSun) {
 	vec3 cameraPosES = ws2es(renderingParams.cameraPosWS, renderingParams.atmosphere.bottomRadius);
 
 	float bottomRadius = renderingParams.atmosphere.bottomRadius;
@@ -655,7 +655,7 @@ glm::vec3 CpuSkyAtmosphere::sampleSkyColor(const glm::vec3 &viewDir) {
 	vec3 L = skyViewLut.sampleBilinear(skyViewUv, CpuTexture::WM_Clamp);
 
 	// sun
-	if (dot(viewDir, renderingParams.dir2sun) > cos(renderingParams.sunAngularRadius)) {
+	if (includeSun && dot(viewDir, renderingParams.dir2sun) > cos(renderingParams.sunAngularRadius)) {
 		vec3 transmittanceToSun = sampleTransmittanceToSun(
 			&transmittanceLut,
 			renderingParams.atmosphere.bottomRadius,
@@ -88,7 +88,8 @@ class CpuSkyAtmosphere {
 public:
 	CpuSkyAtmosphere();
 
-	glm::vec3 sampleSkyColor(const glm::vec3& viewDir);
+	// includeSun: whether viewDir within the sun's disk also sees the sun, or just the sky around it
+	glm::vec3 sampleSkyColor(const glm::vec3& viewDir, bool includeSun = true);
 
 	glm::vec3 sampleSunTransmittance(const glm::vec3& viewDir) const;
 
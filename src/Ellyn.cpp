@@ -13,6 +13,7 @@
 #include "Utils/DebugUI.h"
 
 #include "Utils/myn/RenderDoc.h"
+#include "Utils/myn/JobSystem.h"
 
 #include <SDL2/SDL.h>
 #include <imgui.h>
@@ -326,6 +327,7 @@ int main(int argc, const char * argv[])
 	std::srand(time(nullptr));
 
 	Config = new ConfigAsset("config/global.ini", false);
+	myn::jobs::initialize(std::max(0, Config->lookup<int>("NumThreads")));
 
 	if (Config->lookup<int>("Debug.RenderDoc")) RenderDoc::load("niar");
 
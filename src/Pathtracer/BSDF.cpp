@@ -18,22 +18,30 @@ vec3 Diffuse::f(const vec3& wi, const vec3& wo, bool debug) const {
 	return albedo * ONE_OVER_PI;
 }
 
-vec3 Diffuse::sample_f(float& pdf, vec3& wi, vec3 wo, bool debug) const {
+vec3 Diffuse::sample_f(float& pdf, vec3& wi, vec3 wo, vec2 u, bool debug) const {
 #if USE_COS_WEIGHED
-	wi = myn::sample::hemisphere_cos_weighed();
+	wi = myn::sample::hemisphere_cos_weighed(u);
 	pdf = wi.z * ONE_OVER_PI;
 #else
-	wi = sample::hemisphere_uniform();
+	wi = myn::sample::hemisphere_uniform(u);
 	pdf = ONE_OVER_TWO_PI;
 #endif
 	return f(wi, wo, debug);
 }
 
+float Diffuse::pdf(const vec3& wi, const vec3& wo) const {
+#if USE_COS_WEIGHED
+	return std::max(0.0f, wi.z) * ONE_OVER_PI;
+#else
+	return wi.z > 0 ? ONE_OVER_TWO_PI : 0.0f;
+#endif
+}
+
 vec3 Mirror::f(const vec3& wi, const vec3& wo, bool debug) const {
 	return vec3(0.0f);
 }
 
-vec3 Mirror::sample_f(float& pdf, vec3& wi, vec3 wo, bool debug) const {
+vec3 Mirror::sample_f(float& pdf, vec3& wi, vec3 wo, vec2 u, bool debug) const {
 	wi = -wo;
 	wi.z = wo.z;
 	pdf = 1.0f;
@@ -44,7 +52,7 @@ vec3 Glass::f(const vec3& wi, const vec3& wo, bool debug) const {
 	return vec3(0.0f);
 }
 
-vec3 Glass::sample_f(float& pdf, vec3& wi, vec3 wo, bool debug) const {
+vec3 Glass::sample_f(float& pdf, vec3& wi, vec3 wo, vec2 u, bool debug) const {
 	// will treat wo as in direction and wi as out direction, since it's bidirectional
 
 	bool trace_out = wo.z < 0; // the direction we're going to trace is into the medium
@@ -73,7 +81,7 @@ vec3 Glass::sample_f(float& pdf, vec3& wi, vec3 wo, bool debug) const {
 	float reflectance = r0 + (1.0f - r0) * pow(1.0f - cos_theta_i, 5);
 	
 	// flip a biased coin to decide whether to reflect or refract
-	bool reflect = myn::sample::rand01() <= reflectance;
+	bool reflect = u.x < reflectance;
 	if (reflect) {
 		if (debug) LOG("reflect");
 		wi = -wo;
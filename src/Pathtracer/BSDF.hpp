@@ -1,6 +1,23 @@
 #pragma once
 #include <glm/glm.hpp>
 
+// hemisphere space (what BSDFs take wi, wo in) is z-up around the surface normal
+inline void make_h2w(glm::mat3& h2w, const glm::vec3& z) { // TODO: make more robust
+	// choose a vector different from z
+	glm::vec3 tmp = glm::normalize(glm::vec3(1, 2, 3));
+
+	glm::vec3 x = glm::cross(tmp, z);
+	x = glm::normalize(x);
+	glm::vec3 y = glm::cross(z, x);
+
+	h2w = glm::mat3(x, y, z);
+}
+
+// see: https://stackoverflow.com/questions/687261/converting-rgb-to-grayscale-intensity
+inline float brightness(const glm::vec3& color) {
+	return 0.2989f * color.r + 0.587f * color.g + 0.114f * color.b;
+}
+
 struct BSDF {
 
 	enum Type {
@@ -30,9 +47,12 @@ struct BSDF {
 	 * wi: negative of light incoming dir (output, sampled)
 	 * wo: light outgoing dir (input)
 	 * n: normal of the hit surface (input)
+	 * u: uniform sample in [0, 1)^2 that sample_f warps into wi (input)
 	 */
 	virtual glm::vec3 f(const glm::vec3& wi, const glm::vec3& wo, bool debug = false) const = 0;
-	virtual glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, bool debug = false) const = 0;
+	virtual glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, glm::vec2 u, bool debug = false) const = 0;
+	// density of sample_f picking wi (for MIS); 0 for delta BSDFs
+	virtual float pdf(const glm::vec3& wi, const glm::vec3& wo) const = 0;
 
 	// asset management
 	uint32_t asset_version = 0;
@@ -53,7 +73,8 @@ struct Diffuse : public BSDF {
 		set_emission(glm::vec3(0));
 	}
 	glm::vec3 f(const glm::vec3& wi, const glm::vec3& wo, bool debug) const override;
-	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, bool debug) const override;
+	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, glm::vec2 u, bool debug) const override;
+	float pdf(const glm::vec3& wi, const glm::vec3& wo) const override;
 };
 
 struct Mirror : public BSDF {
@@ -64,7 +85,8 @@ struct Mirror : public BSDF {
 		set_emission(glm::vec3(0));
 	}
 	glm::vec3 f(const glm::vec3& wi, const glm::vec3& wo, bool debug) const override;
-	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, bool debug) const override;
+	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, glm::vec2 u, bool debug) const override;
+	float pdf(const glm::vec3& wi, const glm::vec3& wo) const override { return 0; }
 };
 
 struct Glass : public BSDF {
@@ -76,5 +98,6 @@ struct Glass : public BSDF {
 		set_emission(glm::vec3(0));
 	}
 	glm::vec3 f(const glm::vec3& wi, const glm::vec3& wo, bool debug) const override;
-	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, bool debug) const override;
+	glm::vec3 sample_f(float& pdf, glm::vec3& wi, glm::vec3 wo, glm::vec2 u, bool debug) const override;
+	float pdf(const glm::vec3& wi, const glm::vec3& wo) const override { return 0; }
 };
@@ -1,8 +1,13 @@
 #include "BVH.hpp"
+#include "Utils/myn/Log.h"
+#include "Utils/myn/Timer.h"
+#include "Utils/myn/JobSystem.h"
 #include <algorithm>
 
-#define BVH_THRESHOLD 16
-#define PER_AXIS_GRANULARITY 8
+#define BVH_NUM_BINS 16
+// spatial splits are only tried where the best object split's children overlap by more than this fraction of the root
+#define BVH_SPATIAL_SPLIT_ALPHA 1e-5f
+#define BVH_NUM_SPATIAL_BINS 32
 
 inline float BVH::surface_area() {
 	if (primitives_count == 0) return 0.0f;
@@ -13,448 +18,860 @@ inline float BVH::surface_area() {
 	//return (max.x - min.x) * (max.y - min.y) * (max.z - min.z);
 }
 
-void BVH::extend_primitive(Primitive* prim)
+void BVH::extend_primitive(uint32_t index)
 {
-	Triangle* T = dynamic_cast<Triangle*>(prim);
-	if (!T) return; // currently bvh only supports triangles
-	for (int i=0; i<3; i++) {
-		min = glm::min(min, T->vertices[i]);
-		max = glm::max(max, T->vertices[i]);
-	}
+	vec3 prim_min, prim_max;
+	triangles->get_extents(index, prim_min, prim_max);
+	min = glm::min(min, prim_min);
+	max = glm::max(max, prim_max);
 }
 
 void BVH::update_extents() {
 	// populate min and max:
 	for (uint i=0; i<primitives_count; i++) {
-		extend_primitive((*primitives_ptr)[primitives_start + i]);
+		extend_primitive(primitives_start + i);
 	}
 }
 
-void BVH::expand_bvh()
+namespace
 {
-	if (primitives_count <= BVH_THRESHOLD) {
-		return;
+// per-primitive data cached once for the whole build, so the inner loops don't touch the triangle store at all
+struct BuildPrimitive {
+	vec3 min;
+	vec3 max;
+	vec3 centroid;
+	uint32_t index;
+};
+
+struct Bin {
+	vec3 min = vec3(INF);
+	vec3 max = vec3(-INF);
+	uint count = 0;
+
+	void merge(const Bin& other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+		count += other.count;
+	}
+};
+
+struct NodeBounds {
+	vec3 min = vec3(INF);
+	vec3 max = vec3(-INF);
+	vec3 cmin = vec3(INF);
+	vec3 cmax = vec3(-INF);
+
+	void merge(const NodeBounds& other) {
+		min = glm::min(min, other.min);
+		max = glm::max(max, other.max);
+		cmin = glm::min(cmin, other.cmin);
+		cmax = glm::max(cmax, other.cmax);
 	}
+};
 
-	vec3 step = (max - min) * (1.0f / PER_AXIS_GRANULARITY);
+struct SplitBins {
+	Bin bins[3][BVH_NUM_BINS];
 
-	float min_SA = INF;
-	int min_divide_axis = 0;
+	void merge(const SplitBins& other) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (int i = 0; i < BVH_NUM_BINS; i++) bins[axis][i].merge(other.bins[axis][i]);
+		}
+	}
+};
+
+struct BuildContext {
+	BuildPrimitive* refs; // refs[i] corresponds to triangle base + i before the build
+	uint base;
+	BVHBuildOptions options;
+};
+
+struct BuildStats {
+	uint num_nodes = 0;
+	uint num_leaves = 0;
+	uint max_depth = 0;
+	double sah_cost = 0; // not yet normalized by root surface area
+	double overlap = 0; // sum of the children's overlap area over all interior nodes, not yet normalized either
+
+	void merge(const BuildStats& other) {
+		num_nodes += other.num_nodes;
+		num_leaves += other.num_leaves;
+		max_depth = glm::max(max_depth, other.max_depth);
+		sah_cost += other.sah_cost;
+		overlap += other.overlap;
+	}
+};
+
+BuildContext make_context(std::vector<BuildPrimitive>& refs, uint base, const BVHBuildOptions& options) {
+	BuildContext ctx;
+	ctx.refs = refs.data();
+	ctx.base = base;
+	ctx.options = options;
+	// (leaf counts need to fit in LinearBVHNode::count)
+	ctx.options.max_leaf_size = glm::clamp(ctx.options.max_leaf_size, 1u, 0xffffu);
+	ctx.options.num_threads = glm::max(1u, ctx.options.num_threads);
+	ctx.options.leaf_batch_size = glm::max(1u, ctx.options.leaf_batch_size);
+	return ctx;
+}
 
-	auto center = [](Primitive* T_) {
-		Triangle* T = dynamic_cast<Triangle*>(T_);
-		return (T->vertices[0] + T->vertices[1] + T->vertices[2]) * (1.0f / 3.0f);
-	};
+inline float half_area(const vec3& min, const vec3& max) {
+	vec3 d = glm::max(max - min, vec3(0));
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
 
-	// x axis
-	for (int i=1; i<PER_AXIS_GRANULARITY; i++)
-	{
-		float x_divide = min.x + i * step.x;
-		BVH* left_tmp = new BVH(primitives_ptr, depth + 1);
-		BVH* right_tmp = new BVH(primitives_ptr, depth + 1);
-		uint left_cnt = 0, right_cnt = 0;
+inline int bin_index(float c, float cmin, float k) {
+	return glm::min(BVH_NUM_BINS - 1, int((c - cmin) * k));
+}
 
-		for (uint32_t j=0; j<primitives_count; j++)
-		{
-			Triangle* T = dynamic_cast<Triangle*>( (*primitives_ptr)[primitives_start + j] );
-			if (center(T).x < x_divide) {
-				left_cnt++;
-			} else {
-				right_cnt++;
+/*
+ * Runs fn over num_threads contiguous chunks of [begin, end), each producing a partial T,
+ * then merges the partials in chunk order. Merges are exact (min/max/counts), so the result
+ * doesn't depend on num_threads.
+ */
+template <typename T, typename Fn>
+T reduce_chunks(uint num_threads, const BuildPrimitive* begin, const BuildPrimitive* end, const Fn& fn)
+{
+	size_t count = end - begin;
+	num_threads = glm::max(1u, num_threads);
+	if (num_threads == 1) {
+		T result;
+		fn(result, begin, end);
+		return result;
+	}
+	std::vector<T> partials(num_threads);
+	size_t chunk = (count + num_threads - 1) / num_threads;
+	myn::jobs::parallel_for(0, num_threads, 1, [&](uint32_t first, uint32_t last) {
+		for (uint i = first; i < last; i++) {
+			size_t b = glm::min(count, i * chunk), e = glm::min(count, (i + 1) * chunk);
+			fn(partials[i], begin + b, begin + e);
+		}
+	});
+	for (uint i = 1; i < num_threads; i++) partials[0].merge(partials[i]);
+	return partials[0];
+}
+
+inline float num_batches(const BVHBuildOptions& opt, uint n) {
+	return float((n + opt.leaf_batch_size - 1) / opt.leaf_batch_size);
+}
+
+// half area of the intersection of two boxes, 0 if they don't overlap
+inline float overlap_half_area(const vec3& amin, const vec3& amax, const vec3& bmin, const vec3& bmax) {
+	vec3 d = glm::min(amax, bmax) - glm::max(amin, bmin);
+	if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+NodeBounds compute_bounds(const BuildPrimitive* begin, const BuildPrimitive* end, uint num_threads)
+{
+	return reduce_chunks<NodeBounds>(num_threads, begin, end,
+		[](NodeBounds& out, const BuildPrimitive* b, const BuildPrimitive* e) {
+		for (auto* r = b; r != e; r++) {
+			out.min = glm::min(out.min, r->min);
+			out.max = glm::max(out.max, r->max);
+			out.cmin = glm::min(out.cmin, r->centroid);
+			out.cmax = glm::max(out.cmax, r->centroid);
+		}
+	});
+}
+
+// best binned SAH split by centroids
+struct ObjectSplit {
+	float cost = INF;
+	int axis = -1; // -1 if there's no valid split
+	int split = 0; // primitives in bins [0, split) go to the left child
+	vec3 k = vec3(0); // bin index scale per axis (0 marks an axis with no centroid extent)
+	vec3 cmin = vec3(0);
+	// children bounds if this split is taken
+	vec3 left_min, left_max, right_min, right_max;
+};
+
+ObjectSplit find_object_split(const BuildPrimitive* begin, const BuildPrimitive* end, const NodeBounds& bounds,
+							  const BVHBuildOptions& opt, uint num_threads)
+{
+	ObjectSplit result;
+	result.cmin = bounds.cmin;
+	vec3 cextent = bounds.cmax - bounds.cmin;
+	for (int axis = 0; axis < 3; axis++) {
+		result.k[axis] = cextent[axis] > 0 ? BVH_NUM_BINS * (1.0f - 1e-5f) / cextent[axis] : 0;
+	}
+	const vec3& k = result.k;
+	const vec3& cmin = result.cmin;
+
+	SplitBins split_bins = reduce_chunks<SplitBins>(num_threads, begin, end,
+		[&](SplitBins& out, const BuildPrimitive* b, const BuildPrimitive* e) {
+		for (int axis = 0; axis < 3; axis++) {
+			if (k[axis] == 0) continue;
+			for (auto* r = b; r != e; r++) {
+				Bin& bin = out.bins[axis][bin_index(r->centroid[axis], cmin[axis], k[axis])];
+				bin.count++;
+				bin.min = glm::min(bin.min, r->min);
+				bin.max = glm::max(bin.max, r->max);
 			}
 		}
-		bool accepted = false;
-		left_tmp->primitives_start = primitives_start;
-		left_tmp->primitives_count = left_cnt;
-		right_tmp->primitives_start = primitives_start + left_cnt;
-		right_tmp->primitives_count = right_cnt;
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).x;
-			float x2 = center(P2).x;
-			return x1 < x2;
-		});
-		left_tmp->update_extents();
-		right_tmp->update_extents();
-
-		if (left_cnt > 0 && right_cnt > 0) {
-			float SA = left_tmp->surface_area() + right_tmp->surface_area();
-			if (SA < min_SA) {
-				left = left_tmp;
-				right = right_tmp;
-				min_SA = SA;
-				min_divide_axis = 0;
-				accepted = true;
+	});
+
+	// find the cheapest bin boundary over all 3 axes
+	float node_area = half_area(bounds.min, bounds.max);
+	for (int axis = 0; axis < 3; axis++) {
+		if (k[axis] == 0) continue;
+		const Bin* bins = split_bins.bins[axis];
+
+		// sweep from the right to get bounds & count of everything right of each boundary
+		Bin right[BVH_NUM_BINS];
+		Bin acc;
+		for (int i = BVH_NUM_BINS - 1; i > 0; i--) {
+			acc.merge(bins[i]);
+			right[i] = acc;
+		}
+		// then sweep from the left and evaluate the SAH at each boundary
+		acc = Bin();
+		for (int i = 1; i < BVH_NUM_BINS; i++) {
+			acc.merge(bins[i - 1]);
+			if (acc.count == 0 || right[i].count == 0) continue;
+			float left_area = half_area(acc.min, acc.max);
+			float right_area = half_area(right[i].min, right[i].max);
+			float cost = opt.traversal_cost + opt.intersection_cost *
+				(left_area * num_batches(opt, acc.count) + right_area * num_batches(opt, right[i].count)) / glm::max(node_area, 1e-20f);
+			if (cost < result.cost) {
+				result.cost = cost;
+				result.axis = axis;
+				result.split = i;
+				result.left_min = acc.min;
+				result.left_max = acc.max;
+				result.right_min = right[i].min;
+				result.right_max = right[i].max;
 			}
 		}
+	}
+	return result;
+}
 
-		if (!accepted) {
-			delete left_tmp;
-			delete right_tmp;
-		}
+// partitions by the given object split, or at the median of the largest centroid extent if that doesn't separate anything
+BuildPrimitive* partition_object(BuildPrimitive* begin, BuildPrimitive* end, const NodeBounds& bounds,
+								 const ObjectSplit& os, uint& out_axis)
+{
+	BuildPrimitive* mid = nullptr;
+	out_axis = os.axis;
+	if (os.axis >= 0) {
+		// one partition pass using the same bin assignment as above
+		int axis = os.axis;
+		mid = std::partition(begin, end, [&](const BuildPrimitive& r) {
+			return bin_index(r.centroid[axis], os.cmin[axis], os.k[axis]) < os.split;
+		});
 	}
-	// y axis
-	for (int i=1; i<PER_AXIS_GRANULARITY; i++)
-	{
-		float y_divide = min.y + i * step.y;
-		BVH* left_tmp = new BVH(primitives_ptr, depth + 1);
-		BVH* right_tmp = new BVH(primitives_ptr, depth + 1);
-		uint left_cnt = 0, right_cnt = 0;
+	if (mid == nullptr || mid == begin || mid == end) {
+		// all centroids coincide but we still need to split (too many to be a leaf): fall back to median split
+		vec3 cextent = bounds.cmax - bounds.cmin;
+		int axis = cextent.x >= cextent.y && cextent.x >= cextent.z ? 0 : (cextent.y >= cextent.z ? 1 : 2);
+		out_axis = axis;
+		mid = begin + (end - begin) / 2;
+		std::nth_element(begin, mid, end, [axis](const BuildPrimitive& a, const BuildPrimitive& b) {
+			return a.centroid[axis] < b.centroid[axis];
+		});
+	}
+	return mid;
+}
 
-		for (uint32_t j=0; j<primitives_count; j++)
-		{
-			auto* T = dynamic_cast<Triangle*>( (*primitives_ptr)[primitives_start + j] );
-			if (center(T).y < y_divide) {
-				left_cnt++;
-			} else {
-				right_cnt++;
-			}
+/*
+ * Decides whether node becomes a leaf; if not, partitions its primitives and creates (but doesn't expand) its children.
+ * num_threads > 1 only parallelizes the O(n) bounds & binning passes, the outcome is identical.
+ */
+bool split_node(BVH* node, const BuildContext& ctx, BuildStats& stats, uint num_threads)
+{
+	BuildPrimitive* begin = ctx.refs + (node->primitives_start - ctx.base);
+	BuildPrimitive* end = begin + node->primitives_count;
+
+	NodeBounds bounds = compute_bounds(begin, end, num_threads);
+	node->min = bounds.min;
+	node->max = bounds.max;
+
+	const auto& opt = ctx.options;
+	uint count = node->primitives_count;
+	float node_area = half_area(node->min, node->max);
+
+	stats.num_nodes++;
+	stats.max_depth = glm::max(stats.max_depth, node->depth);
+
+	auto make_leaf = [&]() {
+		stats.num_leaves++;
+		stats.sah_cost += double(node_area) * opt.intersection_cost * num_batches(opt, count);
+		return false;
+	};
+
+	if (count <= 1) return make_leaf();
+
+	ObjectSplit os = find_object_split(begin, end, bounds, opt, num_threads);
+
+	float leaf_cost = opt.intersection_cost * num_batches(opt, count);
+	if (count <= opt.max_leaf_size && (os.axis < 0 || leaf_cost <= os.cost)) {
+		return make_leaf();
+	}
+
+	BuildPrimitive* mid = partition_object(begin, end, bounds, os, node->axis);
+	if (os.axis >= 0) {
+		stats.overlap += overlap_half_area(os.left_min, os.left_max, os.right_min, os.right_max);
+	}
+
+	stats.sah_cost += double(node_area) * opt.traversal_cost;
+
+	uint left_count = mid - begin;
+	node->left = new BVH(node->triangles, node->depth + 1);
+	node->left->primitives_start = node->primitives_start;
+	node->left->primitives_count = left_count;
+	node->right = new BVH(node->triangles, node->depth + 1);
+	node->right->primitives_start = node->primitives_start + left_count;
+	node->right->primitives_count = count - left_count;
+	return true;
+}
+
+void build_recursive(BVH* node, const BuildContext& ctx, BuildStats& stats)
+{
+	if (split_node(node, ctx, stats, 1)) {
+		build_recursive(node->left, ctx, stats);
+		build_recursive(node->right, ctx, stats);
+	}
+}
+
+// splits the big nodes near the root (each split itself multithreaded), and collects the rest as independent subtrees
+void build_top_levels(BVH* node, const BuildContext& ctx, BuildStats& stats, uint subtree_size, std::vector<BVH*>& subtrees)
+{
+	if (node->primitives_count <= subtree_size) {
+		subtrees.push_back(node);
+		return;
+	}
+	if (split_node(node, ctx, stats, ctx.options.num_threads)) {
+		build_top_levels(node->left, ctx, stats, subtree_size, subtrees);
+		build_top_levels(node->right, ctx, stats, subtree_size, subtrees);
+	}
+}
+
+//-------- spatial splits --------
+
+// bounds of the part of a triangle within axis slab [lo, hi], further clipped to an existing reference box
+void clip_triangle(const TriangleStore& triangles, const BuildPrimitive& ref, int axis, float lo, float hi,
+				   vec3& out_min, vec3& out_max)
+{
+	out_min = vec3(INF);
+	out_max = vec3(-INF);
+	vec3 v[3] = {triangles.vertex(ref.index, 0), triangles.vertex(ref.index, 1), triangles.vertex(ref.index, 2)};
+	for (int i = 0; i < 3; i++) {
+		const vec3& p = v[i];
+		const vec3& q = v[(i + 1) % 3];
+		float pa = p[axis], qa = q[axis];
+		if (pa >= lo && pa <= hi) {
+			out_min = glm::min(out_min, p);
+			out_max = glm::max(out_max, p);
 		}
-		bool accepted = false;
-		left_tmp->primitives_start = primitives_start;
-		left_tmp->primitives_count = left_cnt;
-		right_tmp->primitives_start = primitives_start + left_cnt;
-		right_tmp->primitives_count = right_cnt;
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).y;
-			float x2 = center(P2).y;
-			return x1 < x2;
-		});
-		left_tmp->update_extents();
-		right_tmp->update_extents();
-
-		if (left_cnt > 0 && right_cnt > 0) {
-			float SA = left_tmp->surface_area() + right_tmp->surface_area();
-			if (SA < min_SA) {
-				left = left_tmp;
-				right = right_tmp;
-				min_SA = SA;
-				min_divide_axis = 1;
-				accepted = true;
+		// where the edge crosses either plane
+		for (float plane : {lo, hi}) {
+			if ((pa < plane && qa > plane) || (pa > plane && qa < plane)) {
+				vec3 x = glm::mix(p, q, (plane - pa) / (qa - pa));
+				x[axis] = plane;
+				out_min = glm::min(out_min, x);
+				out_max = glm::max(out_max, x);
 			}
 		}
+	}
+	out_min = glm::max(out_min, ref.min);
+	out_max = glm::min(out_max, ref.max);
+}
+
+struct SpatialBin {
+	vec3 min = vec3(INF);
+	vec3 max = vec3(-INF);
+	uint enter = 0; // references whose bounds start in this bin
+	uint exit = 0; // ... and end in this bin
+};
+
+struct SpatialSplit {
+	float cost = INF;
+	int axis = -1;
+	float position = 0;
+	vec3 left_min, left_max, right_min, right_max;
+	uint left_count = 0, right_count = 0;
+};
+
+/*
+ * Spatial split BVH (Stich, Friedrich, Dietrich, "Spatial Splits in Bounding Volume Hierarchies", 2009).
+ * Serial and recursive; every node owns its reference list, since splitting references changes their number.
+ * References are straddling triangles clipped to either side, so the same triangle can end up in several leaves.
+ */
+struct SBVHBuilder
+{
+	const TriangleStore& triangles;
+	BVHBuildOptions opt;
+	float root_area;
+	size_t duplicates_left; // budget of extra references
+	std::vector<uint32_t> order; // triangle of each reference, in leaf order
+	BuildStats stats;
+	double object_overlap = 0; // overlap the best object split would have had at every interior node
+	uint num_spatial_splits = 0;
+
+	SpatialSplit find_spatial_split(const std::vector<BuildPrimitive>& refs, const NodeBounds& bounds) const
+	{
+		SpatialSplit result;
+		float node_area = half_area(bounds.min, bounds.max);
+		for (int axis = 0; axis < 3; axis++) {
+			float lo = bounds.min[axis];
+			float extent = bounds.max[axis] - lo;
+			if (extent <= 0) continue;
+			float bin_width = extent / BVH_NUM_SPATIAL_BINS;
+			auto bin_of = [&](float x) {
+				return glm::clamp(int((x - lo) / bin_width), 0, BVH_NUM_SPATIAL_BINS - 1);
+			};
+
+			// chop every reference into the bins it spans
+			SpatialBin bins[BVH_NUM_SPATIAL_BINS];
+			for (const auto& r : refs) {
+				int first = bin_of(r.min[axis]);
+				int last = bin_of(r.max[axis]);
+				bins[first].enter++;
+				bins[last].exit++;
+				for (int b = first; b <= last; b++) {
+					vec3 cmin, cmax;
+					clip_triangle(triangles, r, axis, lo + b * bin_width,
+								  b == BVH_NUM_SPATIAL_BINS - 1 ? bounds.max[axis] : lo + (b + 1) * bin_width, cmin, cmax);
+					if (cmin.x > cmax.x || cmin.y > cmax.y || cmin.z > cmax.z) continue;
+					bins[b].min = glm::min(bins[b].min, cmin);
+					bins[b].max = glm::max(bins[b].max, cmax);
+				}
+			}
 
-		if (!accepted) {
-			delete left_tmp;
-			delete right_tmp;
+			// same sweeps as for object splits, but counting entries on the left and exits on the right
+			vec3 right_min[BVH_NUM_SPATIAL_BINS], right_max[BVH_NUM_SPATIAL_BINS];
+			uint right_count[BVH_NUM_SPATIAL_BINS];
+			vec3 acc_min(INF), acc_max(-INF);
+			uint acc_count = 0;
+			for (int i = BVH_NUM_SPATIAL_BINS - 1; i > 0; i--) {
+				acc_min = glm::min(acc_min, bins[i].min);
+				acc_max = glm::max(acc_max, bins[i].max);
+				acc_count += bins[i].exit;
+				right_min[i] = acc_min;
+				right_max[i] = acc_max;
+				right_count[i] = acc_count;
+			}
+			acc_min = vec3(INF); acc_max = vec3(-INF);
+			acc_count = 0;
+			for (int i = 1; i < BVH_NUM_SPATIAL_BINS; i++) {
+				acc_min = glm::min(acc_min, bins[i - 1].min);
+				acc_max = glm::max(acc_max, bins[i - 1].max);
+				acc_count += bins[i - 1].enter;
+				if (acc_count == 0 || right_count[i] == 0) continue;
+				float cost = opt.traversal_cost + opt.intersection_cost *
+					(half_area(acc_min, acc_max) * num_batches(opt, acc_count) +
+					 half_area(right_min[i], right_max[i]) * num_batches(opt, right_count[i])) / glm::max(node_area, 1e-20f);
+				if (cost < result.cost) {
+					result.cost = cost;
+					result.axis = axis;
+					result.position = lo + i * bin_width;
+					result.left_min = acc_min; result.left_max = acc_max;
+					result.right_min = right_min[i]; result.right_max = right_max[i];
+					result.left_count = acc_count;
+					result.right_count = right_count[i];
+				}
+			}
 		}
+		return result;
 	}
-	// z axis
-	for (int i=1; i<PER_AXIS_GRANULARITY; i++)
-	{
-		float z_divide = min.z + i * step.z;
-		BVH* left_tmp = new BVH(primitives_ptr, depth + 1);
-		BVH* right_tmp = new BVH(primitives_ptr, depth + 1);
-		uint left_cnt = 0, right_cnt = 0;
 
-		for (uint32_t j=0; j<primitives_count; j++)
-		{
-			Triangle* T = dynamic_cast<Triangle*>( (*primitives_ptr)[primitives_start + j] );
-			if (center(T).z < z_divide) {
-				left_cnt++;
+	// distributes refs to both sides of the plane; straddling references get split, unless it's cheaper to
+	// keep them whole on one side ("reference unsplitting") or the duplication budget has run out
+	void partition_spatial(const std::vector<BuildPrimitive>& refs, const SpatialSplit& ss,
+						   std::vector<BuildPrimitive>& left, std::vector<BuildPrimitive>& right)
+	{
+		int axis = ss.axis;
+		vec3 lmin = ss.left_min, lmax = ss.left_max, rmin = ss.right_min, rmax = ss.right_max;
+		float nl = ss.left_count, nr = ss.right_count;
+		for (const auto& r : refs) {
+			if (r.max[axis] <= ss.position) { left.push_back(r); continue; }
+			if (r.min[axis] >= ss.position) { right.push_back(r); continue; }
+
+			BuildPrimitive l = r, rr = r;
+			clip_triangle(triangles, r, axis, -INF, ss.position, l.min, l.max);
+			clip_triangle(triangles, r, axis, ss.position, INF, rr.min, rr.max);
+			bool l_valid = l.min.x <= l.max.x && l.min.y <= l.max.y && l.min.z <= l.max.z;
+			bool r_valid = rr.min.x <= rr.max.x && rr.min.y <= rr.max.y && rr.min.z <= rr.max.z;
+
+			float split_cost = half_area(lmin, lmax) * nl + half_area(rmin, rmax) * nr;
+			float left_cost = half_area(glm::min(lmin, r.min), glm::max(lmax, r.max)) * nl + half_area(rmin, rmax) * (nr - 1);
+			float right_cost = half_area(lmin, lmax) * (nl - 1) + half_area(glm::min(rmin, r.min), glm::max(rmax, r.max)) * nr;
+			bool can_split = duplicates_left > 0 && l_valid && r_valid;
+			if (!can_split) split_cost = INF;
+
+			if (split_cost <= left_cost && split_cost <= right_cost) {
+				l.centroid = (l.min + l.max) * 0.5f;
+				rr.centroid = (rr.min + rr.max) * 0.5f;
+				left.push_back(l);
+				right.push_back(rr);
+				duplicates_left--;
+			} else if (left_cost <= right_cost) {
+				left.push_back(r);
+				lmin = glm::min(lmin, r.min); lmax = glm::max(lmax, r.max);
+				nr--;
 			} else {
-				right_cnt++;
+				right.push_back(r);
+				rmin = glm::min(rmin, r.min); rmax = glm::max(rmax, r.max);
+				nl--;
 			}
 		}
-		bool accepted = false;
-		left_tmp->primitives_start = primitives_start;
-		left_tmp->primitives_count = left_cnt;
-		right_tmp->primitives_start = primitives_start + left_cnt;
-		right_tmp->primitives_count = right_cnt;
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).z;
-			float x2 = center(P2).z;
-			return x1 < x2;
-		});
-		left_tmp->update_extents();
-		right_tmp->update_extents();
-
-		if (left_cnt > 0 && right_cnt > 0) {
-			float SA = left_tmp->surface_area() + right_tmp->surface_area();
-			if (SA < min_SA) {
-				left = left_tmp;
-				right = right_tmp;
-				min_SA = SA;
-				min_divide_axis = 2;
-				accepted = true;
-			}
+	}
+
+	void build(BVH* node, std::vector<BuildPrimitive>& refs)
+	{
+		NodeBounds bounds = compute_bounds(refs.data(), refs.data() + refs.size(), 1);
+		node->min = bounds.min;
+		node->max = bounds.max;
+		uint count = refs.size();
+		float node_area = half_area(node->min, node->max);
+
+		stats.num_nodes++;
+		stats.max_depth = glm::max(stats.max_depth, node->depth);
+
+		auto make_leaf = [&]() {
+			stats.num_leaves++;
+			stats.sah_cost += double(node_area) * opt.intersection_cost * num_batches(opt, count);
+			node->primitives_start = order.size();
+			node->primitives_count = count;
+			for (const auto& r : refs) order.push_back(r.index);
+			refs.clear();
+			refs.shrink_to_fit();
+		};
+
+		if (count <= 1) return make_leaf();
+
+		ObjectSplit os = find_object_split(refs.data(), refs.data() + refs.size(), bounds, opt, 1);
+		float os_overlap = os.axis >= 0 ? overlap_half_area(os.left_min, os.left_max, os.right_min, os.right_max) : 0;
+
+		// only look for spatial splits where the object split leaves noticeable overlap
+		SpatialSplit ss;
+		if (duplicates_left > 0 && os_overlap > BVH_SPATIAL_SPLIT_ALPHA * root_area) {
+			ss = find_spatial_split(refs, bounds);
 		}
 
-		if (!accepted) {
-			delete left_tmp;
-			delete right_tmp;
+		float best_cost = glm::min(os.cost, ss.cost);
+		float leaf_cost = opt.intersection_cost * num_batches(opt, count);
+		if (count <= opt.max_leaf_size && (best_cost == INF || leaf_cost <= best_cost)) {
+			return make_leaf();
 		}
-	}
 
-	// sort them back (since primitive order might've been modified along the way)
-	if (min_divide_axis==0) {
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).x;
-			float x2 = center(P2).x;
-			return x1 < x2;
-		});
-	} else if (min_divide_axis==1) {
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).y;
-			float x2 = center(P2).y;
-			return x1 < x2;
-		});
-	} else {
-		std::sort(primitives_ptr->begin() + primitives_start, primitives_ptr->begin() + primitives_start + primitives_count,
-		[center](Primitive* P1, Primitive* P2){
-			float x1 = center(P1).z;
-			float x2 = center(P2).z;
-			return x1 < x2;
-		});
+		std::vector<BuildPrimitive> left, right;
+		if (ss.axis >= 0 && ss.cost < os.cost) {
+			partition_spatial(refs, ss, left, right);
+			node->axis = ss.axis;
+		}
+		if (left.empty() || right.empty()) {
+			left.clear();
+			right.clear();
+			BuildPrimitive* mid = partition_object(refs.data(), refs.data() + refs.size(), bounds, os, node->axis);
+			left.assign(refs.data(), mid);
+			right.assign(mid, refs.data() + refs.size());
+		} else {
+			num_spatial_splits++;
+		}
+		refs.clear();
+		refs.shrink_to_fit();
+
+		NodeBounds lb = compute_bounds(left.data(), left.data() + left.size(), 1);
+		NodeBounds rb = compute_bounds(right.data(), right.data() + right.size(), 1);
+		stats.overlap += overlap_half_area(lb.min, lb.max, rb.min, rb.max);
+		object_overlap += os_overlap;
+		stats.sah_cost += double(node_area) * opt.traversal_cost;
+
+		node->left = new BVH(node->triangles, node->depth + 1);
+		node->right = new BVH(node->triangles, node->depth + 1);
+		build(node->left, left);
+		build(node->right, right);
+		node->primitives_start = node->left->primitives_start;
+		node->primitives_count = node->left->primitives_count + node->right->primitives_count;
 	}
-
-	// need this check because there could be cases when all divisions result in one child being empty.
-	// In that case make this node a leaf.
-	if (left && right) {
-		/*
-		LOG("left %u [%u, %u), right %u [%u, %u)", 
-			left->primitives_count, left->primitives_start, left->primitives_start + left->primitives_count, 
-			right->primitives_count, right->primitives_start, right->primitives_start + right->primitives_count);
-		*/
-	} else {
-		//LOG("(automatical division)");
-		left = new BVH(primitives_ptr, depth + 1);
-		right = new BVH(primitives_ptr, depth + 1);
-		left->primitives_start = primitives_start;
-		left->primitives_count = primitives_count / 2;
-		left->update_extents();
-		right->primitives_start = primitives_start + left->primitives_count;
-		right->primitives_count = primitives_count - left->primitives_count;
-		right->update_extents();
-	}
-	left->expand_bvh();
-	right->expand_bvh();
+};
 }
 
-// https://www.scratchapixel.com/lessons/3d-basic-rendering/minimal-ray-tracer-rendering-simple-shapes/ray-box-intersection 
-bool BVH::intersect_aabb(const Ray& ray, float& tmin, float& tmax)
+void BVH::expand_bvh(const BVHBuildOptions& options)
 {
-#if 0 // use my own (readable but a tad slower) impl?
-	float dmin = INF;
-	bool hit = false;
-
-	float txmin = (min.x - ray.o.x) / ray.d.x;
-	float txmax = (max.x - ray.o.x) / ray.d.x;
-	float tymin = (min.y - ray.o.y) / ray.d.y;
-	float tymax = (max.y - ray.o.y) / ray.d.y;
-	float tzmin = (min.z - ray.o.z) / ray.d.z;
-	float tzmax = (max.z - ray.o.z) / ray.d.z;
-
-	if (!isnan(txmin) && txmin >= ray.tmin && txmin < ray.tmax) {
-		//float px = ray.o.x + txmin*ray.d.x;
-		float py = ray.o.y + txmin*ray.d.y;
-		float pz = ray.o.z + txmin*ray.d.z;
-		if (py >= min.y && py < max.y &&
-			pz >= min.z && pz < max.z)
-		{
-			dmin = glm::min(dmin, txmin);
-			hit = true;
-		}
+	TIMER_BEGIN
+
+	std::vector<BuildPrimitive> refs(primitives_count);
+	for (uint i = 0; i < primitives_count; i++) {
+		BuildPrimitive& r = refs[i];
+		r.index = primitives_start + i;
+		triangles->get_extents(r.index, r.min, r.max);
+		r.centroid = (r.min + r.max) * 0.5f;
 	}
 
-	if (!isnan(txmax) && txmax >= ray.tmin && txmax < ray.tmax) {
-		//float px = ray.o.x + txmax*ray.d.x;
-		float py = ray.o.y + txmax*ray.d.y;
-		float pz = ray.o.z + txmax*ray.d.z;
-		if (py >= min.y && py < max.y &&
-			pz >= min.z && pz < max.z)
-		{
-			dmin = glm::min(dmin, txmax);
-			hit = true;
-		}
+	BuildContext ctx = make_context(refs, primitives_start, options);
+	uint num_threads = ctx.options.num_threads;
+
+	delete left; left = nullptr;
+	delete right; right = nullptr;
+	min = vec3(INF);
+	max = vec3(-INF);
+
+	bool spatial_splits = ctx.options.spatial_splits;
+	if (spatial_splits && (primitives_start != 0 || primitives_count != triangles->size())) {
+		WARN("spatial splits need the BVH to cover the whole triangle store, building without them")
+		spatial_splits = false;
 	}
 
-	if (!isnan(tymin) && tymin >= ray.tmin && tymin < ray.tmax) {
-		float px = ray.o.x + tymin*ray.d.x;
-		//float py = ray.o.y + tymin*ray.d.y;
-		float pz = ray.o.z + tymin*ray.d.z;
-		if (px >= min.x && px < max.x &&
-			pz >= min.z && pz < max.z)
+	BuildStats stats;
+	double top_levels_time = 0, subtrees_time = 0, subtrees_work_time = 0;
+	uint num_triangles = primitives_count;
+	std::vector<uint32_t> order;
+	double object_overlap = 0;
+	uint num_spatial_splits = 0;
+	if (spatial_splits) {
+		NodeBounds root_bounds = compute_bounds(refs.data(), refs.data() + refs.size(), 1);
+		SBVHBuilder builder{*triangles, ctx.options, half_area(root_bounds.min, root_bounds.max),
+							size_t(glm::max(0.0f, ctx.options.max_duplication) * primitives_count)};
+		builder.order.reserve(primitives_count);
+		builder.build(this, refs);
+		stats = builder.stats;
+		object_overlap = builder.object_overlap;
+		num_spatial_splits = builder.num_spatial_splits;
+		order = std::move(builder.order);
+	} else if (num_threads == 1 || primitives_count < BVH_MIN_PARALLEL_BUILD_SIZE) {
+		build_recursive(this, ctx, stats);
+	} else {
+		// phase 1: split the top of the tree until there are plenty of subtrees to hand out
+		std::vector<BVH*> subtrees;
+		uint subtree_size = glm::max(BVH_MIN_PARALLEL_BUILD_SIZE / 4, primitives_count / (num_threads * 8));
 		{
-			dmin = glm::min(dmin, tymin);
-			hit = true;
+			TIMER_BEGIN
+			build_top_levels(this, ctx, stats, subtree_size, subtrees);
+			TIMER_END(t)
+			top_levels_time = t;
 		}
-	}
 
-	if (!isnan(tymax) && tymax >= ray.tmin && tymax < ray.tmax) {
-		float px = ray.o.x + tymax*ray.d.x;
-		//float py = ray.o.y + tymax*ray.d.y;
-		float pz = ray.o.z + tymax*ray.d.z;
-		if (px >= min.x && px < max.x &&
-			pz >= min.z && pz < max.z)
-		{
-			dmin = glm::min(dmin, tymax);
-			hit = true;
+		// phase 2: the job system's threads take subtrees, biggest first. Every subtree is built by exactly one thread
+		// with the serial algorithm, so the resulting tree doesn't depend on scheduling.
+		std::sort(subtrees.begin(), subtrees.end(), [](const BVH* a, const BVH* b) {
+			if (a->primitives_count != b->primitives_count) return a->primitives_count > b->primitives_count;
+			return a->primitives_start < b->primitives_start;
+		});
+		TIMER_BEGIN
+		std::vector<BuildStats> subtree_stats(subtrees.size());
+		std::vector<double> subtree_work_time(subtrees.size(), 0);
+		myn::jobs::parallel_for(0, subtrees.size(), 1, [&](uint32_t first, uint32_t last) {
+			for (uint i = first; i < last; i++) {
+				TIMER_BEGIN
+				build_recursive(subtrees[i], ctx, subtree_stats[i]);
+				TIMER_END(t)
+				subtree_work_time[i] = t;
+			}
+		});
+		for (uint i = 0; i < subtrees.size(); i++) {
+			stats.merge(subtree_stats[i]);
+			subtrees_work_time += subtree_work_time[i];
 		}
+		TIMER_END(t)
+		subtrees_time = t;
 	}
 
-	if (!isnan(tzmin) && tzmin >= ray.tmin && tzmin < ray.tmax) {
-		float px = ray.o.x + tzmin*ray.d.x;
-		float py = ray.o.y + tzmin*ray.d.y;
-		//float pz = ray.o.z + tzmin*ray.d.z;
-		if (px >= min.x && px < max.x &&
-			py >= min.y && py < max.y)
-		{
-			dmin = glm::min(dmin, tzmin);
-			hit = true;
+	// write back the new primitive order
+	if (spatial_splits) {
+		triangles->assign_references(order);
+	} else {
+		order.resize(primitives_count);
+		for (uint i = 0; i < primitives_count; i++) {
+			order[i] = refs[i].index;
 		}
+		refs.clear();
+		refs.shrink_to_fit();
+		triangles->reorder(primitives_start, order);
 	}
 
-	if (!isnan(tzmax) && tzmax >= ray.tmin && tzmax < ray.tmax) {
-		float px = ray.o.x + tzmax*ray.d.x;
-		float py = ray.o.y + tzmax*ray.d.y;
-		//float pz = ray.o.z + tzmax*ray.d.z;
-		if (px >= min.x && px < max.x &&
-			py >= min.y && py < max.y)
-		{
-			dmin = glm::min(dmin, tzmax);
-			hit = true;
-		}
+	TIMER_END(duration)
+	if (!options.report) return;
+	float root_area = half_area(min, max);
+	double sah_cost = root_area > 0 ? stats.sah_cost / root_area : 0;
+	// overlap of sibling boxes, weighted by area like the SAH: roughly, how many extra nodes a random ray visits
+	double overlap = root_area > 0 ? stats.overlap / root_area : 0;
+	TRACE("built BVH over %u primitives in %.3fs: %u nodes, %u leaves, max depth %u, SAH cost %.2f, node overlap %.3f",
+		  num_triangles, duration, stats.num_nodes, stats.num_leaves, stats.max_depth, sah_cost, overlap)
+	if (spatial_splits) {
+		TRACE("	%u spatial splits, %u references (+%.1f%%); node overlap with object splits only would be %.3f",
+			  num_spatial_splits, primitives_count, 100.0f * (primitives_count - num_triangles) / glm::max(1u, num_triangles),
+			  root_area > 0 ? object_overlap / root_area : 0)
+	}
+	if (subtrees_work_time > 0) {
+		// replaces the subtree phase's wall time with the sum of its per-thread work. The top levels are still
+		// counted with their multithreaded time, so this underestimates the actual speedup a bit.
+		// (per-thread work is wall time, so it's only meaningful when NumThreads doesn't exceed the core count)
+		double serial_equivalent = duration - subtrees_time + subtrees_work_time;
+		TRACE("\t%u threads: top levels %.3fs, subtrees %.3fs of work, speedup over serial >= %.2fx",
+			  num_threads, top_levels_time, subtrees_work_time, serial_equivalent / duration)
 	}
+}
 
-	if (hit) {
-		distance = dmin;
-		return true;
-	} else {
-		return false;
+void BVH::expand_bvh(const std::vector<vec3>& box_min, const std::vector<vec3>& box_max,
+					 const BVHBuildOptions& options, std::vector<uint32_t>& order)
+{
+	std::vector<BuildPrimitive> refs(primitives_count);
+	for (uint i = 0; i < primitives_count; i++) {
+		BuildPrimitive& r = refs[i];
+		r.index = primitives_start + i;
+		r.min = box_min[r.index];
+		r.max = box_max[r.index];
+		r.centroid = (r.min + r.max) * 0.5f;
 	}
+	BuildContext ctx = make_context(refs, primitives_start, options);
+	ctx.options.num_threads = 1;
+
+	delete left; left = nullptr;
+	delete right; right = nullptr;
+	BuildStats stats;
+	build_recursive(this, ctx, stats);
 
-#else
-	tmin = (min.x - ray.o.x) / ray.d.x; 
-	tmax = (max.x - ray.o.x) / ray.d.x; 
- 
-	if (tmin > tmax) std::swap(tmin, tmax); 
- 
-	float tymin = (min.y - ray.o.y) / ray.d.y; 
-	float tymax = (max.y - ray.o.y) / ray.d.y; 
- 
-	if (tymin > tymax) std::swap(tymin, tymax); 
- 
-	if ((tmin > tymax) || (tymin > tmax)) 
-		return false; 
- 
-	if (tymin > tmin) 
-		tmin = tymin; 
- 
-	if (tymax < tmax) 
-		tmax = tymax; 
- 
-	float tzmin = (min.z - ray.o.z) / ray.d.z; 
-	float tzmax = (max.z - ray.o.z) / ray.d.z; 
- 
-	if (tzmin > tzmax) std::swap(tzmin, tzmax); 
- 
-	if ((tmin > tzmax) || (tzmin > tmax)) 
-		return false; 
- 
-	if (tzmin > tmin) 
-		tmin = tzmin; 
- 
-	if (tzmax < tmax) 
-		tmax = tzmax; 
-
-	return tmax >= ray.tmin; 
-#endif
-	
+	order.resize(primitives_count);
+	for (uint i = 0; i < primitives_count; i++) {
+		order[i] = refs[i].index;
+	}
 }
 
-#define FRONT_TO_BACK 0
+//-------- flattened BVH --------
 
-Primitive* BVH::intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh) 
+LinearBVH::LinearBVH(const BVH* root) : triangles(root->triangles)
 {
-	Primitive* primitive = nullptr;
-
-	if (use_bvh)
-	{
+	if (root->primitives_count == 0) return;
+
+	// depth-first, but allocate both children of a node at once so they end up adjacent
+	std::vector<std::pair<const BVH*, uint32_t>> st;
+	nodes.emplace_back();
+	st.emplace_back(root, 0);
+	while (!st.empty()) {
+		auto [src, index] = st.back(); st.pop_back();
+		max_depth = glm::max(max_depth, src->depth);
+
+		LinearBVHNode node{};
+		node.min = src->min;
+		node.max = src->max;
+		if (src->left && src->right) {
+			node.offset = nodes.size();
+			node.count = 0;
+			node.axis = src->axis;
+			nodes.emplace_back();
+			nodes.emplace_back();
+			st.emplace_back(src->right, node.offset + 1);
+			st.emplace_back(src->left, node.offset);
+		} else {
+			node.offset = src->primitives_start;
+			node.count = src->primitives_count;
+		}
+		nodes[index] = node;
+	}
+}
 
-	#if FRONT_TO_BACK
+namespace
+{
+struct TraversalEntry {
+	uint32_t index;
+	float tnear;
+};
+#define BVH_LOCAL_STACK_SIZE 64
+}
 
-		if (left || right)
-		{
-			float tmin_left, tmax_left, tmin_right, tmax_right;
-			if (left->intersect_aabb(ray, tmin_left, tmax_right))
-			{
-				if (right->intersect_aabb(ray, tmin_right, tmax_right)) // intersected both bboxes, go with the closer one
-				{
-					BVH* first = nullptr;
-					BVH* second = nullptr;
-					float tmin_near, tmin_far;
-					if (tmin_left < tmin_right) {
-						first = left; second = right;
-						tmin_near = tmin_left; tmin_far = tmin_right;
-					} else {
-						first = right; second = left;
-						tmin_near = tmin_right; tmin_far = tmin_left;
-					}
-
-					primitive = first->intersect_primitives(ray, t, n);
-					if (!primitive || t > tmin_far) {
-						Primitive* prim_tmp = second->intersect_primitives(ray, t, n);
-						if (prim_tmp) {
-							primitive = prim_tmp;
-						}
-					}
-				}
-				else // only intersected with left
-				{
-					primitive = left->intersect_primitives(ray, t, n);
-				}
-			}
-			else // only intersected with right
-			{
-				primitive = right->intersect_primitives(ray, t, n);
-			}
+int LinearBVH::intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh) const
+{
+	int primitive = -1;
+	TriangleRay tri_ray(ray);
+	float tmax = ray.tmax;
+
+	if (!use_bvh) {
+		primitive = triangles->intersect_leaf(tri_ray, 0, triangles->size(), tmax);
+		if (primitive >= 0) {
+			ray.tmax = tmax;
+			t = tmax;
+			n = triangles->normal(primitive);
 		}
-		else
-		{
-			for (uint32_t i = 0; i < primitives_count; i++) {
-				Primitive* prim_tmp = (*primitives_ptr)[primitives_start + i]->intersect(ray, t, n, true);
-				if (prim_tmp) {
-					primitive = prim_tmp;
-				}
+		return primitive;
+	}
+	if (nodes.empty()) return -1;
+
+	vec3 inv_d = 1.0f / ray.d;
+
+	// near-first traversal never holds more than (depth + 1) entries
+	TraversalEntry local_stack[BVH_LOCAL_STACK_SIZE];
+	std::vector<TraversalEntry> heap_stack;
+	TraversalEntry* st = local_stack;
+	if (max_depth + 2 > BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		st = heap_stack.data();
+	}
+	int top = 0;
+
+	float tnear;
+	if (!intersect_node(nodes[0], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) return -1;
+	st[top++] = {0, tnear};
+
+	while (top > 0) {
+		TraversalEntry entry = st[--top];
+		// cull: something closer than this node was found after it got pushed
+		if (entry.tnear > ray.tmax) continue;
+
+		const LinearBVHNode& node = nodes[entry.index];
+		if (node.is_leaf()) {
+			int hit = triangles->intersect_leaf(tri_ray, node.offset, node.count, tmax);
+			if (hit >= 0) {
+				primitive = hit;
+				ray.tmax = tmax;
 			}
+			continue;
 		}
-	#else
-		float tmin, tmax;
-		if (intersect_aabb(ray, tmin, tmax))
-		{
-			if (left || right)
-			{
-				primitive = left->intersect_primitives(ray, t, n);
-				Primitive* prim_tmp = right->intersect_primitives(ray, t, n);
-				if (prim_tmp) primitive = prim_tmp;
-			}
-			else
-			{
-				for (uint32_t i = 0; i < primitives_count; i++) {
-					Primitive* prim_tmp = (*primitives_ptr)[primitives_start + i]->intersect(ray, t, n, true);
-					if (prim_tmp) {
-						primitive = prim_tmp;
-					}
-				}
+
+		float tnear_l, tnear_r;
+		bool hit_l = intersect_node(nodes[node.offset], ray.o, inv_d, ray.tmin, ray.tmax, tnear_l);
+		bool hit_r = intersect_node(nodes[node.offset + 1], ray.o, inv_d, ray.tmin, ray.tmax, tnear_r);
+		if (hit_l && hit_r) {
+			// push the far child first so the near one gets popped next
+			if (tnear_l <= tnear_r) {
+				st[top++] = {node.offset + 1, tnear_r};
+				st[top++] = {node.offset, tnear_l};
+			} else {
+				st[top++] = {node.offset, tnear_l};
+				st[top++] = {node.offset + 1, tnear_r};
 			}
+		} else if (hit_l) {
+			st[top++] = {node.offset, tnear_l};
+		} else if (hit_r) {
+			st[top++] = {node.offset + 1, tnear_r};
 		}
+	}
+	if (primitive >= 0) {
+		t = tmax;
+		n = triangles->normal(primitive);
+	}
+	return primitive;
+}
 
-	#endif // FRONT_TO_BACK
-
+bool LinearBVH::occluded(const Ray& ray, bool use_bvh) const
+{
+	TriangleRay tri_ray(ray);
+	if (!use_bvh) return triangles->occludes_leaf(tri_ray, 0, triangles->size(), ray.tmax);
+	if (nodes.empty()) return false;
+
+	vec3 inv_d = 1.0f / ray.d;
+
+	// no ordering needed since any hit will do, but keep the same stack bound
+	uint32_t local_stack[BVH_LOCAL_STACK_SIZE];
+	std::vector<uint32_t> heap_stack;
+	uint32_t* st = local_stack;
+	if (max_depth + 2 > BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		st = heap_stack.data();
 	}
-	else
-	{
-		for (uint32_t i = 0; i < primitives_count; i++) {
-			Primitive* prim_tmp = (*primitives_ptr)[primitives_start + i]->intersect(ray, t, n, true);
-			if (prim_tmp) {
-				primitive = prim_tmp;
-			}
+	int top = 0;
+
+	float tnear;
+	if (!intersect_node(nodes[0], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) return false;
+	st[top++] = 0;
+
+	while (top > 0) {
+		const LinearBVHNode& node = nodes[st[--top]];
+		if (node.is_leaf()) {
+			if (triangles->occludes_leaf(tri_ray, node.offset, node.count, ray.tmax)) return true;
+			continue;
 		}
+		if (intersect_node(nodes[node.offset + 1], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) st[top++] = node.offset + 1;
+		if (intersect_node(nodes[node.offset], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) st[top++] = node.offset;
 	}
-	return primitive;
-}
\ No newline at end of file
+	return false;
+}
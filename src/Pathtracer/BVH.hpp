@@ -3,13 +3,41 @@
 
 using namespace glm;
 
+// rounding in the slab test can make a box narrowly miss a ray that hits a triangle inside of it, which would
+// undo the watertight triangle test. Scaling the box's far distance by 1 + 2 * gamma(3) makes it conservative
+// (Ize, "Robust BVH Ray Traversal", 2013).
+#define BVH_SLAB_TFAR_SCALE 1.00000036f
+// below this many primitives, a multithreaded build isn't worth spawning threads for
+#define BVH_MIN_PARALLEL_BUILD_SIZE 16384u
+
+struct BVHBuildOptions
+{
+	// nodes with at most this many primitives may become leaves (if SAH says so);
+	// bigger ranges are always split.
+	uint max_leaf_size = 8;
+	// relative costs used by the surface area heuristic
+	float traversal_cost = 1.0f;
+	float intersection_cost = 1.0f;
+	// leaves get intersected this many primitives at a time, so SAH charges ceil(count / leaf_batch_size) tests
+	uint leaf_batch_size = 1;
+	// worker threads for the build; the resulting tree is the same regardless of this number
+	uint num_threads = 1;
+	// SBVH: also consider splitting triangle references at planes (only where object splits overlap a lot).
+	// Single threaded, and needs the BVH to cover the whole triangle store.
+	bool spatial_splits = false;
+	// spatial splits stop once this many extra references (as a fraction of the triangle count) were created
+	float max_duplication = 0.5f;
+	// TRACE build stats when done
+	bool report = true;
+};
+
 struct BVH
 {
-	BVH(std::vector<Primitive*>* _primitives_ptr, uint _depth) {
+	BVH(TriangleStore* _triangles, uint _depth) {
 		depth = _depth;
 		min = vec3(INF);
 		max = vec3(-INF);
-		primitives_ptr = _primitives_ptr;
+		triangles = _triangles;
 		primitives_start = 0;
 		primitives_count = 0;
 		left = nullptr;
@@ -25,18 +53,66 @@ struct BVH
 	vec3 min;
 	vec3 max;
 
-	std::vector<Primitive*>* primitives_ptr;
+	TriangleStore* triangles;
 	uint primitives_start;
 	uint primitives_count;
 	BVH* left;
 	BVH* right;
+	uint axis = 0; // split axis, only meaningful for interior nodes
+
+	void extend_primitive(uint32_t index);
 
-	void extend_primitive(Primitive* prim);
-	
 	void update_extents();
-	void expand_bvh();
+
+	// binned SAH build over [primitives_start, primitives_start + primitives_count).
+	// reorders *triangles so that every node's primitives are a contiguous range of it.
+	void expand_bvh(const BVHBuildOptions& options = {});
+	// same build over arbitrary boxes indexed by primitives_start + i (the top level over mesh instances), serial.
+	// Nothing gets reordered; order receives the box index of each primitive slot [primitives_start, ...) instead.
+	void expand_bvh(const std::vector<vec3>& box_min, const std::vector<vec3>& box_max,
+					const BVHBuildOptions& options, std::vector<uint32_t>& order);
 
 	float surface_area();
-	bool intersect_aabb(const Ray& ray, float& tmin, float& tmax);
-	Primitive* intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh = true);
-};
\ No newline at end of file
+};
+
+// node of the flattened BVH. Exactly 32 bytes so two of them share a cache line;
+// the two children of an interior node are always stored next to each other.
+// pathtracer_kernel_utils.ispc mirrors this layout (struct BVH), so keep them in sync.
+struct alignas(32) LinearBVHNode
+{
+	vec3 min;
+	uint32_t offset; // leaf: index of first primitive; interior: index of left child (right child is offset + 1)
+	vec3 max;
+	uint16_t count; // number of primitives in a leaf, 0 for interior nodes
+	uint8_t axis; // split axis of interior nodes
+	uint8_t pad;
+
+	bool is_leaf() const { return count > 0; }
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+// slab test against a ray with precomputed inverse direction. Outputs the entry distance.
+inline bool intersect_node(const LinearBVHNode& node, const vec3& o, const vec3& inv_d, float tmin, float tmax, float& tnear)
+{
+	vec3 t0 = (node.min - o) * inv_d;
+	vec3 t1 = (node.max - o) * inv_d;
+	vec3 tsmall = glm::min(t0, t1);
+	vec3 tbig = glm::max(t0, t1);
+	tnear = glm::max(glm::max(tsmall.x, tsmall.y), glm::max(tsmall.z, tmin));
+	float tfar = glm::min(glm::min(tbig.x, tbig.y), tbig.z) * BVH_SLAB_TFAR_SCALE;
+	return tnear <= glm::min(tfar, tmax);
+}
+
+struct LinearBVH
+{
+	// flattens an already built tree; primitives referenced by leaves stay in root->triangles
+	explicit LinearBVH(const BVH* root);
+
+	std::vector<LinearBVHNode> nodes;
+	const TriangleStore* triangles;
+	uint max_depth = 0;
+
+	int intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh = true) const;
+	// any-hit: returns as soon as anything is found within [ray.tmin, ray.tmax]. For shadow rays.
+	bool occluded(const Ray& ray, bool use_bvh = true) const;
+};
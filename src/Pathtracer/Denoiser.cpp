@@ -0,0 +1,219 @@
+#include "Denoiser.hpp"
+#include "Film.hpp"
+#include "Utils/myn/Misc.h"
+#include "Utils/myn/JobSystem.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+// albedo channels below this count as black, and that channel of the mean is filtered as is
+#define DENOISER_ALBEDO_EPSILON 1e-3f
+// depth differences up to this fraction of the center's depth are always tolerated (curved surfaces aren't planes)
+#define DENOISER_DEPTH_TOLERANCE 0.01f
+// taps whose weight is below exp(-this) don't count
+#define DENOISER_MAX_EXPONENT 16.0f
+// rows per job system chunk
+#define DENOISER_GRAIN_ROWS 4
+
+using namespace glm;
+
+namespace {
+
+inline float luminance(const vec3& c) {
+	return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+// B3 spline, by distance from the center
+const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+// what the edge-stopping functions look at, per pixel
+struct Guide {
+	vec3 albedo; // what the mean got divided by
+	vec3 normal; // 0 where the camera ray escaped
+	float depth; // INF where it escaped
+	vec2 depth_gradient; // per pixel along x and y
+	bool valid; // has any samples
+};
+
+// one row of one iteration. (Everything as plain values and pointers, so the compiler doesn't have to assume the
+// outputs could overwrite any of it)
+void filter_row(int y, int step, int width, int height, const Guide* guides, const float* lum,
+				const vec3* c_in, const float* v_in, vec3* c_out, float* v_out,
+				float sigma_luminance, float sigma_normal, float sigma_depth) {
+	for (int x = 0; x < width; x++) {
+		uint32_t p = y * width + x;
+		const Guide& gp = guides[p];
+		if (!gp.valid) {
+			c_out[p] = vec3(0);
+			v_out[p] = 0;
+			continue;
+		}
+		float l_p = lum[p];
+		float l_scale = 1.0f / (sigma_luminance * std::sqrt(v_in[p]) + 1e-6f);
+		bool has_normal = gp.normal != vec3(0);
+
+		vec3 c_sum = vec3(0);
+		float v_sum = 0, w_sum = 0;
+		for (int ky = -2; ky <= 2; ky++) {
+			int qy = y + ky * step;
+			if (qy < 0 || qy >= height) continue;
+			for (int kx = -2; kx <= 2; kx++) {
+				int qx = x + kx * step;
+				if (qx < 0 || qx >= width) continue;
+				uint32_t q = qy * width + qx;
+				const Guide& gq = guides[q];
+				if (!gq.valid) continue;
+
+				float w = kernel[std::abs(kx)] * kernel[std::abs(ky)];
+				if (q != p) {
+					// escaped and hit pixels never mix
+					if ((gp.depth == INF) != (gq.depth == INF)) continue;
+					float e = std::abs(lum[q] - l_p) * l_scale;
+					if (gp.depth != INF) {
+						float expected = std::abs(dot(gp.depth_gradient, vec2(kx * step, ky * step)));
+						e += std::abs(gp.depth - gq.depth)
+							/ (sigma_depth * expected + DENOISER_DEPTH_TOLERANCE * gp.depth + 1e-6f);
+					}
+					// (the weight would round to 0 anyway, so skip the rest)
+					if (e > DENOISER_MAX_EXPONENT) continue;
+					if (has_normal && gq.normal != vec3(0)) {
+						// cos^sigma_normal, as part of the one exp below. -log(cos) is about 1 - cos where it matters
+						// (any further apart and the weight is 0 either way), and saves a log per tap
+						float cos_n = dot(gp.normal, gq.normal);
+						if (cos_n <= 0) continue;
+						e += sigma_normal * (1 - cos_n);
+					}
+					w *= std::exp(-e);
+				}
+				c_sum += w * c_in[q];
+				v_sum += w * w * v_in[q];
+				w_sum += w;
+			}
+		}
+		// (the center itself always has some weight)
+		c_out[p] = c_sum / w_sum;
+		v_out[p] = v_sum / (w_sum * w_sum);
+	}
+}
+
+}
+
+void Denoiser::run(const Film& film, std::vector<vec3>& output) const {
+	int width = film.width, height = film.height;
+	uint32_t num_pixels = width * height;
+	std::vector<Guide> guides(num_pixels);
+	std::vector<vec3> color[2] = { std::vector<vec3>(num_pixels), std::vector<vec3>(num_pixels) };
+	std::vector<float> variance[2] = { std::vector<float>(num_pixels), std::vector<float>(num_pixels) };
+	std::vector<float> lum(num_pixels);
+	auto for_rows = [](int num_rows, const std::function<void(int)>& row) {
+		myn::jobs::parallel_for(0, num_rows, DENOISER_GRAIN_ROWS, [&](uint32_t first, uint32_t last) {
+			for (uint32_t y = first; y < last; y++) row(int(y));
+		});
+	};
+
+	// demodulate, and estimate each pixel's variance (of its luminance) from the difference of its two half estimates.
+	// Those need at least one sample each; -1 for now otherwise
+	for_rows(height, [&](int y) {
+		for (uint32_t i = y * width; i < (y + 1) * width; i++) {
+			Guide& g = guides[i];
+			uint32_t n = film.num_samples[i];
+			g.valid = n > 0;
+			g.albedo = vec3(1);
+			g.normal = vec3(0);
+			g.depth = INF;
+			color[0][i] = vec3(0);
+			variance[0][i] = -1;
+			if (!g.valid) continue;
+			vec3 albedo = film.albedo[i] / float(n);
+			for (int c = 0; c < 3; c++) {
+				if (albedo[c] > DENOISER_ALBEDO_EPSILON) g.albedo[c] = albedo[c];
+			}
+			if (dot(film.normal[i], film.normal[i]) > 0) g.normal = normalize(film.normal[i]);
+			g.depth = film.depth[i];
+			color[0][i] = film.mean(i) / g.albedo;
+			if (n >= 2) {
+				uint32_t n_even = (n + 1) / 2; // sample indices start at 0
+				vec3 even = film.sum_even[i] / float(n_even) / g.albedo;
+				vec3 odd = (film.sum[i] - film.sum_even[i]) / float(n - n_even) / g.albedo;
+				float d = luminance(even) - luminance(odd);
+				variance[0][i] = d * d * 0.25f;
+			}
+		}
+	});
+
+	// depth gradients, each from the neighbor closer in depth on either side, so that silhouettes don't count as slopes.
+	// And the variance estimates are noisy themselves: blur them over 3x3, or with too few samples, take the spatial
+	// variance over 3x3 instead
+	for_rows(height, [&](int y) {
+		for (int x = 0; x < width; x++) {
+			uint32_t i = y * width + x;
+			Guide& g = guides[i];
+			g.depth_gradient = vec2(0);
+			variance[1][i] = 0;
+			if (!g.valid) continue;
+
+			auto slope = [&](int dx, int dy) {
+				float best = INF;
+				for (int s = -1; s <= 1; s += 2) {
+					int nx = x + s * dx, ny = y + s * dy;
+					if (nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+					const Guide& neighbor = guides[ny * width + nx];
+					if (!neighbor.valid || neighbor.depth == INF) continue;
+					float d = (neighbor.depth - g.depth) * float(s);
+					if (std::abs(d) < std::abs(best)) best = d;
+				}
+				return best == INF ? 0.0f : best;
+			};
+			if (g.depth != INF) g.depth_gradient = vec2(slope(1, 0), slope(0, 1));
+
+			bool known = variance[0][i] >= 0;
+			float sum = 0, sum_sq = 0, w_sum = 0;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					int nx = x + dx, ny = y + dy;
+					if (nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+					uint32_t j = ny * width + nx;
+					if (!guides[j].valid) continue;
+					if (known) {
+						if (variance[0][j] < 0) continue;
+						float w = float((2 - std::abs(dx)) * (2 - std::abs(dy)));
+						sum += w * variance[0][j];
+						w_sum += w;
+					} else {
+						float l = luminance(color[0][j]);
+						sum += l;
+						sum_sq += l * l;
+						w_sum += 1;
+					}
+				}
+			}
+			if (known) variance[1][i] = sum / w_sum;
+			else variance[1][i] = std::max(0.0f, sum_sq / w_sum - (sum / w_sum) * (sum / w_sum));
+		}
+	});
+	std::swap(variance[0], variance[1]);
+
+	for (int iteration = 0; iteration < iterations; iteration++) {
+		int step = 1 << iteration;
+		const std::vector<vec3>& c_in = color[iteration & 1];
+		const std::vector<float>& v_in = variance[iteration & 1];
+		std::vector<vec3>& c_out = color[(iteration + 1) & 1];
+		std::vector<float>& v_out = variance[(iteration + 1) & 1];
+		for_rows(height, [&](int y) {
+			for (uint32_t i = y * width; i < (y + 1) * width; i++) lum[i] = luminance(c_in[i]);
+		});
+		for_rows(height, [&](int y) {
+			filter_row(y, step, width, height, guides.data(), lum.data(), c_in.data(), v_in.data(),
+					   c_out.data(), v_out.data(), sigma_luminance, sigma_normal, sigma_depth);
+		});
+	}
+
+	// remodulate
+	const std::vector<vec3>& result = color[iterations > 0 ? iterations & 1 : 0];
+	output.resize(num_pixels);
+	for_rows(height, [&](int y) {
+		for (uint32_t i = y * width; i < (y + 1) * width; i++) {
+			output[i] = guides[i].valid ? result[i] * guides[i].albedo : vec3(0);
+		}
+	});
+}
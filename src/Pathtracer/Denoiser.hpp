@@ -0,0 +1,23 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+
+struct Film;
+
+// edge-avoiding a-trous wavelet filter for renders with few samples per pixel (Dammertz et al. 2010), with the
+// variance guided luminance weight of SVGF (Schied et al. 2017). Iteration i blurs with a 5x5 B3 spline kernel whose
+// taps are 2^i pixels apart, so 5 iterations reach 62 pixels out at 25 taps per pixel each. A tap gets less weight
+// the more its first hit's depth and normal differ from the center's, and the more its luminance differs than the
+// noise at the center would explain.
+// What gets filtered is irradiance (the mean divided by the first hit's albedo); the albedo gets multiplied back in
+// afterwards, so textures stay as sharp as the first hit sees them. Needs the film's AOVs.
+struct Denoiser {
+	int iterations = 5;
+	float sigma_luminance = 4.0f; // in standard deviations of the center's noise
+	float sigma_normal = 128.0f; // exponent on the cosine between the normals
+	float sigma_depth = 1.0f; // in multiples of the depth difference the center's depth gradient predicts
+
+	// filters the film's means into output (resized to width * height). Rows are spread over the job system
+	void run(const Film& film, std::vector<glm::vec3>& output) const;
+};
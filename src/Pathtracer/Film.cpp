@@ -0,0 +1,173 @@
+#include "Film.hpp"
+#include "Utils/myn/Misc.h"
+#include "Utils/myn/Log.h"
+#include <tinyexr/tinyexr.h>
+#include <algorithm>
+#include <map>
+#include <cstring>
+
+// keeps relative error of near black pixels from blowing up
+#define FILM_ERROR_LUMINANCE_FLOOR 0.02f
+
+using namespace glm;
+
+namespace {
+inline float luminance(const vec3& c) {
+	return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+}
+
+void Film::resize(uint32_t _width, uint32_t _height, bool with_aovs) {
+	width = _width;
+	height = _height;
+	sum.resize(width * height);
+	sum_even.resize(width * height);
+	num_samples.resize(width * height);
+	has_aovs = with_aovs;
+	uint32_t aov_size = has_aovs ? width * height : 0;
+	albedo.resize(aov_size);
+	normal.resize(aov_size);
+	direct.resize(aov_size);
+	depth.resize(aov_size);
+	clear();
+}
+
+void Film::clear() {
+	std::fill(sum.begin(), sum.end(), vec3(0));
+	std::fill(sum_even.begin(), sum_even.end(), vec3(0));
+	std::fill(num_samples.begin(), num_samples.end(), 0);
+	std::fill(albedo.begin(), albedo.end(), vec3(0));
+	std::fill(normal.begin(), normal.end(), vec3(0));
+	std::fill(direct.begin(), direct.end(), vec3(0));
+	std::fill(depth.begin(), depth.end(), INF);
+	denoised.clear();
+}
+
+uint64_t Film::total_samples() const {
+	uint64_t total = 0;
+	for (uint32_t n : num_samples) total += n;
+	return total;
+}
+
+uint32_t Film::max_samples() const {
+	uint32_t result = 0;
+	for (uint32_t n : num_samples) result = std::max(result, n);
+	return result;
+}
+
+float Film::relative_error(uint32_t pixel) const {
+	uint32_t n = num_samples[pixel];
+	if (n < 2) return INF;
+	uint32_t n_even = (n + 1) / 2; // sample indices start at 0
+	vec3 even = clamp(sum_even[pixel] / float(n_even), vec3(0), vec3(1));
+	vec3 odd = clamp((sum[pixel] - sum_even[pixel]) / float(n - n_even), vec3(0), vec3(1));
+	vec3 all = clamp(mean(pixel), vec3(0), vec3(1));
+	return std::abs(luminance(even) - luminance(odd)) / (luminance(all) + FILM_ERROR_LUMINANCE_FLOOR);
+}
+
+vec3 Film::to_display(const vec3& radiance) {
+	const vec3 gamma(0.455f);
+	return pow(clamp(radiance, vec3(0), vec3(1)), gamma);
+}
+
+void Film::resolve_rgba8(uint8_t* rgba) const {
+	for (uint32_t i = 0; i < width * height; i++) {
+		vec3 c = to_display(resolved(i));
+		rgba[4 * i] = uint8_t(c.r * 255.0f);
+		rgba[4 * i + 1] = uint8_t(c.g * 255.0f);
+		rgba[4 * i + 2] = uint8_t(c.b * 255.0f);
+		rgba[4 * i + 3] = 255;
+	}
+}
+
+void Film::resolve_heatmap_rgba8(uint8_t* rgba) const {
+	// roughly inferno
+	const vec3 stops[] = { {0, 0, 0}, {0.25f, 0.04f, 0.45f}, {0.7f, 0.2f, 0.35f}, {0.98f, 0.55f, 0.04f}, {0.99f, 1, 0.64f} };
+	const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+	float scale = 1.0f / float(std::max(1u, max_samples()));
+	for (uint32_t i = 0; i < width * height; i++) {
+		float t = float(num_samples[i]) * scale * last;
+		int k = std::min(int(t), last - 1);
+		vec3 c = mix(stops[k], stops[k + 1], t - float(k));
+		rgba[4 * i] = uint8_t(c.r * 255.0f);
+		rgba[4 * i + 1] = uint8_t(c.g * 255.0f);
+		rgba[4 * i + 2] = uint8_t(c.b * 255.0f);
+		rgba[4 * i + 3] = 255;
+	}
+}
+
+bool Film::write_exr(const std::string& path, bool half_float, bool with_aovs) const {
+	uint32_t num_pixels = width * height;
+	bool aovs = has_aovs && with_aovs;
+
+	// channel name -> planar data. EXR readers expect channels sorted by name, which std::map takes care of
+	std::map<std::string, std::vector<float>> channels;
+	auto add_vec3 = [&](const std::string& layer, const char* components, auto&& get) {
+		for (int c = 0; c < 3; c++) {
+			std::vector<float>& data = channels[layer + components[c]];
+			data.resize(num_pixels);
+			for (uint32_t i = 0; i < num_pixels; i++) data[i] = get(i)[c];
+		}
+	};
+	// averages over each pixel's samples
+	auto per_sample = [&](const std::vector<vec3>& buffer) {
+		return [&](uint32_t i) { return num_samples[i] ? buffer[i] / float(num_samples[i]) : vec3(0); };
+	};
+
+	add_vec3("", "RGB", [&](uint32_t i) { return resolved(i); });
+	if (aovs) {
+		if (!denoised.empty()) add_vec3("noisy.", "RGB", per_sample(sum));
+		add_vec3("albedo.", "RGB", per_sample(albedo));
+		add_vec3("N.", "XYZ", [&](uint32_t i) { return dot(normal[i], normal[i]) > 0 ? normalize(normal[i]) : vec3(0); });
+		add_vec3("direct.", "RGB", per_sample(direct));
+		add_vec3("indirect.", "RGB", [&](uint32_t i) {
+			return num_samples[i] ? (sum[i] - direct[i]) / float(num_samples[i]) : vec3(0);
+		});
+		channels["Z"] = depth;
+		std::vector<float>& samples = channels["samples.Y"];
+		samples.resize(num_pixels);
+		for (uint32_t i = 0; i < num_pixels; i++) samples[i] = float(num_samples[i]);
+	}
+
+	std::vector<EXRChannelInfo> infos(channels.size());
+	std::vector<int> pixel_types(channels.size(), TINYEXR_PIXELTYPE_FLOAT);
+	std::vector<int> requested_types(channels.size(), half_float ? TINYEXR_PIXELTYPE_HALF : TINYEXR_PIXELTYPE_FLOAT);
+	std::vector<unsigned char*> planes;
+	for (auto& pair : channels) {
+		EXRChannelInfo& info = infos[planes.size()];
+		memset(&info, 0, sizeof(info));
+		strncpy(info.name, pair.first.c_str(), 255);
+		planes.push_back(reinterpret_cast<unsigned char*>(const_cast<float*>(pair.second.data())));
+	}
+	// depth and sample counts need the precision
+	if (aovs) {
+		for (size_t c = 0; c < infos.size(); c++) {
+			std::string name = infos[c].name;
+			if (name == "Z" || name == "samples.Y") requested_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+		}
+	}
+
+	EXRHeader header;
+	InitEXRHeader(&header);
+	header.num_channels = int(infos.size());
+	header.channels = infos.data();
+	header.pixel_types = pixel_types.data();
+	header.requested_pixel_types = requested_types.data();
+	header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+	EXRImage image;
+	InitEXRImage(&image);
+	image.num_channels = int(planes.size());
+	image.images = planes.data();
+	image.width = int(width);
+	image.height = int(height);
+
+	const char* err = nullptr;
+	int result = SaveEXRImageToFile(&image, &header, path.c_str(), &err);
+	if (result != TINYEXR_SUCCESS) {
+		ERR("failed to write %s: %s", path.c_str(), err ? err : "unknown error")
+		if (err) FreeEXRErrorMessage(err);
+		return false;
+	}
+	return true;
+}
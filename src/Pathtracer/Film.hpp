@@ -0,0 +1,70 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+// HDR accumulation of the pathtraced image: per pixel, the sum of all radiance samples so far and their count.
+// Pixels can be refined by any number of passes; 8 bit output is only derived from it (to_display).
+// Each pixel must only be written by one thread at a time, which tiles take care of.
+// Samples with even sample index are also summed separately: two independent half estimates of each pixel,
+// whose difference says how far it is from converging.
+struct Film
+{
+	// with_aovs also allocates the buffers of add_aovs
+	void resize(uint32_t _width, uint32_t _height, bool with_aovs = false);
+	void clear();
+
+	void add_samples(uint32_t pixel, const glm::vec3& radiance_sum, const glm::vec3& even_sum, uint32_t count) {
+		sum[pixel] += radiance_sum;
+		sum_even[pixel] += even_sum;
+		num_samples[pixel] += count;
+	}
+	// per sample data of the first hit, summed over the same samples as add_samples (except for depth)
+	void add_aovs(uint32_t pixel, const glm::vec3& albedo_sum, const glm::vec3& normal_sum,
+				  const glm::vec3& direct_sum, float min_depth) {
+		albedo[pixel] += albedo_sum;
+		normal[pixel] += normal_sum;
+		direct[pixel] += direct_sum;
+		depth[pixel] = std::min(depth[pixel], min_depth);
+	}
+	glm::vec3 mean(uint32_t pixel) const {
+		return num_samples[pixel] ? sum[pixel] / float(num_samples[pixel]) : glm::vec3(0);
+	}
+	// what gets output: the denoised pixel if there is one, else the mean
+	glm::vec3 resolved(uint32_t pixel) const {
+		return denoised.empty() ? mean(pixel) : denoised[pixel];
+	}
+	uint64_t total_samples() const;
+	uint32_t max_samples() const;
+	// difference of the two half estimates relative to the mean, in displayed (clamped) luminance.
+	// INF until both halves have samples
+	float relative_error(uint32_t pixel) const;
+
+	// clamped to [0, 1] and gamma corrected
+	static glm::vec3 to_display(const glm::vec3& radiance);
+	// the whole image as 8 bit RGBA
+	void resolve_rgba8(uint8_t* rgba) const;
+	// samples per pixel as 8 bit RGBA, from black (none) to yellow (max_samples)
+	void resolve_heatmap_rgba8(uint8_t* rgba) const;
+	// linear RGB, plus the AOV layers if there are any and with_aovs (and then the noisy means as noisy.RGB too,
+	// if denoised). Returns false on failure
+	bool write_exr(const std::string& path, bool half_float, bool with_aovs = true) const;
+
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::vector<glm::vec3> sum;
+	std::vector<glm::vec3> sum_even;
+	std::vector<uint32_t> num_samples;
+
+	// AOVs, empty unless resized with them
+	bool has_aovs = false;
+	std::vector<glm::vec3> albedo; // of the first hit's BSDF; 0 where the camera ray escaped
+	std::vector<glm::vec3> normal; // world space, of the first hit
+	std::vector<glm::vec3> direct; // what the first hit emits or gets through direct lighting, or the sky behind
+	std::vector<float> depth; // distance to the nearest first hit, INF if none
+
+	// the Denoiser's output, empty unless it ran since the last clear
+	std::vector<glm::vec3> denoised;
+};
@@ -0,0 +1,262 @@
+#include "LightBVH.hpp"
+#include "PathtracerLight.hpp"
+#include "Utils/myn/Log.h"
+#include "Utils/myn/Timer.h"
+#include <algorithm>
+#include <cmath>
+
+// the largest float below 1
+#define ONE_MINUS_EPSILON 0x1.fffffep-1f
+
+using namespace glm;
+
+namespace {
+
+inline float safe_sqrt(float x) { return std::sqrt(std::max(0.0f, x)); }
+inline float safe_acos(float x) { return std::acos(clamp(x, -1.0f, 1.0f)); }
+
+// cos(max(0, a - b)) and sin(max(0, a - b)), from the sines and cosines of a and b
+inline float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+	if (cos_a > cos_b) return 1;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+inline float sin_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+	if (cos_a > cos_b) return 0;
+	return sin_a * cos_b - cos_a * sin_b;
+}
+
+// v rotated by angle around the unit vector k (Rodrigues)
+inline vec3 rotate(const vec3& v, const vec3& k, float angle) {
+	float c = std::cos(angle), s = std::sin(angle);
+	return v * c + cross(k, v) * s + k * dot(k, v) * (1.0f - c);
+}
+
+}
+
+void LightBounds::merge(const LightBounds& other) {
+	if (other.power == 0) return;
+	if (power == 0) {
+		*this = other;
+		return;
+	}
+	min = glm::min(min, other.min);
+	max = glm::max(max, other.max);
+	power += other.power;
+	cos_theta_e = std::min(cos_theta_e, other.cos_theta_e);
+
+	// smallest cone around both cones
+	float theta_a = safe_acos(cos_theta_o);
+	float theta_b = safe_acos(other.cos_theta_o);
+	float theta_d = safe_acos(dot(axis, other.axis));
+	if (std::min(theta_d + theta_b, PI) <= theta_a) return;
+	if (std::min(theta_d + theta_a, PI) <= theta_b) {
+		axis = other.axis;
+		cos_theta_o = other.cos_theta_o;
+		return;
+	}
+	float theta_o = (theta_a + theta_d + theta_b) * 0.5f;
+	vec3 k = cross(axis, other.axis);
+	if (theta_o >= PI || dot(k, k) == 0) {
+		cos_theta_o = -1;
+		return;
+	}
+	axis = normalize(rotate(axis, normalize(k), theta_o - theta_a));
+	cos_theta_o = std::cos(theta_o);
+}
+
+float LightBounds::importance(const vec3& p, const vec3& n) const {
+	vec3 pc = centroid();
+	vec3 to_p = p - pc;
+	// (clamped, so that points inside or right next to the bounds don't get all the weight)
+	float d2 = std::max(dot(to_p, to_p), length(max - min) * 0.5f);
+	float dist2 = dot(to_p, to_p);
+	vec3 wi = dist2 > 0 ? to_p / std::sqrt(dist2) : axis;
+
+	// angle between the cone axis and the direction to p, minus how far the cone reaches towards p
+	float cos_theta_w = dot(axis, wi);
+	float sin_theta_w = safe_sqrt(1 - cos_theta_w * cos_theta_w);
+	float sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+	float cos_theta_x = cos_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+	float sin_theta_x = sin_sub_clamped(sin_theta_w, cos_theta_w, sin_theta_o, cos_theta_o);
+
+	// ... minus the angle the bounds subtend, seen from p
+	vec3 half_diagonal = (max - min) * 0.5f;
+	float r2 = dot(half_diagonal, half_diagonal);
+	float cos_theta_b = dist2 < r2 ? -1.0f : safe_sqrt(1 - r2 / dist2);
+	float sin_theta_b = safe_sqrt(1 - cos_theta_b * cos_theta_b);
+	float cos_theta_p = cos_sub_clamped(sin_theta_x, cos_theta_x, sin_theta_b, cos_theta_b);
+	if (cos_theta_p <= cos_theta_e) return 0;
+
+	float result = power * cos_theta_p / d2;
+	if (n != vec3(0)) {
+		float cos_theta_i = std::abs(dot(wi, n));
+		float sin_theta_i = safe_sqrt(1 - cos_theta_i * cos_theta_i);
+		result *= cos_sub_clamped(sin_theta_i, cos_theta_i, sin_theta_b, cos_theta_b);
+	}
+	return std::max(0.0f, result);
+}
+
+float LightBounds::orientation_measure() const {
+	float theta_o = safe_acos(cos_theta_o);
+	float theta_e = safe_acos(cos_theta_e);
+	float theta_w = std::min(theta_o + theta_e, PI);
+	float sin_theta_o = safe_sqrt(1 - cos_theta_o * cos_theta_o);
+	return 2 * PI * (1 - cos_theta_o) + PI / 2 * (2 * theta_w * sin_theta_o - std::cos(theta_o - 2 * theta_w)
+		- 2 * theta_o * sin_theta_o + cos_theta_o);
+}
+
+void LightBVH::clear() {
+	nodes.clear();
+	lights.clear();
+	infinite_lights.clear();
+}
+
+void LightBVH::build(const std::vector<PathtracerLight*>& all_lights) {
+	TIMER_BEGIN
+	clear();
+
+	std::vector<BuildLight> build_lights;
+	for (PathtracerLight* light : all_lights) {
+		LightBounds bounds;
+		if (!light->get_bounds(bounds)) infinite_lights.push_back(light);
+		else if (bounds.power > 0) {
+			build_lights.push_back({uint32_t(lights.size()), bounds});
+			lights.push_back(light);
+		}
+	}
+	if (build_lights.empty()) return;
+
+	nodes.reserve(build_lights.size() * 2 - 1);
+	build_recursive(build_lights.data(), build_lights.data() + build_lights.size());
+
+	// leaves point into lights in the order the build left them in
+	std::vector<PathtracerLight*> ordered(lights.size());
+	uint32_t next = 0;
+	for (Node& node : nodes) {
+		if (!node.is_leaf) continue;
+		ordered[next] = lights[node.index];
+		node.index = next++;
+	}
+	lights = std::move(ordered);
+
+	TIMER_END(duration)
+	TRACE("built light BVH over %zu lights (%zu nodes, %zu infinite lights) in %.1fms",
+		  lights.size(), nodes.size(), infinite_lights.size(), duration * 1000)
+}
+
+uint32_t LightBVH::build_recursive(BuildLight* begin, BuildLight* end) {
+	uint32_t node_index = nodes.size();
+	nodes.emplace_back();
+
+	if (end - begin == 1) {
+		nodes[node_index] = {begin->bounds, begin->light, true};
+		return node_index;
+	}
+
+	LightBounds bounds;
+	vec3 cmin = vec3(INF), cmax = vec3(-INF);
+	for (BuildLight* l = begin; l != end; l++) {
+		bounds.merge(l->bounds);
+		cmin = glm::min(cmin, l->bounds.centroid());
+		cmax = glm::max(cmax, l->bounds.centroid());
+	}
+
+	// cheapest bucket boundary over all 3 axes, charging each side its power * orientation measure * surface area.
+	// Splits across the short sides of a box get charged more, so that thin boxes still get cut across their length
+	float best_cost = INF;
+	int best_axis = -1, best_split = 0;
+	vec3 diagonal = bounds.max - bounds.min;
+	float max_extent = std::max(diagonal.x, std::max(diagonal.y, diagonal.z));
+	auto surface_area = [](const LightBounds& b) {
+		vec3 d = glm::max(vec3(0), b.max - b.min);
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	};
+	auto bucket_of = [&](const BuildLight& l, int axis) {
+		float k = LIGHT_BVH_NUM_BUCKETS * (1.0f - 1e-5f) / (cmax[axis] - cmin[axis]);
+		return glm::min(LIGHT_BVH_NUM_BUCKETS - 1, int((l.bounds.centroid()[axis] - cmin[axis]) * k));
+	};
+	for (int axis = 0; axis < 3; axis++) {
+		if (cmax[axis] == cmin[axis]) continue;
+		LightBounds buckets[LIGHT_BVH_NUM_BUCKETS];
+		for (BuildLight* l = begin; l != end; l++) buckets[bucket_of(*l, axis)].merge(l->bounds);
+
+		LightBounds right[LIGHT_BVH_NUM_BUCKETS];
+		for (int i = LIGHT_BVH_NUM_BUCKETS - 1; i > 0; i--) {
+			right[i] = buckets[i];
+			if (i < LIGHT_BVH_NUM_BUCKETS - 1) right[i].merge(right[i + 1]);
+		}
+		float k_r = diagonal[axis] > 0 ? max_extent / diagonal[axis] : 1;
+		LightBounds left;
+		for (int i = 1; i < LIGHT_BVH_NUM_BUCKETS; i++) {
+			left.merge(buckets[i - 1]);
+			if (left.power == 0 || right[i].power == 0) continue;
+			float cost = k_r * (left.power * left.orientation_measure() * surface_area(left)
+				+ right[i].power * right[i].orientation_measure() * surface_area(right[i]));
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_split = i;
+			}
+		}
+	}
+
+	BuildLight* mid;
+	if (best_axis >= 0) {
+		mid = std::partition(begin, end, [&](const BuildLight& l) { return bucket_of(l, best_axis) < best_split; });
+	} else {
+		// all at one spot, any halves will do
+		mid = begin + (end - begin) / 2;
+	}
+
+	build_recursive(begin, mid);
+	uint32_t second = build_recursive(mid, end);
+	nodes[node_index] = {bounds, second, false};
+	return node_index;
+}
+
+float LightBVH::infinite_light_pmf() const {
+	return 1.0f / float(infinite_lights.size() + (nodes.empty() ? 0 : 1));
+}
+
+bool LightBVH::sample(const vec3& p, const vec3& n, float u, PathtracerLight*& light, float& pmf) const {
+	// infinite lights get one share each, the whole tree gets one more
+	uint32_t num_choices = infinite_lights.size() + (nodes.empty() ? 0 : 1);
+	if (num_choices == 0) return false;
+	float p_infinite = float(infinite_lights.size()) / float(num_choices);
+	if (u < p_infinite) {
+		uint32_t i = std::min(uint32_t(u * num_choices), uint32_t(infinite_lights.size()) - 1);
+		light = infinite_lights[i];
+		pmf = 1.0f / float(num_choices);
+		return true;
+	}
+	if (nodes.empty()) return false;
+	u = std::min((u - p_infinite) / (1 - p_infinite), ONE_MINUS_EPSILON);
+
+	// walk down, reusing u for each choice
+	pmf = 1 - p_infinite;
+	uint32_t node_index = 0;
+	for (;;) {
+		const Node& node = nodes[node_index];
+		if (node.is_leaf) {
+			// (interior nodes already checked this for every leaf below the root)
+			if (node_index > 0 || node.bounds.importance(p, n) > 0) {
+				light = lights[node.index];
+				return true;
+			}
+			return false;
+		}
+		float c0 = nodes[node_index + 1].bounds.importance(p, n);
+		float c1 = nodes[node.index].bounds.importance(p, n);
+		if (c0 == 0 && c1 == 0) return false;
+		float p0 = c0 / (c0 + c1);
+		if (u < p0) {
+			node_index = node_index + 1;
+			u = std::min(u / p0, ONE_MINUS_EPSILON);
+			pmf *= p0;
+		} else {
+			node_index = node.index;
+			u = std::min((u - p0) / (1 - p0), ONE_MINUS_EPSILON);
+			pmf *= 1 - p0;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "Utils/myn/Misc.h"
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+
+class PathtracerLight;
+
+// buckets per axis when looking for the cheapest split
+#define LIGHT_BVH_NUM_BUCKETS 12
+
+// how much a light, or a subtree of lights, could possibly contribute around it: where its emitters are, their total
+// power, and an orientation cone. Emitters face directions within theta_o of axis, and each one's emission falls off
+// to nothing theta_e past its facing direction (so theta_e is pi/2 for diffuse emitters).
+// (Conty Estevez & Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting", 2018)
+struct LightBounds {
+	glm::vec3 min = glm::vec3(INF);
+	glm::vec3 max = glm::vec3(-INF);
+	glm::vec3 axis = glm::vec3(0, 0, 1);
+	float power = 0;
+	float cos_theta_o = 1;
+	float cos_theta_e = 1;
+
+	glm::vec3 centroid() const { return (min + max) * 0.5f; }
+	void merge(const LightBounds& other);
+	// an estimate of (and, within the cones, an upper bound on) what these lights contribute to a point p with normal n.
+	// n = 0 skips the cosine at p
+	float importance(const glm::vec3& p, const glm::vec3& n) const;
+	// how expensive it is to end up sampling a node with these bounds, for the build
+	float orientation_measure() const;
+};
+
+// picks one light for next event estimation with a probability that depends on the shading point, by walking down
+// from the root and choosing either child in proportion to its importance. Lights without a position (directional)
+// aren't in the tree: they're picked uniformly against the tree as a whole.
+struct LightBVH {
+	struct Node {
+		LightBounds bounds;
+		// leaf: index into lights; interior: the second child (the first one is the next node)
+		uint32_t index;
+		bool is_leaf;
+	};
+
+	void build(const std::vector<PathtracerLight*>& all_lights);
+	void clear();
+	bool empty() const { return lights.empty() && infinite_lights.empty(); }
+
+	// u in [0, 1). Returns false if no light can reach p at all
+	bool sample(const glm::vec3& p, const glm::vec3& n, float u, PathtracerLight*& light, float& pmf) const;
+	// probability that sample picks a given infinite light, the same at every point
+	float infinite_light_pmf() const;
+
+	std::vector<Node> nodes;
+	std::vector<PathtracerLight*> lights; // bounded ones, in leaf order
+	std::vector<PathtracerLight*> infinite_lights;
+
+private:
+	struct BuildLight {
+		uint32_t light;
+		LightBounds bounds;
+	};
+	uint32_t build_recursive(BuildLight* begin, BuildLight* end);
+};
@@ -7,12 +7,11 @@
 #include "Assets/ConfigAsset.hpp"
 #include "Render/Materials/GltfMaterialInfo.h"
 #include "CpuSkyAtmosphere/CpuSkyAtmosphere.h"
+#include "Utils/myn/JobSystem.h"
 #include <stack>
 #include <unordered_map>
 #include <chrono>
-#include <thread>
 #include <atomic>
-#include <condition_variable>
 #if GRAPHICS_DISPLAY
 #include <imgui.h>
 #include "Render/Vulkan/VulkanUtils.h"
@@ -27,25 +26,6 @@
 #include "Assets/SceneAsset.h"
 #include "Scene/SkyAtmosphere/SkyAtmosphere.h"
 
-struct RaytraceThread {
-
-	enum Status { uninitialized, working, pending_upload, uploaded, ready_for_next, all_done };
-	
-	RaytraceThread(std::function<void(int)> work, int _tid) : tid(_tid) {
-		thread = std::thread(work, _tid);
-	}
-
-	std::atomic<int> tid = 0;
-	std::thread thread{};
-	std::mutex m{};
-	std::condition_variable cv{};
-
-	std::atomic<bool> finished = true;
-	std::atomic<Status> status = uninitialized;
-	int tile_index = -1; // protected by m just like the tile buffer
-
-};
-
 Pathtracer::Pathtracer(uint32_t _width, uint32_t _height) {
 
 	width = _width;
@@ -70,15 +50,18 @@ Pathtracer::~Pathtracer() {
 #endif
 
 	delete image_buffer;
-	for (uint32_t i=0; i<cached_config.NumThreads; i++) {
+	for (uint32_t i=0; i<num_subimage_buffers; i++) {
 		delete subimage_buffers[i];
 	}
 	delete subimage_buffers;
 
 	for (auto l : lights) delete l.light;
-	for (auto t : primitives) delete t;
 
-	delete bvh;
+	delete scene_bvh;
+#if ISPC
+	delete ispc_bvh;
+#endif
+	delete sampler;
 
 	delete cpuSky;
 
@@ -102,46 +85,6 @@ void Pathtracer::initialize() {
 	});
 #endif
 
-	// scene
-	reload_scene(drawable);
-
-	// define thread work lambda
-	raytrace_task = [this](int tid)
-	{
-		while (true)
-		{
-			// What can cause this line to hit EXEC_BAD_ACCESS?
-			std::unique_lock<std::mutex> lock(threads[tid]->m);
-
-			// wait until main thread says it's okay to keep working (or okay to quit)
-			threads[tid]->cv.wait(lock, [this, tid] {
-				return threads[tid]->status == RaytraceThread::ready_for_next
-				|| threads[tid]->status == RaytraceThread::all_done;
-			});
-
-			// try to get next tile to work on
-			uint32_t tile;
-			if (raytrace_tasks.dequeue(tile))
-			{
-				threads[tid]->status = RaytraceThread::working;
-				threads[tid]->tile_index = tile;
-				raytrace_tile(tid, tile);
-				if (threads[tid]->status == RaytraceThread::all_done) {// modified by main thread while working
-					//LOG("%d: notified to quit early while working", tid)
-					break;
-				} else {
-					threads[tid]->status = RaytraceThread::pending_upload;
-				}
-			}
-			else
-			{
-				//LOG("%d: quit bc no more work to do", tid)
-				threads[tid]->status = RaytraceThread::all_done;
-				break;
-			}
-		}
-	};
-
 #if GRAPHICS_DISPLAY
 	// graphics api stuff
 	ImageCreator windowSurfaceCreator(
@@ -170,20 +113,27 @@ void Pathtracer::initialize() {
 
 	config = new ConfigAsset("config/pathtracer.ini", true, [this](const ConfigAsset* cfg) {
 
-		uint32_t old_num_threads = cached_config.NumThreads;
-
 		// read from file
 #if ISPC
 		cached_config.ISPC = cfg->lookup<int>("ISPC");
 #endif
 		cached_config.UseBVH = cfg->lookup<int>("UseBVH");
+		cached_config.BVHMaxLeafSize = cfg->lookup<int>("BVHMaxLeafSize");
+		cached_config.UseWideBVH = cfg->lookup<int>("UseWideBVH");
+		cached_config.BVHSpatialSplits = cfg->lookup<int>("BVHSpatialSplits");
+		cached_config.BVHMaxDuplication = cfg->lookup<float>("BVHMaxDuplication");
 
 		cached_config.Multithreaded = cfg->lookup<int>("Multithreaded");
-		cached_config.NumThreads = cfg->lookup<int>("NumThreads");
+		// (there'd be no job system thread besides this one to hand tiles to)
+		if (myn::jobs::num_threads() == 1) cached_config.Multithreaded = 0;
 		cached_config.TileSize = cfg->lookup<int>("TileSize");
+		cached_config.Integrator = cfg->lookup<int>("Integrator");
+		cached_config.PacketCameraRays = cfg->lookup<int>("PacketCameraRays");
 
 		cached_config.UseDirectLight = cfg->lookup<int>("UseDirectLight");
 		cached_config.DirectLightSamples = cfg->lookup<int>("DirectLightSamples");
+		cached_config.SkyCacheResolution = cfg->lookup<int>("SkyCacheResolution");
+		cached_config.LightSampler = cfg->lookup<int>("LightSampler");
 
 		cached_config.UseJitteredSampling = cfg->lookup<int>("UseJitteredSampling");
 		cached_config.UseDOF = cfg->lookup<int>("UseDOF");
@@ -194,6 +144,16 @@ void Pathtracer::initialize() {
 		cached_config.RussianRouletteThreshold = cfg->lookup<float>("RussianRouletteThreshold");
 
 		cached_config.MinRaysPerPixel = cfg->lookup<int>("MinRaysPerPixel");
+		cached_config.Sampler = cfg->lookup<int>("Sampler");
+		cached_config.AdaptiveSampling = cfg->lookup<int>("AdaptiveSampling");
+		cached_config.AdaptiveThreshold = cfg->lookup<float>("AdaptiveThreshold");
+		cached_config.AdaptiveMinSamples = cfg->lookup<int>("AdaptiveMinSamples");
+
+		cached_config.Denoise = cfg->lookup<int>("Denoise");
+		cached_config.DenoiseIterations = cfg->lookup<int>("DenoiseIterations");
+		cached_config.DenoiseSigmaLuminance = cfg->lookup<float>("DenoiseSigmaLuminance");
+		cached_config.DenoiseSigmaNormal = cfg->lookup<float>("DenoiseSigmaNormal");
+		cached_config.DenoiseSigmaDepth = cfg->lookup<float>("DenoiseSigmaDepth");
 
 		// initialization related to config options
 
@@ -205,26 +165,43 @@ void Pathtracer::initialize() {
 		clear_tasks_and_threads_begin();
 		clear_tasks_and_threads_wait();
 #endif
+		// (no workers are running now)
+		raytrace_tasks.reserve(tiles_X * tiles_Y);
+#if GRAPHICS_DISPLAY
+		completed_tiles.reserve(tiles_X * tiles_Y);
+#endif
 
 		// cpu buffers
 		delete image_buffer;
 		if (subimage_buffers /* not null if it's previously created at least once */) {
-			for (uint32_t i=0; i<old_num_threads; i++) {
+			for (uint32_t i=0; i<num_subimage_buffers; i++) {
 				delete subimage_buffers[i];
 			}
 			delete subimage_buffers;
 		}
 		image_buffer = new unsigned char[width * height * PATHTRACER_OUT_NUM_CHANNELS * PATHTRACER_OUT_SIZE_PER_CHANNEL];
-		subimage_buffers = new unsigned char*[cached_config.NumThreads];
-		for (int i=0; i<cached_config.NumThreads; i++) {
+#if GRAPHICS_DISPLAY
+		film.resize(width, height);
+#else
+		// (the denoiser is guided by the AOVs)
+		film.resize(width, height, exr_aovs || denoise_enabled());
+#endif
+		num_subimage_buffers = myn::jobs::num_threads();
+		subimage_buffers = new unsigned char*[num_subimage_buffers];
+		for (int i=0; i<num_subimage_buffers; i++) {
 			subimage_buffers[i] = new unsigned char[
 			cached_config.TileSize * cached_config.TileSize * PATHTRACER_OUT_NUM_CHANNELS *PATHTRACER_OUT_SIZE_PER_CHANNEL];
 		}
+		wavefront_batches.resize(myn::jobs::num_threads());
+		ray_counters.resize(myn::jobs::num_threads());
 
 		// queue tasks, spawn threads, etc.
 		reset();
 	});
 
+	// scene (after config is loaded, since building the BVH depends on it)
+	reload_scene(drawable);
+
 #if GRAPHICS_DISPLAY
 	initialized = true;
 #endif
@@ -238,11 +215,16 @@ BSDF *Pathtracer::get_or_create_mesh_bsdf(const std::string &materialName)
 
 	if (iter != BSDFs.end()) {
 		auto pooled_bsdf = iter->second;
-		if (pooled_bsdf->asset_version == info->_version) {
-			return pooled_bsdf;
-		} else {
-			delete pooled_bsdf;
+		if (pooled_bsdf->asset_version != info->_version) {
+			// material-only change: update it in place, so the scene can keep pointing at it.
+			// (the type only depends on the name, which is the same)
+			if (pooled_bsdf->type == BSDF::Diffuse) {
+				pooled_bsdf->albedo = info->BaseColorFactor * 0.8f;
+			}
+			pooled_bsdf->set_emission(info->EmissiveFactor);
+			pooled_bsdf->asset_version = info->_version;
 		}
+		return pooled_bsdf;
 	}
 
 	// create a new one
@@ -268,22 +250,28 @@ BSDF *Pathtracer::get_or_create_mesh_bsdf(const std::string &materialName)
 }
 
 void Pathtracer::reload_scene(SceneObject *scene) {
+#if GRAPHICS_DISPLAY
+	// lights, BSDFs and the scene BVH are changed in place or deleted below
+	ASSERT_M(raytrace_workers.done(), "reloading the scene while tile workers are running")
+#endif
+	TIMER_BEGIN
 
-	primitives.clear();
+	light_bvh.clear();
+	for (auto& l : lights) delete l.light;
 	lights.clear();
 
-	// also delete BSDF library
-	for (auto& pair : BSDFs) {
-		delete pair.second;
-	}
-	BSDFs.clear();
-
-	delete bvh;
-	bvh = new BVH(&primitives, 0);
+#if ISPC
+	delete ispc_bvh;
+	ispc_bvh = nullptr;
+	ispc_triangles.clear();
+#endif
 
+	// BSDFs are kept across reloads (get_or_create_mesh_bsdf updates changed ones in place)
+	std::vector<MeshInstanceDesc> mesh_instances;
 	int meshes_count = 0;
 	float light_power_sum = 0;
 	PathtracerDirectionalLight* foundSun = nullptr;
+	bool found_sky = false, sky_changed = false;
 	scene->foreach_descendent_bfs([&](SceneObject* drawable)
 	{
 		if (auto* mo = dynamic_cast<MeshObject*>(drawable)) {
@@ -292,23 +280,8 @@ void Pathtracer::reload_scene(SceneObject *scene) {
 			mo->bsdf = bsdf;
 			meshes_count++;
 
-			bool emissive = mo->bsdf->is_emissive;
-			for (int i=0; i < mo->mesh->get_num_indices(); i+=3) {
-				// loop and load triangles
-				Vertex v1 = mo->mesh->get_vertices()[mo->mesh->get_indices()[i]];
-				Vertex v2 = mo->mesh->get_vertices()[mo->mesh->get_indices()[i + 1]];
-				Vertex v3 = mo->mesh->get_vertices()[mo->mesh->get_indices()[i + 2]];
-				auto* T = new Triangle(mo->object_to_world(), v1, v2, v3, mo->bsdf);
-				auto* P = static_cast<Primitive*>(T);
-				primitives.push_back(P);
-
-				// also load as light if emissive
-				if (emissive) {
-					auto L = new PathtracerMeshLight(T);
-					float w = L->get_weight();
-					light_power_sum += w;
-					lights.push_back( {static_cast<PathtracerLight*>(L), w} );
-				}
+			if (mo->mesh->get_num_indices() >= 3) {
+				mesh_instances.push_back({mo->mesh, bsdf, mo->object_to_world()});
 			}
 		}
 		else if (auto* plight = dynamic_cast<PointLight*>(drawable)) {
@@ -330,25 +303,81 @@ void Pathtracer::reload_scene(SceneObject *scene) {
 		}
 		else if (auto* sky = dynamic_cast<SkyAtmosphere*>(drawable)) {
 			if (sky->enabled() && sky->getSun()) {
-				cpuSky = new myn::sky::CpuSkyAtmosphere();
-				cpuSky->renderingParams.dir2sun = -sky->getSun()->getLightDirection();
-				cpuSky->renderingParams.cameraPosWS = camera->world_position();
-				cpuSky->updateLuts();
-				TRACE("created CPU sky")
+				found_sky = true;
+				vec3 dir2sun = -sky->getSun()->getLightDirection();
+				vec3 camera_position = camera->world_position();
+				// (the sky barely changes as the camera moves sideways, so only its altitude counts)
+				if (!cpuSky || cpuSky->renderingParams.dir2sun != dir2sun
+					|| cpuSky->renderingParams.cameraPosWS.z != camera_position.z) {
+					delete cpuSky;
+					cpuSky = new myn::sky::CpuSkyAtmosphere();
+					cpuSky->renderingParams.dir2sun = dir2sun;
+					cpuSky->renderingParams.cameraPosWS = camera_position;
+					cpuSky->updateLuts();
+					sky_changed = true;
+					TRACE("created CPU sky")
+				}
 			}
 		}
 	});
 
+	if (!found_sky) {
+		delete cpuSky;
+		cpuSky = nullptr;
+		sky_cache.clear();
+	} else if (sky_changed || sky_cache.empty() || sky_cache.get_resolution() != uint32_t(cached_config.SkyCacheResolution)) {
+		sky_cache.build(cpuSky, cached_config.SkyCacheResolution);
+	}
+
 	// if sky atmosphere is created, modify sun somewhat:
 	if (cpuSky) {
 		EXPECT(foundSun != nullptr, true)
 		foundSun->apply_sky(cpuSky);
 	}
 
+	// environment: looked up here once, instead of on every miss
+	environment = nullptr;
+	if (cpuSky) {
+		environment = new PathtracerEnvironmentLight(&sky_cache);
+	} else if (Config->lookup<int>("LoadEnvironmentMap")) {
+		auto envmap = Asset::find<EnvironmentMapAsset>(Config->lookup<std::string>("EnvironmentMap"));
+		if (envmap && !envmap->texels3x32.empty()) {
+			environment = new PathtracerEnvironmentLight(envmap->texels3x32.data(), envmap->width, envmap->height);
+		}
+	}
+	if (environment) {
+		float w = environment->get_weight();
+		light_power_sum += w;
+		lights.push_back( {static_cast<PathtracerLight*>(environment), w} );
+	}
+
+	// a reload often only moved some objects or tweaked materials, which don't need the BVHs rebuilt
+	uint32_t num_moved = 0;
+	bool updated = scene_bvh && scene_bvh->update(mesh_instances, num_moved);
+	if (!updated) {
+		delete scene_bvh;
+		scene_bvh = new SceneBVH();
+		scene_bvh->build(mesh_instances, get_bvh_build_options());
+	}
+
+	// load emissive triangles of every instance as lights (once each, even if a BVH references some of them more than once)
+	for (const MeshInstance& instance : scene_bvh->instances) {
+		if (!instance.bsdf->is_emissive) continue;
+		const TriangleStore& triangles = instance.mesh->triangles;
+		for (uint32_t i = 0; i < triangles.size(); i++) {
+			if (triangles.is_duplicate(i)) continue;
+			auto L = new PathtracerMeshLight(instance.vertex(i, 0), instance.vertex(i, 1), instance.vertex(i, 2), instance.bsdf);
+			float w = L->get_weight();
+			light_power_sum += w;
+			lights.push_back( {static_cast<PathtracerLight*>(L), w} );
+		}
+	}
+
 	// post-process light weights (normalize them)
 	for (int i = 0; i < lights.size(); i++) {
 		float normalized_w = lights[i].cumulative_weight / light_power_sum;
 		lights[i].one_over_pdf = 1.0f / normalized_w;
+		if (lights[i].light == environment) environment_cdf_pmf = normalized_w;
 		if (i == 0) {
 			lights[i].cumulative_weight = normalized_w;
 		} else {
@@ -356,37 +385,66 @@ void Pathtracer::reload_scene(SceneObject *scene) {
 		}
 	}
 
-	bvh->primitives_start = 0;
-	bvh->primitives_count = primitives.size();
-	bvh->update_extents();
-	bvh->expand_bvh();
+	std::vector<PathtracerLight*> all_lights;
+	for (auto& l : lights) all_lights.push_back(l.light);
+	light_bvh.build(all_lights);
 
 	scene_version = get_scene_asset()->get_version();
 
-	TRACE("loaded a scene with %d meshes, %llu triangles, %llu lights",
-		  meshes_count, primitives.size(), lights.size());
+	TIMER_END(duration)
+	if (updated) {
+		TRACE("reloaded scene in %.1fms without rebuilding BVHs (%u of %zu instances moved)",
+			  duration * 1000, num_moved, scene_bvh->instances.size())
+	} else {
+		TRACE("reloaded scene in %.1fms", duration * 1000)
+	}
+
+	TRACE("loaded a scene with %d meshes (%zu unique), %u triangles, %zu lights",
+		  meshes_count, scene_bvh->meshes.size(), scene_bvh->num_instanced_triangles(), lights.size());
+	if (scene_bvh->num_unique_triangles() > 0) {
+		TRACE("scene memory (triangles + BVHs): %.1f MB, %.1f bytes/unique triangle",
+			  scene_bvh->memory_bytes() / 1048576.0f, float(scene_bvh->memory_bytes()) / scene_bvh->num_unique_triangles());
+	}
+}
+
+BVHBuildOptions Pathtracer::get_bvh_build_options() const {
+	BVHBuildOptions options;
+	options.max_leaf_size = cached_config.BVHMaxLeafSize;
+	options.leaf_batch_size = TRIANGLE_STORE_BATCH;
+	options.num_threads = cached_config.Multithreaded ? myn::jobs::num_threads() : 1;
+	options.spatial_splits = cached_config.BVHSpatialSplits;
+	options.max_duplication = cached_config.BVHMaxDuplication;
+	return options;
 }
 
 void Pathtracer::reset() {
 	TRACE("reset pathtracer");
 
+	// before any thread can pick up a tile
+	update_camera_rays();
+	generate_pixel_offsets();
+	delete sampler;
+	sampler = Sampler::create(Sampler::Type(cached_config.Sampler), samples_per_pixel(), width);
+
 	//-------- threading stuff --------
+	// (no workers are running now, so leftovers from an unfinished render can be dropped)
+	raytrace_tasks.clear();
+#if GRAPHICS_DISPLAY
+	completed_tiles.clear();
+#endif
 	if (cached_config.Multithreaded) {
 
-		// enqueue all new tiles
-		for (uint32_t i=0; i < tiles_X * tiles_Y; i++) {
-			raytrace_tasks.enqueue(i);
-		}
-		// spawn new threads to start working on them
-		for (uint32_t i=0; i<cached_config.NumThreads; i++) {
-			threads.push_back(new RaytraceThread(raytrace_task, i));
+		// enqueue all new tiles, along a Hilbert curve so that neighboring threads work on nearby parts of the scene.
+		// (workers start on continue_trace)
+		for (uint32_t i : hilbert_tile_order(tiles_X, tiles_Y)) {
+			EXPECT_M(raytrace_tasks.enqueue(i), true, "tile queue is full")
 		}
 	}
 	//---------------------------------
 	rendered_tiles = 0;
 	cumulative_render_time = 0.0f;
-	generate_pixel_offsets();
 
+	film.clear();
 	memset(image_buffer, 40, width * height * PATHTRACER_OUT_NUM_CHANNELS * PATHTRACER_OUT_SIZE_PER_CHANNEL);
 #if GRAPHICS_DISPLAY
 	paused = true;
@@ -459,6 +517,8 @@ void Pathtracer::pause_trace() {
 	TRACE("rendered %f seconds so far.", cumulative_render_time);
 	notified_pause_finish = false;
 	paused = true;
+	// workers finish the tile they're on, but don't start another
+	if (raytrace_cancel) raytrace_cancel->cancel();
 }
 
 void Pathtracer::continue_trace() {
@@ -468,27 +528,40 @@ void Pathtracer::continue_trace() {
 	if (cached_config.ISPC) {
 		load_ispc_data();
 	}
+	if (cached_config.Multithreaded && !cached_config.ISPC) start_raytrace_workers();
+#else
+	if (cached_config.Multithreaded) start_raytrace_workers();
 #endif
 	paused = false;
 }
 
-void Pathtracer::clear_tasks_and_threads_begin() {
-	if (cached_config.Multithreaded) {
-		raytrace_tasks.clear();
-		for (auto & thread : threads) {
-			thread->status = RaytraceThread::all_done;
-			thread->cv.notify_all();
-		}
+void Pathtracer::start_raytrace_workers() {
+	raytrace_cancel = std::make_shared<myn::jobs::CancellationToken>();
+	// (one less than there are threads: this one keeps drawing frames)
+	uint32_t num_workers = std::max(1u, myn::jobs::num_threads() - 1);
+	for (uint32_t i = 0; i < num_workers; i++) {
+		raytrace_workers.run([this, cancel = raytrace_cancel]() { raytrace_next_tile(cancel); });
 	}
 }
 
+void Pathtracer::raytrace_next_tile(const std::shared_ptr<myn::jobs::CancellationToken>& cancel) {
+	uint32_t tile;
+	if (cancel->cancelled() || !raytrace_tasks.dequeue(tile)) return;
+	raytrace_tile(myn::jobs::thread_index(), tile);
+	// (sized for every tile, and each one is traced once per reset)
+	EXPECT_M(completed_tiles.enqueue(tile), true, "completed tile queue is full")
+	// a task per tile rather than a loop, so the thread goes back to the job system in between and other work gets in
+	raytrace_workers.run([this, cancel]() { raytrace_next_tile(cancel); });
+}
+
+void Pathtracer::clear_tasks_and_threads_begin() {
+	if (raytrace_cancel) raytrace_cancel->cancel();
+	raytrace_tasks.clear();
+}
+
 void Pathtracer::clear_tasks_and_threads_wait() {
-	if (cached_config.Multithreaded) {
-		for (auto & thread : threads) {
-			if (thread->thread.joinable()) thread->thread.join();
-		}
-		threads.clear();
-	}
+	raytrace_workers.wait();
+	completed_tiles.clear();
 }
 
 void Pathtracer::render(VkCommandBuffer cmdbuf)
@@ -496,6 +569,9 @@ void Pathtracer::render(VkCommandBuffer cmdbuf)
 	if (!initialized) initialize();
 
 	if (scene_version != get_scene_asset()->get_version()) {
+		// workers may still be tracing the old scene, which reload_scene changes or deletes
+		clear_tasks_and_threads_begin();
+		clear_tasks_and_threads_wait();
 		reload_scene(drawable);
 		reset();
 	}
@@ -507,41 +583,18 @@ void Pathtracer::render(VkCommandBuffer cmdbuf)
 #endif
 	){
 		if (!finished) {
-			int uploaded_threads = 0;
-			int finished_threads = 0;
-
-			for (uint32_t i=0; i<threads.size(); i++) {
-
-				if (threads[i]->status == RaytraceThread::all_done) {
-					finished_threads++;
-					if (threads[i]->thread.joinable()) threads[i]->thread.join();
-
-				} else if (threads[i]->status == RaytraceThread::pending_upload) {
-					std::lock_guard<std::mutex> lock(threads[i]->m);
-					upload_tile(i, threads[i]->tile_index);
-					threads[i]->status = RaytraceThread::uploaded;
-
-				} else if (threads[i]->status == RaytraceThread::uploaded) {
-					uploaded_threads++;
-					if (!paused) {
-						threads[i]->status = RaytraceThread::ready_for_next;
-						threads[i]->cv.notify_all();
-					}
-
-				} else if (threads[i]->status == RaytraceThread::uninitialized) {
-					if (!paused) {
-						threads[i]->status = RaytraceThread::ready_for_next;
-						threads[i]->cv.notify_all();
-					}
-				}
-
+			// upload whatever the workers finished since last frame; they don't wait for it
+			uint32_t tile;
+			while (completed_tiles.dequeue(tile)) {
+				upload_tile(tile);
+				rendered_tiles++;
 			}
 
-			if (finished_threads == threads.size()) {
+			if (rendered_tiles == tiles_X * tiles_Y) {
 				TRACE("Done!");
 				finished = true;
 				pause_trace();
-			} else if (paused && uploaded_threads == threads.size() && !notified_pause_finish) {
+			} else if (paused && raytrace_workers.done() && completed_tiles.size() == 0 && !notified_pause_finish) {
 				TRACE("pending tiles finished");
 				notified_pause_finish = true;
 			}
@@ -559,7 +612,7 @@ void Pathtracer::render(VkCommandBuffer cmdbuf)
 
 				// TODO: spawn a task to do this instead
 				raytrace_tile(0, rendered_tiles);
-				upload_tile(0, rendered_tiles);
+				upload_tile(rendered_tiles);
 
 				rendered_tiles++;
 			}
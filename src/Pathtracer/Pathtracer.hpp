@@ -1,8 +1,15 @@
 #pragma once
 #include "Utils/myn/Timer.h"
 #include "Utils/myn/ThreadSafeQueue.h"
+#include "Utils/myn/JobSystem.h"
+#include <memory>
 #include "Scene/AABB.hpp"
-#include "BVH.hpp"
+#include "SceneBVH.hpp"
+#include "LightBVH.hpp"
+#include "SkyRadianceCache.hpp"
+#include "Film.hpp"
+#include "TileScheduler.hpp"
+#include "Wavefront.hpp"
 #include "Render/Renderers/Renderer.h"
 #include "Assets/EnvironmentMapAsset.h"
 #include <unordered_map>
@@ -14,9 +21,8 @@
 struct Scene;
 struct Ray;
 struct RayTask;
-struct Primitive;
 struct PathtracerLight;
-struct RaytraceThread;
+class PathtracerEnvironmentLight;
 class Texture2D;
 class DebugLines;
 class ConfigAsset;
@@ -50,6 +56,14 @@ public:
 
 #else
 	void render_to_file(const std::string& output_path_rel_to_bin) override;
+	// render_to_file keeps refining the whole image in passes until every pixel has spp samples, or until
+	// time_limit_seconds ran out. 0 means no such limit; with neither set it does a single pass.
+	void set_render_budget(uint32_t spp, float time_limit_seconds);
+	// for output paths ending in .exr: linear half instead of float, and whether to collect and write the AOV
+	// layers (first hit albedo, normal, depth, direct/indirect, sample count). Call before initialize().
+	void set_exr_options(bool half_float, bool aovs);
+	// denoise the result even if Denoise in pathtracer.ini is off. Call before initialize().
+	void set_denoise(bool enabled);
 
 #endif
 
@@ -63,17 +77,34 @@ private:
 	uint32_t width, height;
 	uint32_t tiles_X, tiles_Y;
 
+	enum IntegratorType {
+		RecursiveIntegrator = 0, // trace_ray, one path at a time
+		WavefrontIntegrator = 1 // batches of paths, a stage at a time (Wavefront.hpp)
+	};
+
+	enum LightSamplerType {
+		CDFLightSampler = 0, // by power alone, from lights
+		BVHLightSampler = 1 // by what each could contribute to the shading point, from light_bvh
+	};
+
 	// store some frequently-accessed configs here to alleviate config lookup cost
 	struct {
 #if ISPC
 		int ISPC = 0;
 #endif
 		int UseBVH = 1;
+		int BVHMaxLeafSize = 8;
+		int UseWideBVH = 1;
+		int BVHSpatialSplits = 0;
+		float BVHMaxDuplication = 0.5f;
 		int Multithreaded = 0; // initially 0 so if set to >0 by config file, will create the threads
-		int NumThreads = 0;
 		int TileSize = 16;
+		int Integrator = RecursiveIntegrator;
+		int PacketCameraRays = 1;
 		int UseDirectLight = 1;
 		int DirectLightSamples = 2;
+		int SkyCacheResolution = 512;
+		int LightSampler = BVHLightSampler;
 		int UseJitteredSampling = 1;
 		int UseDOF = 1;
 		float FocalDistance = 5.0f;
@@ -81,6 +112,15 @@ private:
 		int MaxRayDepth = 16;
 		float RussianRouletteThreshold = 0.05f;
 		int MinRaysPerPixel = 4;
+		int Sampler = Sampler::Sobol;
+		int AdaptiveSampling = 1;
+		float AdaptiveThreshold = 0.05f;
+		int AdaptiveMinSamples = 16;
+		int Denoise = 0;
+		int DenoiseIterations = 5;
+		float DenoiseSigmaLuminance = 4.0f;
+		float DenoiseSigmaNormal = 128.0f;
+		float DenoiseSigmaDepth = 1.0f;
 	} cached_config;
 	ConfigAsset* config = nullptr;
 
@@ -101,7 +141,6 @@ private:
 	uint32_t rendered_tiles;
 
 	// scene
-	std::vector<Primitive*> primitives;
 	struct LightAndWeight {
 		PathtracerLight* light;
 		float cumulative_weight;
@@ -111,14 +150,27 @@ private:
 		}
 	};
 	std::vector<LightAndWeight> lights;
-	void select_random_light(PathtracerLight* &light, float& one_over_pdf);
+	LightBVH light_bvh;
+	// p, n: the shading point. Returns false if no light is picked, then the sample contributes nothing
+	bool select_random_light(PathtracerLight* &light, float& one_over_pdf, float u, const glm::vec3& p, const glm::vec3& n);
+	// what rays that leave the scene see (environment map or CPU sky), resolved once per scene load. Also in lights
+	PathtracerEnvironmentLight* environment = nullptr;
+	float environment_cdf_pmf = 0;
+	// probability that select_random_light picks the environment (the same at every shading point)
+	float environment_pmf() const;
 	myn::sky::CpuSkyAtmosphere* cpuSky = nullptr;
-	BVH* bvh = nullptr;
+	// kept across scene reloads, until the sun or the camera's altitude moves
+	SkyRadianceCache sky_cache;
+	SceneBVH* scene_bvh = nullptr;
+	BVHBuildOptions get_bvh_build_options() const;
 	void reload_scene(SceneObject *scene);
 	uint32_t scene_version = 0;
 
 #if ISPC
 	ISPC_Data* ispc_data = nullptr;
+	// the ispc kernel doesn't do instancing: it gets the scene flattened into world space, built on first use
+	TriangleStore ispc_triangles;
+	LinearBVH* ispc_bvh = nullptr;
 	void load_ispc_data();
 #endif
 
@@ -131,20 +183,74 @@ private:
 	// multi-jittered sampling
 	std::vector<vec2> pixel_offsets;
 	void generate_pixel_offsets();
+	Sampler* sampler = nullptr;
+	uint32_t samples_per_pixel() const;
 
 #if GRAPHICS_DISPLAY
 	// depth of field
 	float depth_of_first_hit(int x, int y);
 #endif
 
+	// camera ray parameters, taken from camera once per render instead of for every ray
+	struct {
+		vec3 position;
+		mat3 rotation; // camera to world
+		float half_width, half_height;
+		float k_x, k_y; // half size of the image plane at z = -1
+	} camera_rays;
+	void update_camera_rays();
+
 	// routine
 	void generate_one_ray(RayTask& task, int x, int y);
-	void generate_rays(std::vector<RayTask>& tasks, uint32_t index);
-	vec3 raytrace_pixel(uint32_t index);
+	// camera ray for sample samples.sample_index of pixel index; draws its pixel offset (and lens sample) from samples
+	void generate_camera_ray(Ray& ray, SampleStream& samples, uint32_t index);
+	void generate_rays(std::vector<RayTask>& tasks, uint32_t index, uint32_t first_sample, uint32_t num_samples);
+	// traces num_samples more samples (continuing from what the film has) and returns the pixel's new mean
+	vec3 raytrace_pixel(uint32_t index, uint32_t num_samples);
+	// raytrace_pixel on each of pixels, but with PacketCameraRays the camera rays of neighboring pixels (consecutive
+	// in pixels) get intersected as RayPackets. Read the new means from the film
+	void raytrace_pixels(const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples);
+	// adds the traced samples of a pixel to the film
+	void add_to_film(uint32_t index, const RayTask* tasks, uint32_t num_tasks);
 	void raytrace_tile(uint32_t tid, uint32_t tile_index);
 	void trace_ray(RayTask& task, int ray_depth, bool debug);
-
-	void raytrace_scene_to_buf(); //trace to main output buffer directly; used for rendering to file
+	// triangle index within scene_bvh->instances[instance], or -1
+	int intersect_scene(Ray& ray, double& t, vec3& n, uint32_t& instance);
+	bool occluded(const Ray& ray);
+
+	// wavefront integrator: traces num_samples more samples for each of pixels, like raytrace_pixel does for one,
+	// in batches of paths. Adds them to the film; read the new means from there
+	void raytrace_pixels_wavefront(const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples);
+	void wavefront_generate(WavefrontBatch& batch, const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples);
+	void wavefront_extend(WavefrontBatch& batch, int ray_depth);
+	void wavefront_shade(WavefrontBatch& batch, int ray_depth);
+	template<typename BSDFType>
+	void wavefront_shade_hits(WavefrontBatch& batch, const uint32_t* begin, const uint32_t* end, int ray_depth);
+	void wavefront_shadow(WavefrontBatch& batch, int ray_depth);
+	// one per job system thread (by myn::jobs::thread_index())
+	std::vector<WavefrontBatch> wavefront_batches;
+
+	// closest hit + shadow rays cast by each job system thread, for the Mrays/s report
+	struct alignas(64) RayCounter {
+		uint64_t num_rays = 0;
+	};
+	std::vector<RayCounter> ray_counters;
+	uint64_t total_rays() const;
+
+	void raytrace_scene_to_buf(); // into the film, then resolved to the main output buffer; used for rendering to file
+#if !GRAPHICS_DISPLAY
+	uint32_t budget_spp = 0;
+	float budget_seconds = 0;
+	bool exr_half_float = false;
+	bool exr_aovs = false;
+	bool force_denoise = false;
+	bool denoise_enabled() const { return cached_config.Denoise || force_denoise; }
+	// runs the Denoiser over the film (which needs its AOVs for that) and resolves the result to the main output buffer
+	void denoise();
+	// adaptive sampling: drops pixels from active whose relative error is below AdaptiveThreshold,
+	// unless a neighbor's isn't. Returns how many are left
+	size_t update_active_pixels(std::vector<uint8_t>& active);
+#endif
 	void output_file(const std::string& path);
 
 #if GRAPHICS_DISPLAY
@@ -159,29 +265,41 @@ private:
 
 	//---- threading stuff ----
 
-	std::function<void(int)> raytrace_task;
-
-	std::vector<RaytraceThread*> threads;
 	myn::ThreadSafeQueue<uint32_t> raytrace_tasks;
 
 #if GRAPHICS_DISPLAY
+	// ellyn: every tile is a job system task. It takes the next tile from raytrace_tasks, traces it into image_buffer,
+	// pushes it to completed_tiles for render() to upload whenever it gets to it, and queues the next tile's task,
+	// until there are no tiles left or its token gets cancelled (pause, reset, scene reload).
+	myn::jobs::TaskGroup raytrace_workers;
+	std::shared_ptr<myn::jobs::CancellationToken> raytrace_cancel;
+	myn::ThreadSafeQueue<uint32_t> completed_tiles;
+	void start_raytrace_workers();
+	void raytrace_next_tile(const std::shared_ptr<myn::jobs::CancellationToken>& cancel);
+
+	// cancels the workers and drops the tiles not started yet; the ones in progress still finish
 	void clear_tasks_and_threads_begin();
+	// waits for those, and drops completed tiles that weren't uploaded
 	void clear_tasks_and_threads_wait();
 #endif
 
 	//---- buffers & gpu resources ----
 
-	// an image buffer of size width * height * 3 (since it has rgb channels)
+	Film film;
+
+	// 8 bit display / output image, width * height * PATHTRACER_OUT_NUM_CHANNELS
 	unsigned char* image_buffer = nullptr;
+	// one tile each per job system thread (indexed by myn::jobs::thread_index()), for the ispc kernel to write into
 	unsigned char** subimage_buffers = nullptr;
+	uint32_t num_subimage_buffers = 0;
 
 	void set_mainbuffer_rgb(uint32_t i, vec3 rgb);
-	void set_subbuffer_rgb(uint32_t buf_i, uint32_t i, vec3 rgb);
 
 #if GRAPHICS_DISPLAY
 	void upload_rows(uint32_t begin, uint32_t end);
-	void upload_tile(uint32_t subbuf_index, uint32_t tile_index);
-	void upload_tile(uint32_t subbuf_index, uint32_t begin_x, uint32_t begin_y, uint32_t w, uint32_t h);
+	// from image_buffer
+	void upload_tile(uint32_t tile_index);
+	std::vector<unsigned char> tile_upload_buffer;
 
 	// vulkan
 	Texture2D* window_surface = nullptr;
@@ -1,5 +1,8 @@
 #include "Pathtracer.hpp"
+#include "Denoiser.hpp"
 #include "Utils/myn/Log.h"
+#include "Utils/myn/JobSystem.h"
+#include "Render/Mesh.h"
 #if GRAPHICS_DISPLAY
 #include "Render/Vulkan/VulkanUtils.h"
 #include "Render/Texture.h"
@@ -8,6 +11,9 @@
 #endif
 
 #if ISPC
+// must match BVH_STACK_SIZE in pathtracer_kernel_utils.ispc
+#define BVH_ISPC_STACK_SIZE 64
+
 struct ISPC_Data
 {
 	std::vector<ispc::Camera> camera;
@@ -27,7 +33,7 @@ struct ISPC_Data
 	float rr_threshold;
 	bool use_direct_light;
 	uint32_t area_light_samples;
-	std::vector<ispc::BVH> bvh_root;
+	ispc::BVH* bvh_root; // points into Pathtracer::ispc_bvh, which has the same layout
 	uint32_t bvh_stack_size;
 	bool use_bvh;
 	bool use_dof;
@@ -48,51 +54,73 @@ void Pathtracer::load_ispc_data() {
 		return res;
 	};
 
+	// flatten instances into world space, once per scene
+	if (ispc_bvh == nullptr) {
+		uint32_t num_vertices = 0, num_triangles = 0;
+		for (const MeshInstance& instance : scene_bvh->instances) {
+			num_vertices += instance.mesh->mesh->get_num_vertices();
+			num_triangles += instance.mesh->mesh->get_num_indices() / 3;
+		}
+		ispc_triangles.reserve(num_vertices, num_triangles);
+		for (const MeshInstance& instance : scene_bvh->instances) {
+			ispc_triangles.add_mesh(instance.object_to_world, instance.mesh->mesh, ispc_triangles.add_material(instance.bsdf));
+		}
+		BVH bvh_root(&ispc_triangles, 0);
+		bvh_root.primitives_start = 0;
+		bvh_root.primitives_count = ispc_triangles.size();
+		bvh_root.expand_bvh(get_bvh_build_options());
+		ispc_bvh = new LinearBVH(&bvh_root);
+	}
+	// the kernel's traversal stacks are fixed size, so deeper BVHs can only be traced in C++
+	if (ispc_bvh->max_depth + 2 > BVH_ISPC_STACK_SIZE) {
+		WARN("BVH depth %u exceeds ispc traversal stack size %d, falling back to the C++ path", ispc_bvh->max_depth, BVH_ISPC_STACK_SIZE)
+		cached_config.ISPC = false;
+		return;
+	}
+	const TriangleStore& triangles = ispc_triangles;
+
 	// construct scene representation (triangles + materials list)
-	ispc_data->bsdfs.resize(primitives.size());
-	ispc_data->triangles.resize(primitives.size());
-	for (int i=0; i<primitives.size(); i++)
+	ispc_data->bsdfs.resize(triangles.materials.size());
+	for (int i=0; i<triangles.materials.size(); i++)
 	{
-		ispc::Triangle &T = ispc_data->triangles[i];
-		Triangle* T0 = dynamic_cast<Triangle*>(primitives[i]);
-		if (!T0) ERR("failed to cast primitive to triangle?");
-		// construct its corresponding material
-		T.bsdf_index = i;
-		ispc_data->bsdfs[i].albedo = ispc_vec3(T0->bsdf->albedo);
-		ispc_data->bsdfs[i].Le = ispc_vec3(T0->bsdf->get_emission());
-		ispc_data->bsdfs[i].is_delta = T0->bsdf->is_delta;
-		ispc_data->bsdfs[i].is_emissive = T0->bsdf->is_emissive;
-		if (T0->bsdf->type == BSDF::Mirror) {
+		const BSDF* bsdf = triangles.materials[i];
+		ispc_data->bsdfs[i].albedo = ispc_vec3(bsdf->albedo);
+		ispc_data->bsdfs[i].Le = ispc_vec3(bsdf->get_emission());
+		ispc_data->bsdfs[i].is_delta = bsdf->is_delta;
+		ispc_data->bsdfs[i].is_emissive = bsdf->is_emissive;
+		if (bsdf->type == BSDF::Mirror) {
 			ispc_data->bsdfs[i].type = ispc::Mirror;
-		} else if (T0->bsdf->type == BSDF::Glass) {
+		} else if (bsdf->type == BSDF::Glass) {
 			ispc_data->bsdfs[i].type = ispc::Glass;
 		} else {
 			ispc_data->bsdfs[i].type = ispc::Diffuse;
 		}
-		// construct the ispc triangle object
+	}
+	ispc_data->triangles.resize(triangles.size());
+	for (int i=0; i<triangles.size(); i++)
+	{
+		// the ispc kernel still intersects with plane + edge normal tests, so derive those here
+		ispc::Triangle &T = ispc_data->triangles[i];
+		T.bsdf_index = triangles.material_ids[i];
+		vec3 plane_n = triangles.normal(i);
+		vec3 v[3] = {triangles.vertex(i, 0), triangles.vertex(i, 1), triangles.vertex(i, 2)};
 		for (int j=0; j<3; j++) {
-			T.vertices[j] = ispc_vec3(T0->vertices[j]);
-			T.enormals[j] = ispc_vec3(T0->enormals[j]);
+			T.vertices[j] = ispc_vec3(v[j]);
+			T.enormals[j] = ispc_vec3(normalize(cross(plane_n, v[(j + 1) % 3] - v[j])));
 		}
-		T.plane_n = ispc_vec3(T0->plane_n);
-		T.plane_k = T0->plane_k;
-		T.area = T0->area;
+		T.plane_n = ispc_vec3(plane_n);
+		T.plane_k = dot(v[0], plane_n);
+		T.area = triangles.area(i);
 	}
-	ispc_data->num_triangles = primitives.size();
-
-	ispc_data->area_light_indices.resize(lights.size());
-	uint light_count = 0;
-	for (auto & light : lights) {
-		if (!light.light->is_delta()) {
-			Triangle* T = dynamic_cast<PathtracerMeshLight*>(light.light)->triangle;
-			auto it = find(primitives.begin(), primitives.end(), T);
-			if (it != primitives.end()) { // found
-				ispc_data->area_light_indices[light_count] = it - primitives.begin();
-			}
-			light_count++;
+	ispc_data->num_triangles = triangles.size();
+
+	ispc_data->area_light_indices.clear();
+	for (uint32_t i = 0; i < triangles.size(); i++) {
+		if (triangles.bsdf(i)->is_emissive && !triangles.is_duplicate(i)) {
+			ispc_data->area_light_indices.push_back(i);
 		}
 	}
-	ispc_data->num_area_lights = light_count;
+	ispc_data->num_area_lights = ispc_data->area_light_indices.size();
 
 	// construct camera
 	ispc_data->camera.resize(1);
@@ -108,55 +136,20 @@ void Pathtracer::load_ispc_data() {
 	ispc_data->pixel_offsets = pixel_offsets;
 	ispc_data->num_offsets = pixel_offsets.size();
 
-	// BVH
-	uint max_depth = 0;
-	std::stack<BVH*> st;
-	std::unordered_map<BVH*, int> m;
-	// first iteration: make the structs, and map from node to index
-	st.push(bvh);
-	while (!st.empty()) {
-		BVH* ptr = st.top(); st.pop();
-		int self_index = ispc_data->bvh_root.size();
-		m[ptr] = self_index;
-		max_depth = glm::max(max_depth, ptr->depth);
-		// make the node (except children indices)
-		ispc::BVH node;
-		node.min = ispc_vec3(ptr->min);
-		node.max = ispc_vec3(ptr->max);
-		node.triangles_start = ptr->primitives_start;
-		node.triangles_count = ptr->primitives_count;
-		node.self_index = self_index;
-		ispc_data->bvh_root.push_back(node);
-		// push children
-		if (ptr->left) st.push(ptr->right);
-		if (ptr->right) st.push(ptr->left);
-	}
-	// second iteration: set children indices
-	st.push(bvh);
-	while (!st.empty()) {
-		BVH* ptr = st.top(); st.pop();
-		bool is_leaf = !ptr->left || !ptr->right;
-		int self_index = m[ptr];
-		int left_index = is_leaf ? -1 : m[ptr->left];
-		int right_index = is_leaf ? -1 : m[ptr->right];
-		ispc_data->bvh_root[self_index].left_index = left_index;
-		ispc_data->bvh_root[self_index].right_index = right_index;
-
-		// push children
-		if (ptr->left) st.push(ptr->right);
-		if (ptr->right) st.push(ptr->left);
-	}
+	// BVH: the flattened nodes are shared as-is with the kernel
+	static_assert(sizeof(ispc::BVH) == sizeof(LinearBVHNode), "ispc BVH node layout out of sync");
+	ispc_data->bvh_root = reinterpret_cast<ispc::BVH*>(ispc_bvh->nodes.data());
 
 	// and the rest of the inputs
 	ispc_data->width = width;
 	ispc_data->height = height;
 	ispc_data->tile_size = cached_config.TileSize;
-	ispc_data->num_threads = cached_config.Multithreaded ? cached_config.NumThreads : 1;
+	ispc_data->num_threads = cached_config.Multithreaded ? myn::jobs::num_threads() : 1;
 	ispc_data->max_ray_depth = cached_config.MaxRayDepth;
 	ispc_data->rr_threshold = cached_config.RussianRouletteThreshold;
 	ispc_data->use_direct_light = cached_config.UseDirectLight;
 	ispc_data->area_light_samples = cached_config.DirectLightSamples;
-	ispc_data->bvh_stack_size = (1 + max_depth) * 2;
+	ispc_data->bvh_stack_size = ispc_bvh->max_depth + 2;
 	ispc_data->use_bvh = cached_config.UseBVH;
 	ispc_data->use_dof = cached_config.UseDOF;
 	ispc_data->focal_distance = cached_config.FocalDistance;
@@ -174,20 +167,6 @@ void Pathtracer::set_mainbuffer_rgb(uint32_t i, vec3 rgb) {
 	image_buffer[pixel_size * i + 3] = 255;
 }
 
-void Pathtracer::set_subbuffer_rgb(uint32_t buf_i, uint32_t i, vec3 rgb) {
-	uint32_t pixel_size = PATHTRACER_OUT_NUM_CHANNELS * PATHTRACER_OUT_SIZE_PER_CHANNEL;
-	unsigned char* buf = subimage_buffers[buf_i];
-	buf[pixel_size * i] = char(rgb.r * 255.0f);
-	buf[pixel_size * i + 1] = char(rgb.g * 255.0f);
-	buf[pixel_size * i + 2] = char(rgb.b * 255.0f);
-	buf[pixel_size * i + 3] = 255;
-}
-
-vec3 gamma_correct(vec3 in) {
-	const vec3 gamma(0.455f);
-	return pow(in, gamma);
-}
-
 void Pathtracer::raytrace_tile(uint32_t tid, uint32_t tile_index) {
 	uint32_t X = tile_index % tiles_X;
 	uint32_t Y = tile_index / tiles_X;
@@ -225,32 +204,42 @@ void Pathtracer::raytrace_tile(uint32_t tid, uint32_t tile_index) {
 			ispc_data->rr_threshold,
 			ispc_data->use_direct_light,
 			ispc_data->area_light_samples,
-			ispc_data->bvh_root.data(),
+			ispc_data->bvh_root,
 			ispc_data->bvh_stack_size,
 			ispc_data->use_bvh,
 			ispc_data->use_dof,
 			ispc_data->focal_distance,
 			ispc_data->aperture_radius);
+
+		uint32_t pixel_size = PATHTRACER_OUT_NUM_CHANNELS * PATHTRACER_OUT_SIZE_PER_CHANNEL;
+		for (uint32_t y = 0; y < tile_h; y++) {
+			memcpy(image_buffer + (width * (y_offset + y) + x_offset) * pixel_size,
+				   subimage_buffers[tid] + y * tile_w * pixel_size, tile_w * pixel_size);
+		}
 	}
 	else
 #endif
 	{
-		for (uint32_t y = 0; y < tile_h; y++) {
-			for (uint32_t x = 0; x < tile_w; x++) {
-
-				uint32_t px_index_main = width * (y_offset + y) + (x_offset + x);
-				vec3 color = raytrace_pixel(px_index_main);
-
-				// do gamma correction BEFORE converting to R8G8B8A8 to avoid banding
-				color = gamma_correct(color);
-
-				set_mainbuffer_rgb(px_index_main, color);
-
-				uint32_t px_index_sub = y * tile_w + x;
-				set_subbuffer_rgb(tid, px_index_sub, color);
-
+		// in 8x8 blocks, so that consecutive pixels (which camera ray packets are made of) are close together
+		std::vector<uint32_t> pixels;
+		pixels.reserve(tile_w * tile_h);
+		for (uint32_t by = 0; by < tile_h; by += 8) {
+			for (uint32_t bx = 0; bx < tile_w; bx += 8) {
+				for (uint32_t y = by; y < std::min(by + 8, tile_h); y++) {
+					for (uint32_t x = bx; x < std::min(bx + 8, tile_w); x++) {
+						pixels.push_back(width * (y_offset + y) + (x_offset + x));
+					}
+				}
 			}
 		}
+		if (cached_config.Integrator == WavefrontIntegrator) {
+			raytrace_pixels_wavefront(pixels.data(), pixels.size(), samples_per_pixel());
+		} else {
+			raytrace_pixels(pixels.data(), pixels.size(), samples_per_pixel());
+		}
+
+		// do gamma correction BEFORE converting to R8G8B8A8 to avoid banding
+		for (uint32_t i : pixels) set_mainbuffer_rgb(i, Film::to_display(film.mean(i)));
 	}
 
 }
@@ -273,19 +262,7 @@ void Pathtracer::upload_rows(uint32_t begin, uint32_t rows)
 	TRACE("refresh! updated %d rows, %d%% done.", rows, percentage);
 }
 
-void Pathtracer::upload_tile(uint32_t subbuf_index, uint32_t begin_x, uint32_t begin_y, uint32_t w, uint32_t h)
-{
-	unsigned char* buffer = subimage_buffers[subbuf_index];
-	vk::uploadPixelsToImage(
-		buffer,
-		begin_x, begin_y,
-		w, h,
-		PATHTRACER_OUT_NUM_CHANNELS *PATHTRACER_OUT_SIZE_PER_CHANNEL,
-		window_surface->resource
-	);
-}
-
-void Pathtracer::upload_tile(uint32_t subbuf_index, uint32_t tile_index) {
+void Pathtracer::upload_tile(uint32_t tile_index) {
 	uint32_t X = tile_index % tiles_X;
 	uint32_t Y = tile_index / tiles_X;
 	uint32_t tile_size = cached_config.TileSize;
@@ -296,14 +273,28 @@ void Pathtracer::upload_tile(uint32_t subbuf_index, uint32_t tile_index) {
 	uint32_t x_offset = X * tile_size;
 	uint32_t y_offset = Y * tile_size;
 
-	upload_tile(subbuf_index, x_offset, y_offset, tile_w, tile_h);
+	// gather the tile's rows out of image_buffer (workers are done with this tile, and never touch it again)
+	uint32_t pixel_size = PATHTRACER_OUT_NUM_CHANNELS * PATHTRACER_OUT_SIZE_PER_CHANNEL;
+	tile_upload_buffer.resize(tile_w * tile_h * pixel_size);
+	for (uint32_t y = 0; y < tile_h; y++) {
+		memcpy(tile_upload_buffer.data() + y * tile_w * pixel_size,
+			   image_buffer + (width * (y_offset + y) + x_offset) * pixel_size, tile_w * pixel_size);
+	}
+	vk::uploadPixelsToImage(
+		tile_upload_buffer.data(),
+		x_offset, y_offset,
+		tile_w, tile_h,
+		PATHTRACER_OUT_NUM_CHANNELS *PATHTRACER_OUT_SIZE_PER_CHANNEL,
+		window_surface->resource
+	);
 }
 #else
 void Pathtracer::raytrace_scene_to_buf() {
 #if ISPC
+	// (might turn ISPC off for this scene)
+	if (cached_config.ISPC) load_ispc_data();
 	if (cached_config.ISPC)
 	{
-		load_ispc_data();
 		LOG("ispc max depth: %u", ispc_data->bvh_stack_size);
 
 		// dispatch task to ispc
@@ -328,7 +319,7 @@ void Pathtracer::raytrace_scene_to_buf() {
 			ispc_data->rr_threshold,
 			ispc_data->use_direct_light,
 			ispc_data->area_light_samples,
-			ispc_data->bvh_root.data(),
+			ispc_data->bvh_root,
 			ispc_data->bvh_stack_size,
 			ispc_data->use_bvh,
 			ispc_data->use_dof,
@@ -338,57 +329,142 @@ void Pathtracer::raytrace_scene_to_buf() {
 	else
 #endif
 	{
-		if (cached_config.Multithreaded)
-		{
-			myn::ThreadSafeQueue<uint> tasks;
-			uint task_size = cached_config.TileSize * cached_config.TileSize;
-			uint image_size = width * height;
-			for (uint i = 0; i < image_size; i += task_size) {
-				tasks.enqueue(i);
+		// passes over the whole image, each adding up to pass_spp samples per pixel, until the budget is used up
+		uint32_t pass_spp = samples_per_pixel();
+		uint32_t target_spp = budget_spp ? budget_spp : (budget_seconds > 0 ? UINT32_MAX : pass_spp);
+		myn::TimePoint begin = std::chrono::high_resolution_clock::now();
+		auto out_of_time = [&]() {
+			return budget_seconds > 0 &&
+				std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - begin).count() >= budget_seconds;
+		};
+
+		uint num_threads = cached_config.Multithreaded ? myn::jobs::num_threads() : 1;
+		uint image_size = width * height;
+		uint32_t num_passes = 0;
+		TileScheduler scheduler(width, height, cached_config.TileSize, num_threads);
+
+		// pixels that still get samples
+		std::vector<uint8_t> active(image_size, 1);
+		size_t num_active = image_size;
+		for (auto& counter : ray_counters) counter.num_rays = 0;
+
+		for (uint32_t spp = 0; spp < target_spp; spp += pass_spp) {
+			uint32_t num_samples = std::min(pass_spp, target_spp - spp);
+			bool first_pass = num_passes++ == 0;
+
+			if (cached_config.AdaptiveSampling && spp >= cached_config.AdaptiveMinSamples) {
+				num_active = update_active_pixels(active);
+				TRACE("pass %u: %.1f%% of pixels still active", num_passes, 100.0 * double(num_active) / image_size)
+				if (num_active == 0) break;
 			}
-			std::function<void(int)> raytrace_task = [&](int tid){
-				uint task_begin;
-				while (tasks.dequeue(task_begin))
-				{
-					uint task_end = glm::min(image_size, task_begin + task_size);
-					for (uint task = task_begin; task < task_end; task++)
-					{
-						vec3 color = raytrace_pixel(task);
-						color = gamma_correct(color);
-						set_mainbuffer_rgb(task, color);
+			if (num_active < image_size) scheduler.begin_pass([&](uint32_t i) { return active[i] != 0; });
+			else scheduler.begin_pass();
+
+			// the first pass always completes, so that every pixel has something
+			std::function<bool()> stop = nullptr;
+			if (!first_pass) stop = out_of_time;
+			auto trace_rows = [&](uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+				std::vector<uint32_t> pixels;
+				pixels.reserve(w * h);
+				for (uint32_t row = y; row < y + h; row++) {
+					for (uint32_t i = row * width + x; i < row * width + x + w; i++) {
+						if (active[i]) pixels.push_back(i);
 					}
 				}
+				if (cached_config.Integrator == WavefrontIntegrator) {
+					raytrace_pixels_wavefront(pixels.data(), pixels.size(), num_samples);
+				} else {
+					raytrace_pixels(pixels.data(), pixels.size(), num_samples);
+				}
 			};
-			TRACE("enqueued %zu tasks", tasks.size());
-			// create the threads and execute
-			std::vector<std::thread> threads_tmp;
-			for (uint tid = 0; tid < cached_config.NumThreads; tid++) {
-				threads_tmp.emplace_back(raytrace_task, tid);
-			}
-			TRACE("created %d threads", cached_config.NumThreads);
-			for (uint tid = 0; tid < cached_config.NumThreads; tid++) {
-				threads_tmp[tid].join();
-			}
-			TRACE("joined threads");
+			// the wavefront integrator wants as many paths per batch as it can get, so it takes as many rows of a tile at once
+			// as fit a batch; the recursive one gains nothing from that and takes a row at a time, which balances better
+			uint32_t max_pixels = 0;
+			if (cached_config.Integrator == WavefrontIntegrator) max_pixels = WAVEFRONT_MAX_BATCH_PATHS / num_samples;
+			// one scheduler slot per job system thread; each runs until the pass has nothing left to hand out
+			myn::TimePoint pass_begin = std::chrono::high_resolution_clock::now();
+			myn::jobs::parallel_for(0, num_threads, 1, [&](uint32_t first, uint32_t last) {
+				for (uint32_t tid = first; tid < last; tid++) scheduler.run(tid, trace_rows, stop, max_pixels);
+			});
+			scheduler.end_pass(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - pass_begin).count());
+			if (out_of_time()) break;
 		}
-		else
-		{
-			for (uint32_t y = 0; y < height; y++) {
-				for (uint32_t x = 0; x < width; x++) {
+		TRACE("%u passes, %.2f samples per pixel on average, %u at most",
+			  num_passes, double(film.total_samples()) / double(image_size), film.max_samples())
+		scheduler.report_utilization();
 
-					uint32_t px_index = width * y + x;
-					vec3 color = raytrace_pixel(px_index);
-					set_mainbuffer_rgb(px_index, color);
+		film.resolve_rgba8(image_buffer);
+	}
 
-				}
+}
+
+size_t Pathtracer::update_active_pixels(std::vector<uint8_t>& active) {
+	// per pixel estimates are noisy, so a pixel also stays active while any of its neighbors is above threshold
+	std::vector<uint8_t> above(width * height, 0);
+	for (uint32_t i = 0; i < width * height; i++) {
+		if (!active[i] || film.relative_error(i) <= cached_config.AdaptiveThreshold) continue;
+		int x = i % width, y = i / width;
+		for (int dy = -1; dy <= 1; dy++) {
+			for (int dx = -1; dx <= 1; dx++) {
+				int nx = x + dx, ny = y + dy;
+				if (nx >= 0 && ny >= 0 && nx < width && ny < height) above[ny * width + nx] = 1;
 			}
 		}
+	}
+	size_t num_active = 0;
+	for (uint32_t i = 0; i < width * height; i++) {
+		active[i] = active[i] && above[i];
+		num_active += active[i];
+	}
+	return num_active;
+}
 
+void Pathtracer::set_render_budget(uint32_t spp, float time_limit_seconds) {
+	budget_spp = spp;
+	budget_seconds = time_limit_seconds;
+}
+
+void Pathtracer::set_exr_options(bool half_float, bool aovs) {
+	exr_half_float = half_float;
+	exr_aovs = aovs;
+}
+
+void Pathtracer::set_denoise(bool enabled) {
+	force_denoise = enabled;
+}
+
+void Pathtracer::denoise() {
+#if ISPC
+	if (cached_config.ISPC) {
+		WARN("the ispc path doesn't render into the film, so there's nothing to denoise")
+		return;
 	}
+#endif
+	Denoiser denoiser;
+	denoiser.iterations = std::max(0, cached_config.DenoiseIterations);
+	denoiser.sigma_luminance = cached_config.DenoiseSigmaLuminance;
+	denoiser.sigma_normal = cached_config.DenoiseSigmaNormal;
+	denoiser.sigma_depth = cached_config.DenoiseSigmaDepth;
+
+	TIMER_BEGIN
+	denoiser.run(film, film.denoised);
+	TIMER_END(duration)
+	TRACE("denoised in %.1fms (%.1fms per megapixel, %d iterations)",
+		  duration * 1000, duration * 1000 / (double(width) * height * 1e-6), denoiser.iterations)
 
+	film.resolve_rgba8(image_buffer);
 }
 
 void Pathtracer::output_file(const std::string& path) {
+	std::string extension = path.substr(std::min(path.size(), path.find_last_of('.') + 1));
+	if (myn::lower(extension) == "exr") {
+#if ISPC
+		if (cached_config.ISPC) WARN("the ispc path doesn't render into the film, so %s will be black", path.c_str())
+#endif
+		// (the film also has AOVs when only the denoiser wanted them)
+		film.write_exr(path, exr_half_float, exr_aovs);
+		return;
+	}
 	stbi_write_png(
 		path.c_str(),
 		width, height,4,
@@ -405,15 +481,16 @@ void Pathtracer::render_to_file(const std::string& output_path_rel_to_bin)
 	initialize();
 #endif
 
-	double num_camera_rays = double(width * height * pixel_offsets.size()) * 1e-6;
-	std::string workload = std::to_string((int)(num_camera_rays * 1000) * 0.001) + "M camera rays, "
+	std::string budget = budget_spp ? std::to_string(budget_spp) + " spp" : std::to_string(samples_per_pixel()) + " spp per pass";
+	if (budget_seconds > 0) budget += ", at most " + std::to_string(budget_seconds) + " seconds";
+	std::string workload = budget + ", "
 		+ "max depth " + std::to_string(cached_config.MaxRayDepth) + ", "
 		+ "RR threshold " + std::to_string((int)(cached_config.RussianRouletteThreshold * 100) * 0.01);
 
-	uint32_t num_camera_rays_per_task = cached_config.TileSize * cached_config.TileSize * pixel_offsets.size();
+	uint32_t num_camera_rays_per_task = cached_config.TileSize * cached_config.TileSize * samples_per_pixel();
 	std::string threading = std::to_string(num_camera_rays_per_task) + " camera rays per tile, ";
 	if (cached_config.Multithreaded) {
-		threading += std::to_string(cached_config.NumThreads) + " threads";
+		threading += std::to_string(myn::jobs::num_threads()) + " threads";
 	} else {
 		threading += "single threaded";
 	}
@@ -423,7 +500,30 @@ void Pathtracer::render_to_file(const std::string& output_path_rel_to_bin)
 	raytrace_scene_to_buf();
 	TIMER_END(duration)
 	TRACE("done! took %f seconds", duration)
+#if ISPC
+	if (!cached_config.ISPC)
+#endif
+	TRACE("%.2f Mrays/s with the %s integrator (%llu closest hit + shadow rays)",
+		  double(total_rays()) / duration * 1e-6,
+		  cached_config.Integrator == WavefrontIntegrator ? "wavefront" : "recursive", (unsigned long long)total_rays())
+
+	if (denoise_enabled()) denoise();
 
 	output_file(output_path_rel_to_bin);
+
+	// without a budget there is only one pass, so adaptive sampling never kicked in and every pixel has the same count
+	bool multiple_passes = budget_spp > samples_per_pixel() || budget_seconds > 0;
+	if (cached_config.AdaptiveSampling && multiple_passes) {
+		// samples per pixel, next to the image: <name>_spp.png
+		std::string heatmap_path = output_path_rel_to_bin;
+		size_t dot = heatmap_path.find_last_of('.');
+		size_t slash = heatmap_path.find_last_of("/\\");
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = heatmap_path.size();
+		heatmap_path = heatmap_path.substr(0, dot) + "_spp.png";
+		std::vector<uint8_t> heatmap(width * height * 4);
+		film.resolve_heatmap_rgba8(heatmap.data());
+		stbi_write_png(heatmap_path.c_str(), width, height, 4, heatmap.data(), width * 4);
+		LOG("wrote samples per pixel heatmap to %s", heatmap_path.c_str())
+	}
 }
 #endif
\ No newline at end of file
@@ -15,7 +15,9 @@ void Pathtracer::generate_pixel_offsets() {
 	uint32_t sqk = std::ceil(sqrt(cached_config.MinRaysPerPixel));
 	uint32_t num_offsets = pow(sqk, 2);
 	TRACE("generating %u pixel offsets", num_offsets);
-	
+	// shared by all pixels, but should still be the same every run. Not a pixel index, so unlike any pixel's samples
+	myn::sample::seed(UINT32_MAX, 0);
+
 	// canonical arrangement
 	for (int j=0; j<sqk; j++) {
 		for (int i=0; i<sqk; i++) {
@@ -45,63 +47,138 @@ void Pathtracer::generate_pixel_offsets() {
 
 }
 
-void Pathtracer::generate_rays(std::vector<RayTask>& tasks, uint32_t index) {
-	tasks.clear();
+uint32_t Pathtracer::samples_per_pixel() const {
+	return cached_config.UseJitteredSampling ? pixel_offsets.size() : cached_config.MinRaysPerPixel;
+}
 
+void Pathtracer::update_camera_rays() {
+	if (!camera) return;
+	// (object_to_world goes up the whole parent chain)
+	camera_rays.position = camera->world_position();
+	camera_rays.rotation = mat3(camera->object_to_world());
+	camera_rays.half_width = float(width) / 2.0f;
+	camera_rays.half_height = float(height) / 2.0f;
+	// the raytraced image plane is at plane z = -1. Supposed k is its size in half.
+	camera_rays.k_y = tan(camera->fov / 2.0f);
+	camera_rays.k_x = camera_rays.k_y * camera->aspect_ratio;
+}
+
+void Pathtracer::generate_camera_ray(Ray& ray, SampleStream& samples, uint32_t index) {
 	uint32_t w = index % width;
 	uint32_t h = height - index / width;
-	float fov = camera->fov;
-	float half_width = float(width) / 2.0f;
-	float half_height = float(height) / 2.0f;
-	// the raytraced image plane is at plane z = -1. Supposed k is its size in half.
-	float k_y = tan(fov / 2.0f);
-	float k_x = k_y * camera->aspect_ratio;
+	const auto& c = camera_rays;
 
-	RayTask task;
-	Ray& ray = task.ray;
-	bool jittered = cached_config.UseJitteredSampling;
-	for (int i = 0; i < (jittered ? pixel_offsets.size() : cached_config.MinRaysPerPixel); i++) {
-		vec2 offset = jittered ? pixel_offsets[i] : myn::sample::unit_square_uniform();
+	// the independent sampler keeps using the shared jittered offsets (for the first pass), as before there were samplers
+	bool shared_offsets = cached_config.UseJitteredSampling && sampler->type == Sampler::Independent;
+	vec2 offset = samples.get_2d();
+	if (shared_offsets && samples.sample_index < pixel_offsets.size()) offset = pixel_offsets[samples.sample_index];
 
-		ray.o = camera->world_position();
-		ray.tmin = 0.0;
-		ray.tmax = INF;
+	ray.o = c.position;
+	ray.tmin = 0.0;
+	ray.tmax = INF;
 
-		// dx, dy: deviation from canvas center, normalized to range [-1, 1]
-		float dx = (w + offset.x - half_width) / half_width;
-		float dy = (h + offset.y - half_height) / half_height;
+	// dx, dy: deviation from canvas center, normalized to range [-1, 1]
+	float dx = (w + offset.x - c.half_width) / c.half_width;
+	float dy = (h + offset.y - c.half_height) / c.half_height;
 
-		vec3 d_unnormalized_c = vec3(k_x * dx, k_y * dy, -1);
-		vec3 d_unnormalized_w = mat3(camera->object_to_world()) * d_unnormalized_c;
-		ray.d = normalize(d_unnormalized_w);
+	vec3 d_unnormalized_c = vec3(c.k_x * dx, c.k_y * dy, -1);
+	vec3 d_unnormalized_w = c.rotation * d_unnormalized_c;
+	ray.d = normalize(d_unnormalized_w);
 
-		if (cached_config.UseDOF) {
-			vec3 focal_p = ray.o + cached_config.FocalDistance * d_unnormalized_w;
+	if (cached_config.UseDOF) {
+		vec3 focal_p = ray.o + cached_config.FocalDistance * d_unnormalized_w;
 
-			vec3 aperture_shift_cam = vec3(myn::sample::unit_disc_uniform() * cached_config.ApertureRadius, 0);
-			vec3 aperture_shift_world = mat3(camera->object_to_world()) * aperture_shift_cam;
-			ray.o = camera->world_position() + aperture_shift_world;
-			ray.d = normalize(focal_p - ray.o);
-		}
+		vec3 aperture_shift_cam = vec3(myn::sample::unit_disc_uniform(samples.get_2d()) * cached_config.ApertureRadius, 0);
+		vec3 aperture_shift_world = c.rotation * aperture_shift_cam;
+		ray.o = c.position + aperture_shift_world;
+		ray.d = normalize(focal_p - ray.o);
+	}
+}
+
+void Pathtracer::generate_rays(std::vector<RayTask>& tasks, uint32_t index, uint32_t first_sample, uint32_t num_samples) {
+	tasks.clear();
 
+	RayTask task;
+	for (uint32_t i = first_sample; i < first_sample + num_samples; i++) {
+		task.samples = SampleStream{ sampler, index, i, 0 };
+		generate_camera_ray(task.ray, task.samples, index);
 		tasks.push_back(task);
 	}
 }
 
-vec3 Pathtracer::raytrace_pixel(uint32_t index) {
+vec3 Pathtracer::raytrace_pixel(uint32_t index, uint32_t num_samples) {
 	std::vector<RayTask> tasks;
-	generate_rays(tasks, index);
+	generate_rays(tasks, index, film.num_samples[index], num_samples);
+	for (auto & task : tasks) trace_ray(task, 0, false);
+	add_to_film(index, tasks.data(), tasks.size());
+	return film.mean(index);
+}
+
+void Pathtracer::raytrace_pixels(const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples) {
+	if (!cached_config.PacketCameraRays) {
+		for (uint32_t j = 0; j < num_pixels; j++) raytrace_pixel(pixels[j], num_samples);
+		return;
+	}
 
+	// as many whole pixels as fit in a packet (or one pixel in several, if it has more samples than that)
+	uint32_t pixels_per_group = std::max(1u, RAY_PACKET_SIZE / std::max(1u, num_samples));
+	std::vector<RayTask> tasks;
+	RayPacket packet;
+	for (uint32_t first = 0; first < num_pixels; first += pixels_per_group) {
+		uint32_t group_pixels = std::min(pixels_per_group, num_pixels - first);
+		tasks.resize(group_pixels * num_samples);
+		for (uint32_t j = 0; j < group_pixels; j++) {
+			uint32_t index = pixels[first + j];
+			for (uint32_t s = 0; s < num_samples; s++) {
+				RayTask& task = tasks[j * num_samples + s];
+				task = RayTask();
+				task.samples = SampleStream{ sampler, index, film.num_samples[index] + s, 0 };
+				generate_camera_ray(task.ray, task.samples, index);
+			}
+		}
+
+		// first hits by packet; trace_ray takes it from there one ray at a time
+		for (uint32_t b = 0; b < tasks.size(); b += RAY_PACKET_SIZE) {
+			packet.size = 0;
+			for (uint32_t k = b; k < std::min(uint32_t(tasks.size()), b + RAY_PACKET_SIZE); k++) packet.add(tasks[k].ray);
+			scene_bvh->intersect_packet(packet, cached_config.UseBVH);
+			for (uint32_t k = 0; k < packet.size; k++) {
+				RayTask& task = tasks[b + k];
+				task.has_hit = true;
+				task.hit_primitive = packet.primitive[k];
+				task.hit_t = packet.t[k];
+				task.hit_n = packet.n[k];
+				task.hit_instance = packet.instance[k];
+			}
+		}
+		for (auto & task : tasks) trace_ray(task, 0, false);
+
+		for (uint32_t j = 0; j < group_pixels; j++) {
+			add_to_film(pixels[first + j], tasks.data() + j * num_samples, num_samples);
+		}
+	}
+}
+
+void Pathtracer::add_to_film(uint32_t index, const RayTask* tasks, uint32_t num_tasks) {
 	vec3 result = vec3(0);
-	for (auto & task : tasks) {
-		trace_ray(task, 0, false);
+	vec3 result_even = vec3(0);
+	vec3 albedo = vec3(0), normal = vec3(0), direct = vec3(0);
+	float depth = INF;
+	uint64_t num_rays = 0;
+	for (uint32_t i = 0; i < num_tasks; i++) {
+		const RayTask& task = tasks[i];
 		result += task.output;
-		//result += clamp(task.output, vec3(0), vec3(1));
+		if (task.samples.sample_index % 2 == 0) result_even += task.output;
+		albedo += task.first_albedo;
+		normal += task.first_normal;
+		direct += task.direct;
+		depth = std::min(depth, task.first_depth);
+		num_rays += task.num_rays;
 	}
+	ray_counters[myn::jobs::thread_index()].num_rays += num_rays;
 
-	result *= 1.0f / float(tasks.size());
-	result = clamp(result, vec3(0), vec3(1));
-	return result;
+	film.add_samples(index, result, result_even, num_tasks);
+	if (film.has_aovs) film.add_aovs(index, albedo, normal, direct, depth);
 }
 
 #if GRAPHICS_DISPLAY
@@ -114,6 +191,7 @@ void Pathtracer::raytrace_debug(uint32_t index) {
 	int h = index / width;
 	RayTask task;
 	generate_one_ray(task, w, h);
+	task.samples = SampleStream{ sampler, index, 0, 0 };
 
 	trace_ray(task, 0, true);
 	vec3& color = task.output;
@@ -166,8 +244,8 @@ float Pathtracer::depth_of_first_hit(int x, int y) {
 	generate_one_ray(task, x, y);
 	
 	// info of closest hit
-	double t; vec3 n;
-	bvh->intersect_primitives(task.ray, t, n, cached_config.UseBVH);
+	double t; vec3 n; uint32_t instance;
+	intersect_scene(task.ray, t, n, instance);
 
 	t *= dot(task.ray.d, camera->forward());
 
@@ -175,30 +253,17 @@ float Pathtracer::depth_of_first_hit(int x, int y) {
 }
 #endif
 
-namespace
-{
-void make_h2w(mat3& h2w, const vec3& z) { // TODO: make more robust
-	// choose a vector different from z
-	vec3 tmp = normalize(vec3(1, 2, 3));
-
-	vec3 x = cross(tmp, z);
-	x = normalize(x);
-	vec3 y = cross(z, x);
-
-	h2w = mat3(x, y, z);
-}
-
-// see: https://stackoverflow.com/questions/687261/converting-rgb-to-grayscale-intensity
-inline float brightness(const vec3& color) {
-	return 0.2989f * color.r + 0.587f * color.g + 0.114f * color.b;
-}
-};
+bool Pathtracer::select_random_light(PathtracerLight* &light, float &one_over_pdf, float u, const vec3& p, const vec3& n) {
+	if (cached_config.LightSampler == BVHLightSampler) {
+		float pmf;
+		if (!light_bvh.sample(p, n, u, light, pmf)) return false;
+		one_over_pdf = 1.0f / pmf;
+		return true;
+	}
 
-void Pathtracer::select_random_light(PathtracerLight* &light, float &one_over_pdf) {
-	float rnd = myn::sample::rand01();
 	LightAndWeight lw = {
 		.light = nullptr,
-		.cumulative_weight = rnd,
+		.cumulative_weight = u,
 		.one_over_pdf = 1
 	};
 	auto it = std::lower_bound(lights.begin(), lights.end(), lw);
@@ -209,6 +274,26 @@ void Pathtracer::select_random_light(PathtracerLight* &light, float &one_over_pd
 		light = it->light;
 		one_over_pdf = it->one_over_pdf;
 	}
+	return true;
+}
+
+float Pathtracer::environment_pmf() const {
+	if (cached_config.LightSampler == BVHLightSampler) return light_bvh.infinite_light_pmf();
+	return environment_cdf_pmf;
+}
+
+int Pathtracer::intersect_scene(Ray& ray, double& t, vec3& n, uint32_t& instance) {
+	return scene_bvh->intersect_primitives(ray, t, n, instance, cached_config.UseBVH, cached_config.UseWideBVH);
+}
+
+bool Pathtracer::occluded(const Ray& ray) {
+	return scene_bvh->occluded(ray, cached_config.UseBVH, cached_config.UseWideBVH);
+}
+
+uint64_t Pathtracer::total_rays() const {
+	uint64_t total = 0;
+	for (auto& counter : ray_counters) total += counter.num_rays;
+	return total;
 }
 
 void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
@@ -217,12 +302,27 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 	Ray& ray = task.ray;
 
 	// info of closest hit
-	double t; vec3 n;
-	Primitive* primitive = bvh->intersect_primitives(ray, t, n, cached_config.UseBVH);
+	double t; vec3 n; uint32_t instance;
+	int primitive;
+	if (task.has_hit) {
+		primitive = task.hit_primitive;
+		t = task.hit_t;
+		n = task.hit_n;
+		instance = task.hit_instance;
+		task.has_hit = false;
+	} else {
+		primitive = intersect_scene(ray, t, n, instance);
+	}
+	task.num_rays++;
 
-	if (primitive) { // intersected with at least 1 primitive (has valid t, n, bsdf)
+	if (primitive >= 0) { // intersected with at least 1 primitive (has valid t, n, bsdf)
 
-		const BSDF *bsdf = primitive->bsdf;
+		const BSDF *bsdf = scene_bvh->instances[instance].bsdf;
+		if (ray_depth == 0) {
+			task.first_albedo = bsdf->albedo;
+			task.first_normal = n;
+			task.first_depth = float(t);
+		}
 		// pre-compute (or declare) some common things to be used later
 		vec3 L = vec3(0);
 		vec3 hit_p = ray.o + float(t) * ray.d;
@@ -256,25 +356,31 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 				float each_sample_weight = 1.0f / (float) cached_config.DirectLightSamples;
 				for (uint32_t i = 0; i < cached_config.DirectLightSamples; i++) {
 
+					// (both drawn either way, so the sample dimensions don't depend on which light got picked)
+					float u_light = task.samples.get_1d();
+					vec2 u_point = task.samples.get_2d();
 					PathtracerLight *light;
 					float one_over_pdf;
-					select_random_light(light, one_over_pdf);
+					if (!select_random_light(light, one_over_pdf, u_light, hit_p, n)) continue;
 
 					Ray ray_to_light;
 					float attenuation;
 					ray_to_light.o = hit_p;
-					light->ray_to_light_and_attenuation(ray_to_light, attenuation);
+					light->ray_to_light_and_attenuation(ray_to_light, attenuation, u_point);
 
-					double tmp_t;
-					vec3 tmp_n;
-					bool in_shadow =
-						bvh->intersect_primitives(ray_to_light, tmp_t, tmp_n, cached_config.UseBVH) != nullptr;
+					bool in_shadow = occluded(ray_to_light);
+					task.num_rays++;
 					if (!in_shadow) {
 						wi_world = ray_to_light.d;
 						wi_hemi = w2h * wi_world;
 						costhetai = std::max(0.0f, dot(n, wi_world));
-						vec3 L_direct = light->get_emission() * bsdf->f(wi_hemi, wo_hemi) * costhetai * attenuation
+						vec3 L_direct = light->get_radiance(wi_world) * bsdf->f(wi_hemi, wo_hemi) * costhetai * attenuation
 										* one_over_pdf * each_sample_weight;
+						// the bsdf sample below could hit the environment in this direction too
+						if (light == environment) {
+							float light_pdf = environment->pdf(wi_world) / one_over_pdf;
+							L_direct *= power_heuristic(cached_config.DirectLightSamples * light_pdf, bsdf->pdf(wi_hemi, wo_hemi));
+						}
 						// correction for when above num and denom both 0. TODO: is this right?
 						if (glm::isnan(L_direct.x) || glm::isnan(L_direct.y) || glm::isnan(L_direct.z)) L_direct = vec3(0);
 						L += L_direct;
@@ -284,6 +390,7 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 			}
 		}
 		task.output += task.contribution * L;
+		if (ray_depth == 0) task.direct = task.output;
 
 #if 1 // indirect lighting (recursive)
 
@@ -296,7 +403,7 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 #endif
 
 			float pdf;
-			vec3 f = bsdf->sample_f(pdf, wi_hemi, wo_hemi, debug);
+			vec3 f = bsdf->sample_f(pdf, wi_hemi, wo_hemi, task.samples.get_2d(), debug);
 
 			// transform wi back to world space
 			wi_world = h2w * wi_hemi;
@@ -316,7 +423,7 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 				termination_prob = (cached_config.RussianRouletteThreshold - ray.rr_contribution)
 					/ cached_config.RussianRouletteThreshold;
 			}
-			bool terminate = myn::sample::rand01() < termination_prob;
+			bool terminate = task.samples.get_1d() < termination_prob;
 
 			// recursive step: trace scattered ray in wi direction (if not terminated by RR)
 			vec3 Li = vec3(0);
@@ -324,6 +431,7 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 				vec3 refl_offset = wi_hemi.z > 0 ? EPSILON * n : -EPSILON * n;
 				Ray ray_refl(hit_p + refl_offset, wi_world); // alright I give up fighting epsilon for now...
 				if (cached_config.UseDirectLight && bsdf->is_delta) ray_refl.receive_le = true;
+				if (cached_config.UseDirectLight && !bsdf->is_delta) ray_refl.bsdf_pdf = pdf;
 				task.ray = ray_refl;
 				task.contribution *= f * costhetai / pdf * (1.0f / (1.0f - termination_prob));
 				// if it has some termination probability, weigh it more if it's not terminated
@@ -341,13 +449,14 @@ void Pathtracer::trace_ray(RayTask& task, int ray_depth, bool debug) {
 #endif
 	}
 	else {// ray missed
-		if (cpuSky) {
-			task.output += task.contribution * cpuSky->sampleSkyColor(ray.d);
-		}
-		else if (Config->lookup<int>("LoadEnvironmentMap")) {
-			auto envmap = Asset::find<EnvironmentMapAsset>(Config->lookup<std::string>("EnvironmentMap"));
-			task.output += task.contribution * myn::sample::tex::longlatmap_float3(
-				(float*)(envmap->texels3x32.data()), envmap->width, envmap->height, ray.d);
+		if (environment) {
+			vec3 Le = environment->get_radiance(ray.d);
+			if (ray.bsdf_pdf > 0) {
+				float light_pdf = environment_pmf() * environment->pdf(ray.d);
+				Le *= power_heuristic(ray.bsdf_pdf, cached_config.DirectLightSamples * light_pdf);
+			}
+			task.output += task.contribution * Le;
 		}
+		if (ray_depth == 0) task.direct = task.output;
 	}
 }
\ No newline at end of file
@@ -1,7 +1,11 @@
 #include "PathtracerLight.hpp"
 #include "Primitive.hpp"
 #include "BSDF.hpp"
+#include "LightBVH.hpp"
+#include "Utils/myn/Sample.h"
 #include "CpuSkyAtmosphere/CpuSkyAtmosphere.h"
+#include "SkyRadianceCache.hpp"
+#include "Utils/myn/JobSystem.h"
 
 using namespace glm;
 
@@ -11,22 +15,27 @@ float luminance(const vec3& col) {
 }
 };
 
-PathtracerMeshLight::PathtracerMeshLight(Triangle* _triangle)
-	: triangle(_triangle)
+PathtracerMeshLight::PathtracerMeshLight(const vec3& v0, const vec3& v1, const vec3& v2, const BSDF* _bsdf)
+	: vertices{v0, v1, v2}, bsdf(_bsdf)
 {
 	_is_delta = false;
+	vec3 c = cross(v1 - v0, v2 - v0);
+	normal = normalize(c);
+	area = length(c) * 0.5f;
 }
 
 vec3 PathtracerMeshLight::get_emission() {
-	return triangle->bsdf->get_emission();
+	return bsdf->get_emission();
 }
 
-void PathtracerMeshLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation) {
-	vec3 light_p = triangle->sample_point();
+void PathtracerMeshLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation, vec2 u) {
+	vec2 b = myn::sample::triangle_uniform(u);
+	vec3 light_p = vertices[0] + (vertices[1] - vertices[0]) * b.x + (vertices[2] - vertices[0]) * b.y;
 
 	ray.d = normalize(light_p - ray.o);
-	double t; vec3 n;
-	triangle->intersect(ray, t, n, true);
+	double t = length(light_p - ray.o);
+	ray.tmax = t;
+	vec3 n = normal;
 
 	double d2 = t * t;
 
@@ -37,20 +46,31 @@ void PathtracerMeshLight::ray_to_light_and_attenuation(Ray &ray, float &attenuat
 	ray.tmax -= eps_adjusted;
 
 	// could be 0 or infinite
-	attenuation = (triangle->area * costheta_l) / d2;
+	attenuation = (area * costheta_l) / d2;
 }
 
 float PathtracerMeshLight::get_weight() {
 	return luminance(get_emission());
 }
 
+bool PathtracerMeshLight::get_bounds(LightBounds& bounds) {
+	bounds.min = min(vertices[0], min(vertices[1], vertices[2]));
+	bounds.max = max(vertices[0], max(vertices[1], vertices[2]));
+	// one sided, diffuse: radiance over the hemisphere around the normal
+	bounds.power = luminance(get_emission()) * area * PI;
+	bounds.axis = normal;
+	bounds.cos_theta_o = 1;
+	bounds.cos_theta_e = 0;
+	return true;
+}
+
 PathtracerPointLight::PathtracerPointLight(const glm::vec3& in_position, const glm::vec3& in_emission)
 	: position(in_position), emission(in_emission)
 {
 	_is_delta = true;
 }
 
-void PathtracerPointLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation) {
+void PathtracerPointLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation, vec2 u) {
 	vec3 path = position - ray.o;
 	double path_len = length(path);
 	ray.d = normalize(path);
@@ -65,13 +85,23 @@ float PathtracerPointLight::get_weight() {
 	return luminance(get_emission() / (4 * PI));
 }
 
+bool PathtracerPointLight::get_bounds(LightBounds& bounds) {
+	bounds.min = bounds.max = position;
+	bounds.power = luminance(get_emission());
+	// every direction
+	bounds.axis = vec3(0, 0, 1);
+	bounds.cos_theta_o = -1;
+	bounds.cos_theta_e = 0;
+	return true;
+}
+
 PathtracerDirectionalLight::PathtracerDirectionalLight(const vec3 &in_direction, const vec3 &in_emission)
 	: direction(in_direction), emission(in_emission)
 {
 	_is_delta = true;
 }
 
-void PathtracerDirectionalLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation) {
+void PathtracerDirectionalLight::ray_to_light_and_attenuation(Ray &ray, float &attenuation, vec2 u) {
 	ray.d = -direction;
 	ray.tmin = EPSILON;
 	ray.tmax = INF;
@@ -84,4 +114,144 @@ float PathtracerDirectionalLight::get_weight() {
 
 void PathtracerDirectionalLight::apply_sky(const myn::sky::CpuSkyAtmosphere *cpuSky) {
 	emission *= cpuSky->sampleSunTransmittance(-direction);
-}
\ No newline at end of file
+}
+
+namespace {
+
+// long-lat coordinates in [0, 1)^2 <-> directions, as in myn::sample::tex::longlatmap_float3
+inline vec2 direction_to_longlat(const vec3& d) {
+	float phi = std::atan2(d.y, d.x);
+	float theta = std::asin(clamp(d.z, -1.0f, 1.0f));
+	return vec2(-phi * ONE_OVER_TWO_PI + 0.5f, -theta * ONE_OVER_PI + 0.5f);
+}
+
+inline vec3 longlat_to_direction(const vec2& uv) {
+	float phi = (0.5f - uv.x) * 2 * PI;
+	float theta = (0.5f - uv.y) * PI;
+	return vec3(std::cos(theta) * std::cos(phi), std::cos(theta) * std::sin(phi), std::sin(theta));
+}
+
+// density over uv in [0, 1)^2 -> density over directions
+inline float longlat_pdf_to_solid_angle(float pdf_uv, float cos_theta) {
+	return cos_theta > 0 ? pdf_uv / (2 * PI * PI * cos_theta) : 0;
+}
+
+}
+
+PathtracerEnvironmentLight::PathtracerEnvironmentLight(const vec3* in_texels, uint32_t in_width, uint32_t in_height)
+	: texels(in_texels), width(in_width), height(in_height)
+{
+	_is_delta = false;
+
+	// each distribution cell covers about scale * scale texels, plus the next row & column that bilinear lookups
+	// within it also blend in (so no cell gets 0 where get_radiance isn't)
+	uint32_t scale = (width + ENVIRONMENT_LIGHT_MAX_DISTRIBUTION_WIDTH - 1) / ENVIRONMENT_LIGHT_MAX_DISTRIBUTION_WIDTH;
+	uint32_t cell_width = (width + scale - 1) / scale;
+	uint32_t cell_height = (height + scale - 1) / scale;
+	std::vector<vec3> cells(cell_width * cell_height);
+	myn::jobs::parallel_for(0, cell_height, 16, [&](uint32_t begin, uint32_t end) {
+		for (uint32_t y = begin; y < end; y++) {
+			for (uint32_t x = 0; x < cell_width; x++) {
+				vec3 sum = vec3(0);
+				uint32_t count = 0;
+				uint32_t ty_end = std::min(((y + 1) * height + cell_height - 1) / cell_height, height - 1);
+				uint32_t tx_end = ((x + 1) * width + cell_width - 1) / cell_width;
+				for (uint32_t ty = y * height / cell_height; ty <= ty_end; ty++) {
+					for (uint32_t tx = x * width / cell_width; tx <= tx_end; tx++) {
+						sum += texels[ty * width + tx % width];
+						count++;
+					}
+				}
+				cells[y * cell_width + x] = sum / float(count);
+			}
+		}
+	});
+	build_distribution(cells.data(), cell_width, cell_height);
+}
+
+PathtracerEnvironmentLight::PathtracerEnvironmentLight(const SkyRadianceCache* in_sky) : sky(in_sky) {
+	_is_delta = false;
+
+	uint32_t cell_width = ENVIRONMENT_LIGHT_SKY_DISTRIBUTION_WIDTH;
+	uint32_t cell_height = cell_width / 2;
+	std::vector<vec3> cells(cell_width * cell_height);
+	myn::jobs::parallel_for(0, cell_height, 4, [&](uint32_t begin, uint32_t end) {
+		for (uint32_t y = begin; y < end; y++) {
+			for (uint32_t x = 0; x < cell_width; x++) {
+				vec2 uv = vec2((x + 0.5f) / float(cell_width), (y + 0.5f) / float(cell_height));
+				cells[y * cell_width + x] = sky->radiance(longlat_to_direction(uv));
+			}
+		}
+	});
+	build_distribution(cells.data(), cell_width, cell_height);
+}
+
+void PathtracerEnvironmentLight::build_distribution(const vec3* cells, uint32_t cell_width, uint32_t cell_height) {
+	distribution_width = cell_width;
+	distribution_height = cell_height;
+	columns.resize(cell_height);
+	std::vector<float> row_weights(cell_height);
+	std::vector<vec3> row_sums(cell_height);
+	myn::jobs::parallel_for(0, cell_height, 16, [&](uint32_t begin, uint32_t end) {
+		std::vector<float> weights(cell_width);
+		for (uint32_t y = begin; y < end; y++) {
+			// (every cell in a row covers the same solid angle)
+			float cos_theta = std::cos((0.5f - (y + 0.5f) / float(cell_height)) * PI);
+			row_sums[y] = vec3(0);
+			for (uint32_t x = 0; x < cell_width; x++) {
+				const vec3& L = cells[y * cell_width + x];
+				weights[x] = luminance(L);
+				row_sums[y] += L * cos_theta;
+			}
+			columns[y] = myn::AliasTable(weights);
+			row_weights[y] = columns[y].sum() * cos_theta;
+		}
+	});
+	rows = myn::AliasTable(row_weights);
+
+	// average over the sphere: each cell covers 2 pi^2 cos_theta / #cells of its 4 pi
+	vec3 sum = vec3(0);
+	for (const vec3& s : row_sums) sum += s;
+	average = sum * (2 * PI * PI / float(cell_width * cell_height)) / (4 * PI);
+}
+
+float PathtracerEnvironmentLight::get_weight() {
+	// about what it'd shine onto a surface, to compare to directional lights
+	return luminance(average) * PI;
+}
+
+vec3 PathtracerEnvironmentLight::get_radiance(const vec3& wi) {
+	if (sky) return sky->radiance(wi);
+
+	// bilinear, as in myn::sample::tex::tex2D_float3_bilinear, but wrapping around horizontally and clamped vertically
+	vec2 uv = direction_to_longlat(wi);
+	vec2 coords = vec2(width * uv.x, height * uv.y);
+	vec2 deci = fract(coords);
+	uint32_t x0 = std::min(uint32_t(coords.x), width - 1), x1 = (x0 + 1) % width;
+	uint32_t y0 = std::min(uint32_t(coords.y), height - 1), y1 = std::min(y0 + 1, height - 1);
+	vec3 top = mix(texels[y0 * width + x0], texels[y0 * width + x1], deci.x);
+	vec3 bottom = mix(texels[y1 * width + x0], texels[y1 * width + x1], deci.x);
+	return mix(top, bottom, deci.y);
+}
+
+void PathtracerEnvironmentLight::ray_to_light_and_attenuation(Ray& ray, float& attenuation, vec2 u) {
+	vec2 offset;
+	uint32_t y = rows.sample(u.y, &offset.y);
+	uint32_t x = columns[y].sample(u.x, &offset.x);
+	vec2 uv = (vec2(x, y) + offset) / vec2(distribution_width, distribution_height);
+	ray.d = longlat_to_direction(uv);
+	ray.tmin = EPSILON;
+	ray.tmax = INF;
+
+	float pdf_uv = rows.pmf(y) * columns[y].pmf(x) * float(distribution_width * distribution_height);
+	float pdf = longlat_pdf_to_solid_angle(pdf_uv, std::sqrt(std::max(0.0f, 1 - ray.d.z * ray.d.z)));
+	attenuation = pdf > 0 ? 1.0f / pdf : 0;
+}
+
+float PathtracerEnvironmentLight::pdf(const vec3& wi) const {
+	vec2 uv = direction_to_longlat(wi);
+	uint32_t x = std::min(uint32_t(uv.x * distribution_width), distribution_width - 1);
+	uint32_t y = std::min(uint32_t(uv.y * distribution_height), distribution_height - 1);
+	float pdf_uv = rows.pmf(y) * columns[y].pmf(x) * float(distribution_width * distribution_height);
+	return longlat_pdf_to_solid_angle(pdf_uv, std::sqrt(std::max(0.0f, 1 - wi.z * wi.z)));
+}
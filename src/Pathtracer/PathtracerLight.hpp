@@ -1,8 +1,17 @@
 #pragma once
+#include "Utils/myn/AliasTable.h"
 #include <glm/glm.hpp>
+#include <vector>
+
+// environment light: the distribution for picking directions is at most this many columns wide
+#define ENVIRONMENT_LIGHT_MAX_DISTRIBUTION_WIDTH 1024
+// ... and the CPU sky gets baked at this many columns (and half as many rows) for it
+#define ENVIRONMENT_LIGHT_SKY_DISTRIBUTION_WIDTH 256
 
 struct Ray;
-struct Triangle;
+struct BSDF;
+struct LightBounds;
+class SkyRadianceCache;
 
 namespace myn::sky{ class CpuSkyAtmosphere; }
 
@@ -14,7 +23,12 @@ public:
 
 	virtual float get_weight() = 0;
 	virtual glm::vec3 get_emission() = 0;
-	virtual void ray_to_light_and_attenuation(Ray& ray, float& attenuation) = 0;
+	// what arrives from the light along wi (pointing towards the light); only the environment depends on wi
+	virtual glm::vec3 get_radiance(const glm::vec3& wi) { return get_emission(); }
+	// u: uniform sample in [0, 1)^2 for picking a point on area lights
+	virtual void ray_to_light_and_attenuation(Ray& ray, float& attenuation, glm::vec2 u) = 0;
+	// for the light BVH; false for lights that aren't anywhere in particular (directional, environment)
+	virtual bool get_bounds(LightBounds& bounds) { return false; }
 
 protected:
 	bool _is_delta;
@@ -22,16 +36,21 @@ protected:
 
 class PathtracerMeshLight : public PathtracerLight {
 public:
-	explicit PathtracerMeshLight(Triangle* _triangle);
+	// an emissive triangle, in world space (copied out, since mesh data is shared by instances)
+	PathtracerMeshLight(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const BSDF* _bsdf);
 	~PathtracerMeshLight() override = default;
 
 	float get_weight() override;
 	glm::vec3 get_emission() override;
 
 	// atten considers pdf for sampling this particular ray among A' (area projected onto hemisphere)
-	void ray_to_light_and_attenuation(Ray& ray, float& attenuation) override;
+	void ray_to_light_and_attenuation(Ray& ray, float& attenuation, glm::vec2 u) override;
+	bool get_bounds(LightBounds& bounds) override;
 
-	Triangle* triangle;
+	glm::vec3 vertices[3];
+	glm::vec3 normal;
+	float area;
+	const BSDF* bsdf;
 };
 
 class PathtracerPointLight : public PathtracerLight {
@@ -42,7 +61,8 @@ public:
 	float get_weight() override;
 	glm::vec3 get_emission() override { return emission; }
 
-	void ray_to_light_and_attenuation(Ray& ray, float &attenuation) override;
+	void ray_to_light_and_attenuation(Ray& ray, float &attenuation, glm::vec2 u) override;
+	bool get_bounds(LightBounds& bounds) override;
 
 private:
 	glm::vec3 position;
@@ -57,11 +77,53 @@ public:
 	float get_weight() override;
 	glm::vec3 get_emission() override { return emission; }
 
-	void ray_to_light_and_attenuation(Ray& ray, float &attenuation) override;
+	void ray_to_light_and_attenuation(Ray& ray, float &attenuation, glm::vec2 u) override;
 
 	void apply_sky(const myn::sky::CpuSkyAtmosphere* cpuSky);
 
 private:
 	glm::vec3 direction;
 	glm::vec3 emission;
-};
\ No newline at end of file
+};
+
+// light from infinitely far away in every direction: an environment map or the CPU sky. Directions map to long-lat
+// coordinates the way myn::sample::tex::longlatmap_float3 does it (+z up), and get picked in proportion to
+// radiance * solid angle: an alias table over the rows, then one over the columns of the picked row.
+class PathtracerEnvironmentLight : public PathtracerLight {
+public:
+	// texels: width * height, row by row starting at +z. Not copied, so they have to outlive the light
+	PathtracerEnvironmentLight(const glm::vec3* texels, uint32_t width, uint32_t height);
+	// the sky gets sampled coarsely for picking directions, and evaluated through the cache
+	explicit PathtracerEnvironmentLight(const SkyRadianceCache* sky);
+	~PathtracerEnvironmentLight() override = default;
+
+	float get_weight() override;
+	// average radiance
+	glm::vec3 get_emission() override { return average; }
+	glm::vec3 get_radiance(const glm::vec3& wi) override;
+
+	void ray_to_light_and_attenuation(Ray& ray, float &attenuation, glm::vec2 u) override;
+	// solid angle density of ray_to_light_and_attenuation picking direction wi
+	float pdf(const glm::vec3& wi) const;
+
+private:
+	void build_distribution(const glm::vec3* cell_texels, uint32_t cell_width, uint32_t cell_height);
+
+	const glm::vec3* texels = nullptr;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	const SkyRadianceCache* sky = nullptr;
+	glm::vec3 average = glm::vec3(0);
+
+	uint32_t distribution_width = 0;
+	uint32_t distribution_height = 0;
+	myn::AliasTable rows;
+	std::vector<myn::AliasTable> columns;
+};
+
+// multiple importance sampling weight of a sample drawn with density pdf_f, when one with density pdf_g could have
+// drawn it too (the power heuristic, Veach 1997)
+inline float power_heuristic(float pdf_f, float pdf_g) {
+	float f2 = pdf_f * pdf_f, g2 = pdf_g * pdf_g;
+	return f2 + g2 > 0 ? f2 / (f2 + g2) : 0;
+}
@@ -0,0 +1,266 @@
+#include "Pathtracer.hpp"
+#include "PathtracerLight.hpp"
+#include "BSDF.hpp"
+#include "Primitive.hpp"
+#include "Wavefront.hpp"
+
+// Same estimator as trace_ray, drawing the same samples in the same order along each path, so both integrators
+// converge to the same image. What differs is the order of work: trace_ray follows one path to its end, casting its
+// shadow rays as it goes; here each stage runs over the whole batch before the next one starts.
+
+void Pathtracer::raytrace_pixels_wavefront(const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples) {
+	if (num_samples == 0) return;
+	WavefrontBatch& batch = wavefront_batches[myn::jobs::thread_index()];
+	uint32_t pixels_per_batch = std::max(1u, WAVEFRONT_MAX_BATCH_PATHS / num_samples);
+
+	for (uint32_t first = 0; first < num_pixels; first += pixels_per_batch) {
+		uint32_t batch_pixels = std::min(pixels_per_batch, num_pixels - first);
+		wavefront_generate(batch, pixels + first, batch_pixels, num_samples);
+
+		for (int ray_depth = 0; ray_depth < cached_config.MaxRayDepth && !batch.live.empty(); ray_depth++) {
+			wavefront_extend(batch, ray_depth);
+			wavefront_shade(batch, ray_depth);
+			wavefront_shadow(batch, ray_depth);
+		}
+
+		// gather each pixel's samples (they're contiguous) into the film
+		WavefrontPaths& p = batch.paths;
+		for (uint32_t j = 0; j < batch_pixels; j++) {
+			vec3 result = vec3(0), result_even = vec3(0);
+			vec3 albedo = vec3(0), normal = vec3(0), direct = vec3(0);
+			float depth = INF;
+			for (uint32_t i = j * num_samples; i < (j + 1) * num_samples; i++) {
+				result += p.output[i];
+				if (p.samples[i].sample_index % 2 == 0) result_even += p.output[i];
+				albedo += p.first_albedo[i];
+				normal += p.first_normal[i];
+				direct += p.direct[i];
+				depth = std::min(depth, p.first_depth[i]);
+			}
+			film.add_samples(pixels[first + j], result, result_even, num_samples);
+			if (film.has_aovs) film.add_aovs(pixels[first + j], albedo, normal, direct, depth);
+		}
+	}
+}
+
+void Pathtracer::wavefront_generate(WavefrontBatch& batch, const uint32_t* pixels, uint32_t num_pixels, uint32_t num_samples) {
+	WavefrontPaths& p = batch.paths;
+	uint32_t num_paths = num_pixels * num_samples;
+	p.resize(num_paths);
+	batch.live.resize(num_paths);
+
+	Ray ray;
+	for (uint32_t j = 0; j < num_pixels; j++) {
+		uint32_t index = pixels[j];
+		uint32_t first_sample = film.num_samples[index];
+		for (uint32_t s = 0; s < num_samples; s++) {
+			uint32_t i = j * num_samples + s;
+			p.samples[i] = SampleStream{ sampler, index, first_sample + s, 0 };
+			generate_camera_ray(ray, p.samples[i], index);
+			p.ray_o[i] = ray.o;
+			p.ray_d[i] = ray.d;
+			p.receive_le[i] = false;
+			p.bsdf_pdf[i] = 0;
+			p.contribution[i] = vec3(1);
+			p.output[i] = vec3(0);
+			p.first_albedo[i] = vec3(0);
+			p.first_normal[i] = vec3(0);
+			p.first_depth[i] = INF;
+			p.direct[i] = vec3(0);
+			batch.live[i] = i;
+		}
+	}
+}
+
+void Pathtracer::wavefront_extend(WavefrontBatch& batch, int ray_depth) {
+	WavefrontPaths& p = batch.paths;
+	if (ray_depth == 0 && cached_config.PacketCameraRays) {
+		// camera rays: neighboring pixels are next to each other in live, so take them a packet at a time
+		RayPacket packet;
+		for (uint32_t b = 0; b < batch.live.size(); b += RAY_PACKET_SIZE) {
+			uint32_t end = std::min(uint32_t(batch.live.size()), b + RAY_PACKET_SIZE);
+			packet.size = 0;
+			for (uint32_t k = b; k < end; k++) packet.add(Ray(p.ray_o[batch.live[k]], p.ray_d[batch.live[k]]));
+			scene_bvh->intersect_packet(packet, cached_config.UseBVH);
+			for (uint32_t k = b; k < end; k++) {
+				uint32_t i = batch.live[k];
+				p.hit_primitive[i] = packet.primitive[k - b];
+				p.hit_t[i] = packet.t[k - b];
+				p.hit_n[i] = packet.n[k - b];
+				p.hit_instance[i] = packet.instance[k - b];
+			}
+		}
+		ray_counters[myn::jobs::thread_index()].num_rays += batch.live.size();
+		return;
+	}
+	for (uint32_t i : batch.live) {
+		Ray ray(p.ray_o[i], p.ray_d[i]);
+		double t; vec3 n; uint32_t instance;
+		p.hit_primitive[i] = scene_bvh->intersect_primitives(ray, t, n, instance, cached_config.UseBVH, cached_config.UseWideBVH);
+		p.hit_t[i] = float(t);
+		p.hit_n[i] = n;
+		p.hit_instance[i] = instance;
+	}
+	ray_counters[myn::jobs::thread_index()].num_rays += batch.live.size();
+}
+
+void Pathtracer::wavefront_shade(WavefrontBatch& batch, int ray_depth) {
+	WavefrontPaths& p = batch.paths;
+	batch.shadow_rays.clear();
+
+	// misses pick up the environment, and end there
+	float environment_light_pmf = environment ? environment_pmf() : 0;
+	for (uint32_t i : batch.live) {
+		if (p.hit_primitive[i] >= 0) continue;
+		if (environment) {
+			vec3 Le = environment->get_radiance(p.ray_d[i]);
+			if (p.bsdf_pdf[i] > 0) {
+				float light_pdf = environment_light_pmf * environment->pdf(p.ray_d[i]);
+				Le *= power_heuristic(p.bsdf_pdf[i], cached_config.DirectLightSamples * light_pdf);
+			}
+			p.output[i] += p.contribution[i] * Le;
+		}
+		if (ray_depth == 0) p.direct[i] = p.output[i];
+	}
+
+	// hits, counting sorted by BSDF type so that each type gets shaded in one loop of its own
+	constexpr int num_types = BSDF::Glass + 1;
+	uint32_t type_begin[num_types + 1] = {};
+	for (uint32_t i : batch.live) {
+		if (p.hit_primitive[i] >= 0) type_begin[scene_bvh->instances[p.hit_instance[i]].bsdf->type + 1]++;
+	}
+	for (int k = 0; k < num_types; k++) type_begin[k + 1] += type_begin[k];
+	batch.hits.resize(type_begin[num_types]);
+	uint32_t type_end[num_types];
+	std::copy(type_begin, type_begin + num_types, type_end);
+	for (uint32_t i : batch.live) {
+		if (p.hit_primitive[i] >= 0) batch.hits[type_end[scene_bvh->instances[p.hit_instance[i]].bsdf->type]++] = i;
+	}
+
+	uint32_t* hits = batch.hits.data();
+	wavefront_shade_hits<Diffuse>(batch, hits + type_begin[BSDF::Diffuse], hits + type_end[BSDF::Diffuse], ray_depth);
+	wavefront_shade_hits<Mirror>(batch, hits + type_begin[BSDF::Mirror], hits + type_end[BSDF::Mirror], ray_depth);
+	wavefront_shade_hits<Glass>(batch, hits + type_begin[BSDF::Glass], hits + type_end[BSDF::Glass], ray_depth);
+
+	// keep the paths that continue, still in pixel order
+	batch.next_live.clear();
+	for (uint32_t i : batch.live) {
+		if (p.hit_primitive[i] >= 0) batch.next_live.push_back(i);
+	}
+	std::swap(batch.live, batch.next_live);
+}
+
+template<typename BSDFType>
+void Pathtracer::wavefront_shade_hits(WavefrontBatch& batch, const uint32_t* begin, const uint32_t* end, int ray_depth) {
+	WavefrontPaths& p = batch.paths;
+	WavefrontShadowRays& shadow = batch.shadow_rays;
+	bool direct_light = cached_config.UseDirectLight && !lights.empty();
+	float each_sample_weight = 1.0f / (float) cached_config.DirectLightSamples;
+
+	for (const uint32_t* it = begin; it != end; it++) {
+		uint32_t i = *it;
+		// (the type is known here, so BSDFType:: calls skip the virtual dispatch)
+		const BSDFType* bsdf = static_cast<const BSDFType*>(scene_bvh->instances[p.hit_instance[i]].bsdf);
+		vec3 n = p.hit_n[i];
+		if (ray_depth == 0) {
+			p.first_albedo[i] = bsdf->albedo;
+			p.first_normal[i] = n;
+			p.first_depth[i] = p.hit_t[i];
+		}
+		vec3 hit_p = p.ray_o[i] + p.hit_t[i] * p.ray_d[i];
+		mat3 h2w;
+		make_h2w(h2w, n);
+		mat3 w2h = transpose(h2w);
+		vec3 wo_hemi = -w2h * p.ray_d[i];
+		SampleStream& samples = p.samples[i];
+
+		//---- emission ----
+		vec3 Le = vec3(0);
+		if (cached_config.UseDirectLight) {
+			if (ray_depth == 0 || p.receive_le[i] || !bsdf->is_emissive) Le = bsdf->get_emission();
+		} else {
+			Le = bsdf->get_emission();
+		}
+		p.output[i] += p.contribution[i] * Le;
+		if (ray_depth == 0) p.direct[i] = p.output[i];
+
+		//---- direct light: queue a shadow ray per light sample ----
+		if (direct_light && !bsdf->is_delta) {
+			for (uint32_t k = 0; k < cached_config.DirectLightSamples; k++) {
+				float u_light = samples.get_1d();
+				vec2 u_point = samples.get_2d();
+				PathtracerLight *light;
+				float one_over_pdf;
+				if (!select_random_light(light, one_over_pdf, u_light, hit_p, n)) continue;
+
+				Ray ray_to_light;
+				float attenuation;
+				ray_to_light.o = hit_p;
+				light->ray_to_light_and_attenuation(ray_to_light, attenuation, u_point);
+
+				vec3 wi_hemi = w2h * ray_to_light.d;
+				float costhetai = std::max(0.0f, dot(n, ray_to_light.d));
+				vec3 L_direct = light->get_radiance(ray_to_light.d) * bsdf->BSDFType::f(wi_hemi, wo_hemi, false) * costhetai
+								* attenuation * one_over_pdf * each_sample_weight;
+				if (light == environment) {
+					float light_pdf = environment->pdf(ray_to_light.d) / one_over_pdf;
+					L_direct *= power_heuristic(cached_config.DirectLightSamples * light_pdf, bsdf->BSDFType::pdf(wi_hemi, wo_hemi));
+				}
+				if (glm::isnan(L_direct.x) || glm::isnan(L_direct.y) || glm::isnan(L_direct.z)) continue;
+
+				shadow.o.push_back(ray_to_light.o);
+				shadow.d.push_back(ray_to_light.d);
+				shadow.tmin.push_back(ray_to_light.tmin);
+				shadow.tmax.push_back(ray_to_light.tmax);
+				shadow.contribution.push_back(p.contribution[i] * L_direct);
+				shadow.path.push_back(i);
+			}
+		}
+
+		//---- indirect: sample the next ray, or end the path (which shade then drops, as if it had missed) ----
+		if (cached_config.UseDirectLight && bsdf->is_emissive) {
+			p.hit_primitive[i] = -1;
+			continue;
+		}
+
+		float pdf;
+		vec3 wi_hemi;
+		vec3 f = bsdf->BSDFType::sample_f(pdf, wi_hemi, wo_hemi, samples.get_2d(), false);
+		vec3 wi_world = h2w * wi_hemi;
+		float costhetai = abs(dot(n, wi_world));
+
+		// russian roulette (every ray starts out with rr_contribution 1, see trace_ray)
+		float termination_prob = 0.0f;
+		float rr_contribution = brightness(f) * costhetai;
+		if (rr_contribution < cached_config.RussianRouletteThreshold) {
+			termination_prob = (cached_config.RussianRouletteThreshold - rr_contribution)
+				/ cached_config.RussianRouletteThreshold;
+		}
+		if (samples.get_1d() < termination_prob) {
+			p.hit_primitive[i] = -1;
+			continue;
+		}
+
+		vec3 refl_offset = wi_hemi.z > 0 ? EPSILON * n : -EPSILON * n;
+		p.ray_o[i] = hit_p + refl_offset;
+		p.ray_d[i] = wi_world;
+		p.receive_le[i] = cached_config.UseDirectLight && bsdf->is_delta;
+		p.bsdf_pdf[i] = cached_config.UseDirectLight && !bsdf->is_delta ? pdf : 0;
+		p.contribution[i] *= f * costhetai / pdf * (1.0f / (1.0f - termination_prob));
+	}
+}
+
+void Pathtracer::wavefront_shadow(WavefrontBatch& batch, int ray_depth) {
+	WavefrontPaths& p = batch.paths;
+	WavefrontShadowRays& shadow = batch.shadow_rays;
+	for (uint32_t k = 0; k < shadow.size(); k++) {
+		Ray ray(shadow.o[k], shadow.d[k]);
+		ray.tmin = shadow.tmin[k];
+		ray.tmax = shadow.tmax[k];
+		if (scene_bvh->occluded(ray, cached_config.UseBVH, cached_config.UseWideBVH)) continue;
+		uint32_t i = shadow.path[k];
+		p.output[i] += shadow.contribution[k];
+		if (ray_depth == 0) p.direct[i] += shadow.contribution[k];
+	}
+	ray_counters[myn::jobs::thread_index()].num_rays += shadow.size();
+}
@@ -1,133 +1,271 @@
 #include "Primitive.hpp"
 #include "Render/Mesh.h"
 #include "BSDF.hpp"
-#include "Utils/myn/Sample.h"
-#include <unordered_map>
 
-#define USE_EMBEDDED_NORMAL 0
-#define USE_INTERPOLATED_NORMAL 0 // slower, ofc
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define TRIANGLE_STORE_SSE 1
+#include <xmmintrin.h>
+#else
+#define TRIANGLE_STORE_SSE 0
+#endif
 
 using namespace glm;
 
-Triangle::Triangle(
-		const mat4& o2w, 
-		const Vertex& v1, 
-		const Vertex& v2, 
-		const Vertex& v3,
-		BSDF* _bsdf) {
-	// position
-	vertices[0] = vec3(o2w * vec4(v1.position, 1));
-	vertices[1] = vec3(o2w * vec4(v2.position, 1));
-	vertices[2] = vec3(o2w * vec4(v3.position, 1));
-
-	// two edges
-	e1 = vertices[1] - vertices[0];
-	e2 = vertices[2] - vertices[0];
-
-	// precompute true normal and distance to origin
-	vec3 u = e1;
-	vec3 v = e2;
-	if (dot(u, v) > 1.0f - 0.1f * EPSILON) { // if unfortunately picked a very sharp angle
-		u = vertices[2] - vertices[1];
-		v = vertices[0] - vertices[1];
+namespace
+{
+inline vec3 load(const std::vector<float> (&soa)[3], uint32_t i) {
+	return {soa[0][i], soa[1][i], soa[2][i]};
+}
+inline void store(std::vector<float> (&soa)[3], const vec3& v) {
+	for (int a = 0; a < 3; a++) soa[a].push_back(v[a]);
+}
+template<typename T>
+void permute(std::vector<T>& data, uint32_t start, const std::vector<uint32_t>& order, uint32_t stride = 1) {
+	std::vector<T> tmp(order.size() * stride);
+	for (uint32_t i = 0; i < order.size(); i++) {
+		for (uint32_t k = 0; k < stride; k++) tmp[i * stride + k] = data[order[i] * stride + k];
 	}
-	plane_n = normalize(cross(u, v));
-	plane_k = dot(vertices[0], plane_n);
-
-// normal. TODO: correct to transform this way even if object is non-uniformly scaled?
-#if USE_EMBEDDED_NORMAL
-	normals[0] = normalize(vec3(o2w * vec4(v1.normal, 1)));
-	normals[1] = normalize(vec3(o2w * vec4(v2.normal, 1)));
-	normals[2] = normalize(vec3(o2w * vec4(v3.normal, 1)));
-#else
-	normals[0] = plane_n;
-	normals[1] = plane_n;
-	normals[2] = plane_n;
-#endif
+	std::copy(tmp.begin(), tmp.end(), data.begin() + start * stride);
+}
+template<typename T>
+void gather(std::vector<T>& data, const std::vector<uint32_t>& order, uint32_t stride = 1, uint32_t padding = 0) {
+	std::vector<T> result(order.size() * stride + padding);
+	for (uint32_t i = 0; i < order.size(); i++) {
+		for (uint32_t k = 0; k < stride; k++) result[i * stride + k] = data[order[i] * stride + k];
+	}
+	data = std::move(result);
+}
+}
 
-	// precompute area
-	area = length(cross(e1, e2)) * 0.5f;
-
-	// precompute edge normals
-	enormals[0] = normalize(cross(plane_n, vertices[1] - vertices[0]));
-	enormals[1] = normalize(cross(plane_n, vertices[2] - vertices[1]));
-	enormals[2] = normalize(cross(plane_n, vertices[0] - vertices[2]));
-
-	bsdf = _bsdf;
-}
-
-Primitive* Triangle::intersect(Ray& ray, double& t, vec3& normal, bool modify_ray = true) {
-	// ray parallel to plane
-	float d_dot_n = dot(ray.d, plane_n);
-	if (abs(d_dot_n) == 0.0f) return nullptr;
-	// intersection out of range
-	double _t = (plane_k - dot(ray.o, plane_n)) / d_dot_n;
-	if (_t < ray.tmin || _t > ray.tmax) return nullptr;
-
-	vec3 p = ray.o + float(_t) * ray.d;
-	// barycentric coordinate with axes v[1] - v[0], v[2] - v[0]
-	vec3 p0 = p - vertices[0];
-#if USE_INTERPOLATED_NORMAL // barycentric coords
-	// also see: https://gamedev.stackexchange.com/questions/23743/whats-the-most-efficient-way-to-find-barycentric-coordinates
-	float u = dot(p0, enormals[0]) / dot(e2, enormals[0]);
-	float v = dot(p0, enormals[2]) / dot(e1, enormals[2]);
-	if (u < 0 || v < 0 || u + v > 1) return nullptr;
-#else // test sides for each edge
-	// other early outs: intersection not in triangle TODO: precompute some of these
-	if (dot(p - vertices[0], enormals[0]) < 0) return nullptr;
-	if (dot(p - vertices[1], enormals[1]) < 0) return nullptr;
-	if (dot(p - vertices[2], enormals[2]) < 0) return nullptr;
-#endif
+TriangleRay::TriangleRay(const Ray& ray) : o(ray.o), tmin(float(ray.tmin)) {
+	vec3 abs_d = abs(ray.d);
+	kz = abs_d.x > abs_d.y ? (abs_d.x > abs_d.z ? 0 : 2) : (abs_d.y > abs_d.z ? 1 : 2);
+	kx = (kz + 1) % 3;
+	ky = (kx + 1) % 3;
+	// keep the winding of the sheared triangle consistent
+	if (ray.d[kz] < 0) std::swap(kx, ky);
+	sx = ray.d[kx] / ray.d[kz];
+	sy = ray.d[ky] / ray.d[kz];
+	sz = 1.0f / ray.d[kz];
+}
 
-	// intersection is valid.
-	if (modify_ray) ray.tmax = _t;
-	t = _t;
-#if USE_INTERPOLATED_NORMAL
-	normal = normalize((1-u-v) * normals[0] + u * normals[2] + v * normals[1]);
-#else
-	normal = plane_n;
-#endif
-	return this;
+void TriangleStore::clear() {
+	// (also releases the memory, unlike vector::clear)
+	*this = TriangleStore();
+}
+
+void TriangleStore::reserve(uint32_t num_vertices, uint32_t num_triangles) {
+	positions.reserve(num_vertices);
+	indices.reserve(size_t(num_triangles) * 3);
+	material_ids.reserve(num_triangles);
+	for (int a = 0; a < 3; a++) {
+		v0[a].reserve(num_triangles + TRIANGLE_STORE_PADDING);
+		v1[a].reserve(num_triangles + TRIANGLE_STORE_PADDING);
+		v2[a].reserve(num_triangles + TRIANGLE_STORE_PADDING);
+	}
+}
+
+uint32_t TriangleStore::add_material(const BSDF* bsdf) {
+	for (uint32_t i = 0; i < materials.size(); i++) {
+		if (materials[i] == bsdf) return i;
+	}
+	materials.push_back(bsdf);
+	return materials.size() - 1;
+}
+
+void TriangleStore::add_mesh(const mat4& o2w, const Mesh* mesh, uint32_t material_id) {
+	uint32_t base = positions.size();
+	uint32_t num_triangles = mesh->get_num_indices() / 3;
+
+	for (uint32_t i = 0; i < mesh->get_num_vertices(); i++) {
+		positions.push_back(vec3(o2w * vec4(mesh->get_vertices()[i].position, 1)));
+	}
+
+	// take the padding off, append, then put it back
+	for (int a = 0; a < 3; a++) {
+		v0[a].resize(size());
+		v1[a].resize(size());
+		v2[a].resize(size());
+	}
+	const VERTEX_INDEX_TYPE* mesh_indices = mesh->get_indices();
+	for (uint32_t i = 0; i < num_triangles * 3; i += 3) {
+		for (int k = 0; k < 3; k++) indices.push_back(base + mesh_indices[i + k]);
+		material_ids.push_back(material_id);
+
+		uint32_t tri = material_ids.size() - 1;
+		store(v0, vertex(tri, 0));
+		store(v1, vertex(tri, 1));
+		store(v2, vertex(tri, 2));
+	}
+	for (int a = 0; a < 3; a++) {
+		v0[a].resize(size() + TRIANGLE_STORE_PADDING, 0.0f);
+		v1[a].resize(size() + TRIANGLE_STORE_PADDING, 0.0f);
+		v2[a].resize(size() + TRIANGLE_STORE_PADDING, 0.0f);
+	}
 }
 
-vec3 Triangle::sample_point() const {
-	float u = myn::sample::rand01();
-	float v = myn::sample::rand01();
-	if (u + v > 1) {
-		u = 1.0f - u;
-		v = 1.0f - v;
+void TriangleStore::reorder(uint32_t start, const std::vector<uint32_t>& order) {
+	if (!duplicates.empty()) permute(duplicates, start, order);
+	permute(indices, start, order, 3);
+	permute(material_ids, start, order);
+	for (int a = 0; a < 3; a++) {
+		permute(v0[a], start, order);
+		permute(v1[a], start, order);
+		permute(v2[a], start, order);
 	}
-	
-	vec3 e1 = vertices[1] - vertices[0];
-	vec3 e2 = vertices[2] - vertices[0];
+}
 
-	return vertices[0] + e1 * u + e2 * v;
+void TriangleStore::assign_references(const std::vector<uint32_t>& order) {
+	std::vector<bool> referenced(size(), false);
+	duplicates.assign(order.size(), false);
+	num_duplicates = 0;
+	for (uint32_t i = 0; i < order.size(); i++) {
+		if (referenced[order[i]]) {
+			duplicates[i] = true;
+			num_duplicates++;
+		}
+		referenced[order[i]] = true;
+	}
+	if (num_duplicates == 0) duplicates.clear();
+
+	gather(indices, order, 3);
+	gather(material_ids, order);
+	for (int a = 0; a < 3; a++) {
+		gather(v0[a], order, 1, TRIANGLE_STORE_PADDING);
+		gather(v1[a], order, 1, TRIANGLE_STORE_PADDING);
+		gather(v2[a], order, 1, TRIANGLE_STORE_PADDING);
+	}
 }
 
-//-------------- Sphere ----------------
+size_t TriangleStore::memory_bytes() const {
+	size_t bytes = positions.capacity() * sizeof(vec3)
+		+ indices.capacity() * sizeof(uint32_t)
+		+ material_ids.capacity() * sizeof(uint32_t)
+		+ materials.capacity() * sizeof(const BSDF*)
+		+ duplicates.capacity() / 8;
+	for (int a = 0; a < 3; a++) {
+		bytes += (v0[a].capacity() + v1[a].capacity() + v2[a].capacity()) * sizeof(float);
+	}
+	return bytes;
+}
+
+void TriangleStore::get_extents(uint32_t tri, vec3& out_min, vec3& out_max) const {
+	vec3 p0 = vertex(tri, 0);
+	vec3 p1 = vertex(tri, 1);
+	vec3 p2 = vertex(tri, 2);
+	out_min = glm::min(p0, glm::min(p1, p2));
+	out_max = glm::max(p0, glm::max(p1, p2));
+}
+
+vec3 TriangleStore::normal(uint32_t tri) const {
+	vec3 p0 = load(v0, tri);
+	return normalize(cross(load(v1, tri) - p0, load(v2, tri) - p0));
+}
 
-Sphere::~Sphere() {
-	delete bsdf;
+float TriangleStore::area(uint32_t tri) const {
+	vec3 p0 = load(v0, tri);
+	return length(cross(load(v1, tri) - p0, load(v2, tri) - p0)) * 0.5f;
 }
 
-Primitive* Sphere::intersect(Ray& ray, double& t, vec3& normal, bool modify_ray = true) {
-	vec3 p = ray.o - center;
-	float r2 = r * r;
-	// a = 1
-	float b = 2 * dot(p, ray.d);
-	float c = dot(p, p) - r2;
-	float det = b * b - 4 * c;
+/*
+ * Watertight test (Woop, Benthin, Wald 2013), two sided, all in float.
+ * Vertices are moved into the sheared ray space; U, V, W are the scaled barycentrics (2d edge functions
+ * around the origin), the hit is inside iff they don't have mixed signs. Zeros count as inside,
+ * so rays through edges and vertices still hit at least one of the triangles sharing them.
+ */
+int TriangleStore::intersect4(const TriangleRay& ray, uint32_t first, float tmax, float* out_t) const {
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+#if TRIANGLE_STORE_SSE
+	const __m128 ox = _mm_set1_ps(ray.o[kx]);
+	const __m128 oy = _mm_set1_ps(ray.o[ky]);
+	const __m128 oz = _mm_set1_ps(ray.o[kz]);
+	const __m128 sx = _mm_set1_ps(ray.sx);
+	const __m128 sy = _mm_set1_ps(ray.sy);
+	const __m128 sz = _mm_set1_ps(ray.sz);
 
-	if (det < 0) return nullptr; // no intersection
+	// vertices relative to the ray origin; then shear x and y
+	__m128 az = _mm_sub_ps(_mm_loadu_ps(&v0[kz][first]), oz);
+	__m128 bz = _mm_sub_ps(_mm_loadu_ps(&v1[kz][first]), oz);
+	__m128 cz = _mm_sub_ps(_mm_loadu_ps(&v2[kz][first]), oz);
+	__m128 ax = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v0[kx][first]), ox), _mm_mul_ps(sx, az));
+	__m128 ay = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v0[ky][first]), oy), _mm_mul_ps(sy, az));
+	__m128 bx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v1[kx][first]), ox), _mm_mul_ps(sx, bz));
+	__m128 by = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v1[ky][first]), oy), _mm_mul_ps(sy, bz));
+	__m128 cx = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v2[kx][first]), ox), _mm_mul_ps(sx, cz));
+	__m128 cy = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(&v2[ky][first]), oy), _mm_mul_ps(sy, cz));
 
-	double rt_det = sqrt(det);
-	double t_tmp = 0.5f * (-b - rt_det); // t1
-	if (t_tmp < ray.tmin || t_tmp > ray.tmax) t_tmp = 0.5f * (-b + rt_det); // t2
-	if (t_tmp < ray.tmin || t_tmp > ray.tmax) return nullptr; // intersection(s) not valid
+	__m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+	__m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+	__m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
 
-	// outputs
-	t = t_tmp;
-	if (modify_ray) ray.tmax = t_tmp;
-	normal = normalize(ray.o + float(t) * ray.d - center);
-	return this;
+	const __m128 zero = _mm_setzero_ps();
+	__m128 any_neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+	__m128 any_pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+	__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+	__m128 valid = _mm_andnot_ps(_mm_and_ps(any_neg, any_pos), _mm_cmpneq_ps(det, zero));
+
+	// scaled distance; dividing by det in masked-out lanes is harmless
+	__m128 t_scaled = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, az), _mm_mul_ps(v, bz)), _mm_mul_ps(w, cz));
+	__m128 t = _mm_div_ps(_mm_mul_ps(sz, t_scaled), det);
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(t, _mm_set1_ps(ray.tmin)));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(t, _mm_set1_ps(tmax)));
+
+	_mm_storeu_ps(out_t, t);
+	return _mm_movemask_ps(valid);
+#else
+	int mask = 0;
+	for (int i = 0; i < TRIANGLE_STORE_BATCH; i++) {
+		uint32_t tri = first + i;
+		float az = v0[kz][tri] - ray.o[kz];
+		float bz = v1[kz][tri] - ray.o[kz];
+		float cz = v2[kz][tri] - ray.o[kz];
+		float ax = v0[kx][tri] - ray.o[kx] - ray.sx * az;
+		float ay = v0[ky][tri] - ray.o[ky] - ray.sy * az;
+		float bx = v1[kx][tri] - ray.o[kx] - ray.sx * bz;
+		float by = v1[ky][tri] - ray.o[ky] - ray.sy * bz;
+		float cx = v2[kx][tri] - ray.o[kx] - ray.sx * cz;
+		float cy = v2[ky][tri] - ray.o[ky] - ray.sy * cz;
+
+		float u = cx * by - cy * bx;
+		float v = ax * cy - ay * cx;
+		float w = bx * ay - by * ax;
+		bool any_neg = (u < 0) | (v < 0) | (w < 0);
+		bool any_pos = (u > 0) | (v > 0) | (w > 0);
+		float det = u + v + w;
+		if ((any_neg & any_pos) | (det == 0)) continue;
+
+		float t = ray.sz * (u * az + v * bz + w * cz) / det;
+		out_t[i] = t;
+		mask |= int((t >= ray.tmin) & (t <= tmax)) << i;
+	}
+	return mask;
+#endif
+}
+
+int TriangleStore::intersect_leaf(const TriangleRay& ray, uint32_t first, uint32_t count, float& tmax) const {
+	int hit = -1;
+	for (uint32_t i = first; i < first + count; i += TRIANGLE_STORE_BATCH) {
+		float t[TRIANGLE_STORE_BATCH];
+		int mask = intersect4(ray, i, tmax, t);
+		// lanes past the end of the leaf
+		if (first + count - i < TRIANGLE_STORE_BATCH) mask &= (1 << (first + count - i)) - 1;
+		// same order (and tie-breaking) as testing one triangle at a time
+		for (int k = 0; mask != 0; k++, mask >>= 1) {
+			if ((mask & 1) && t[k] <= tmax) {
+				tmax = t[k];
+				hit = i + k;
+			}
+		}
+	}
+	return hit;
+}
+
+bool TriangleStore::occludes_leaf(const TriangleRay& ray, uint32_t first, uint32_t count, float tmax) const {
+	for (uint32_t i = first; i < first + count; i += TRIANGLE_STORE_BATCH) {
+		float t[TRIANGLE_STORE_BATCH];
+		int mask = intersect4(ray, i, tmax, t);
+		if (first + count - i < TRIANGLE_STORE_BATCH) mask &= (1 << (first + count - i)) - 1;
+		if (mask) return true;
+	}
+	return false;
 }
@@ -1,8 +1,13 @@
 #pragma once
 #include "Utils/myn/Misc.h"
+#include "Sampler.hpp"
+
+// intersect_leaf tests this many triangles at once
+#define TRIANGLE_STORE_BATCH 4
+#define TRIANGLE_STORE_PADDING (TRIANGLE_STORE_BATCH - 1)
 
-struct Vertex;
 struct BSDF;
+struct Mesh;
 
 struct Ray {
 	explicit Ray(glm::vec3 _o = glm::vec3(0), glm::vec3 _d = glm::vec3(0, 0, 1)) : o(_o), d(_d) {
@@ -14,6 +19,9 @@ struct Ray {
 	double tmin, tmax; 
 	float rr_contribution; // TODO: why need tmin?
 	bool receive_le = false;
+	// density the BSDF picked this ray's direction with, if next event estimation at its origin could have picked
+	// it too (then a miss only counts with its MIS weight); 0 otherwise
+	float bsdf_pdf = 0;
 };
 
 struct RayTask {
@@ -24,46 +32,84 @@ struct RayTask {
 	Ray ray;
 	glm::vec3 output{};
 	glm::vec3 contribution{};
+	SampleStream samples; // every random decision along the path draws from here
+	// AOVs, recorded at depth 0 (see Film)
+	glm::vec3 first_albedo{0};
+	glm::vec3 first_normal{0};
+	float first_depth = INF;
+	glm::vec3 direct{0};
+	uint32_t num_rays = 0; // closest hit + shadow rays cast for it
+	// closest hit of ray, if the caller already found it (camera ray packets); trace_ray intersects it otherwise
+	bool has_hit = false;
+	int hit_primitive = -1;
+	double hit_t = 0;
+	glm::vec3 hit_n{0};
+	uint32_t hit_instance = 0;
 };
 
-struct Primitive {
-	virtual Primitive* intersect(Ray& ray, double& t, glm::vec3& normal, bool modify_ray = true) = 0;
-	virtual ~Primitive()= default;
-	const BSDF* bsdf{};
+// per-ray constants of the watertight ray-triangle test (Woop et al. 2013), computed once per traversal.
+// Triangles get translated to the ray origin and sheared so that the ray points down +z.
+struct TriangleRay {
+	TriangleRay() = default;
+	explicit TriangleRay(const Ray& ray);
+	int kx, ky, kz; // permutation of axes, kz is the ray's largest dimension
+	float sx, sy, sz; // shear constants
+	glm::vec3 o;
+	float tmin;
 };
 
-struct Triangle : public Primitive {
-
-	// bsdf gets passed in from mesh, and will be cleaned up by mesh as well.
-	Triangle(const glm::mat4& o2w, const Vertex& v1, const Vertex& v2, const Vertex& v3, BSDF* _bsdf);
+// a set of pathtracer triangles: one mesh in its object space (SceneBVH), or a whole scene flattened into world space.
+// Geometry is indexed (shared vertex positions + 32 bit indices), with a material id per triangle.
+// For intersection, each triangle's vertices are also copied out into struct-of-arrays float arrays,
+// so leaves (contiguous after the BVH build) can be tested 4 triangles at a time.
+struct TriangleStore {
 
-	glm::vec3 vertices[3];
-	glm::vec3 normals[3];
-	glm::vec3 enormals[3]; // cached edge normals
+	std::vector<glm::vec3> positions;
+	std::vector<uint32_t> indices; // 3 per triangle, into positions
+	std::vector<uint32_t> material_ids; // 1 per triangle, into materials
+	std::vector<const BSDF*> materials; // not owned
 
-	// other pre-computed values
-	glm::vec3 e1, e2;
-	glm::vec3 plane_n;
-	float plane_k;
-	float area;
+	// intersection data, [axis][triangle]. Exact copies of the positions (no precomputed edges), which keeps
+	// the test watertight along shared edges. Each array has TRIANGLE_STORE_PADDING extra entries at the end
+	// so the last batch of a leaf can always load 4 floats.
+	std::vector<float> v0[3];
+	std::vector<float> v1[3];
+	std::vector<float> v2[3];
 
-	Primitive* intersect(Ray& ray, double& t, glm::vec3& normal, bool modify_ray) override;
+	std::vector<bool> duplicates; // empty unless assign_references() created some
+	uint32_t num_duplicates = 0;
 
-	glm::vec3 sample_point() const;
+	void clear();
+	// growing the arrays one mesh at a time would briefly need ~2x the memory, so size them up front if possible
+	void reserve(uint32_t num_vertices, uint32_t num_triangles);
+	// returns id of an existing entry if bsdf was already added
+	uint32_t add_material(const BSDF* bsdf);
+	// appends mesh triangles, with vertices transformed by o2w
+	void add_mesh(const glm::mat4& o2w, const Mesh* mesh, uint32_t material_id);
+	// triangle i of [start, start + order.size()) becomes the triangle previously at order[i - start]
+	void reorder(uint32_t start, const std::vector<uint32_t>& order);
+	// replaces all triangles with references order[i] to previous triangles. A triangle may be referenced more than
+	// once (spatial split BVH leaves); all but its first reference get marked as duplicates.
+	void assign_references(const std::vector<uint32_t>& order);
+	bool is_duplicate(uint32_t tri) const { return !duplicates.empty() && duplicates[tri]; }
+	uint32_t num_unique() const { return size() - num_duplicates; }
 
-};
+	uint32_t size() const { return material_ids.size(); }
+	size_t memory_bytes() const;
 
-struct Sphere : public Primitive {
-
-	// since spheres are created and used for pathtracer only, 
-	// it's responsible for managing bsdf memory as well.
-	Sphere(const glm::vec3& _c, float _r, BSDF* _bsdf) : center(_c), r(_r) {
-		bsdf = _bsdf;
-	}
-	~Sphere() override;
+	glm::vec3 vertex(uint32_t tri, int k) const { return positions[indices[3 * tri + k]]; }
+	const BSDF* bsdf(uint32_t tri) const { return materials[material_ids[tri]]; }
+	void get_extents(uint32_t tri, glm::vec3& out_min, glm::vec3& out_max) const;
+	glm::vec3 normal(uint32_t tri) const;
+	float area(uint32_t tri) const;
 
-	glm::vec3 center;
-	float r;
+	// closest hit among triangles [first, first + count) within [ray.tmin, tmax]. On a hit, returns its index
+	// and shrinks tmax to its distance; returns -1 otherwise. Ties go to the later triangle.
+	int intersect_leaf(const TriangleRay& ray, uint32_t first, uint32_t count, float& tmax) const;
+	// any hit among triangles [first, first + count) within [ray.tmin, tmax]
+	bool occludes_leaf(const TriangleRay& ray, uint32_t first, uint32_t count, float tmax) const;
 
-	Primitive* intersect(Ray& ray, double& t, glm::vec3& normal, bool modify_ray) override;
+private:
+	// bitmask of hits among triangles [first, first + 4), plus their distances
+	int intersect4(const TriangleRay& ray, uint32_t first, float tmax, float* out_t) const;
 };
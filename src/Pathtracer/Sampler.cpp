@@ -0,0 +1,312 @@
+#include "Sampler.hpp"
+#include "Utils/myn/Sample.h"
+#include "Utils/myn/Log.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// void-and-cluster mask for the blue noise sampler, tiled over the image
+#define BLUE_NOISE_SIZE 64
+// the largest float below 1
+#define ONE_MINUS_EPSILON 0x1.fffffep-1f
+
+using namespace glm;
+
+namespace {
+
+// lowbias32 (Wellons)
+inline uint32_t hash_u32(uint32_t x) {
+	x ^= x >> 16u;
+	x *= 0x7feb352du;
+	x ^= x >> 15u;
+	x *= 0x846ca68bu;
+	x ^= x >> 16u;
+	return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+	return hash_u32(seed ^ (hash_u32(v) + 0x9e3779b9u + (seed << 6u) + (seed >> 2u)));
+}
+
+inline float to_unit_float(uint32_t x) {
+	return float(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+//-------- independent --------
+
+class IndependentSampler : public Sampler {
+public:
+	IndependentSampler(uint32_t spp, uint32_t w) : Sampler(Independent, spp, w) {}
+
+	float get_1d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		myn::sample::seed(pixel, sample_index, dimension);
+		return myn::sample::rand01();
+	}
+	vec2 get_2d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		myn::sample::seed(pixel, sample_index, dimension);
+		return myn::sample::unit_square_uniform();
+	}
+};
+
+//-------- correlated multi-jittered --------
+// Kensler, "Correlated Multi-Jittered Sampling", Pixar technical memo 13-01 (2013)
+
+// a random permutation of [0, l), indexed by i and chosen by p, without storing it
+uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+	uint32_t w = l - 1;
+	w |= w >> 1u;
+	w |= w >> 2u;
+	w |= w >> 4u;
+	w |= w >> 8u;
+	w |= w >> 16u;
+	do {
+		i ^= p; i *= 0xe170893du;
+		i ^= p >> 16u;
+		i ^= (i & w) >> 4u;
+		i ^= p >> 8u; i *= 0x0929eb3fu;
+		i ^= p >> 23u;
+		i ^= (i & w) >> 1u; i *= 1u | p >> 27u;
+		i *= 0x6935fa69u;
+		i ^= (i & w) >> 11u; i *= 0x74dcb303u;
+		i ^= (i & w) >> 2u; i *= 0x9e501cc3u;
+		i ^= (i & w) >> 2u; i *= 0xc860a3dfu;
+		i &= w;
+		i ^= i >> 5u;
+	} while (i >= l);
+	return (i + p) % l;
+}
+
+float randfloat(uint32_t i, uint32_t p) {
+	i ^= p;
+	i ^= i >> 17u;
+	i ^= i >> 10u; i *= 0xb36534e5u;
+	i ^= i >> 12u;
+	i ^= i >> 21u; i *= 0x93fc4795u;
+	i ^= 0xdf6e307fu;
+	i ^= i >> 17u; i *= 1u | p >> 18u;
+	return to_unit_float(i);
+}
+
+class CMJSampler : public Sampler {
+public:
+	CMJSampler(uint32_t spp, uint32_t w) : Sampler(CMJ, spp, w) {
+		m = std::max(1u, uint32_t(std::sqrt(float(spp))));
+		n = (spp + m - 1) / m;
+	}
+
+	float get_1d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		uint32_t s, p;
+		pattern(pixel, sample_index, dimension, s, p);
+		uint32_t stratum = permute(s, samples_per_pixel, p * 0x68bc21ebu);
+		float jitter = randfloat(s, p * 0x967a889bu);
+		return std::min((stratum + jitter) / samples_per_pixel, ONE_MINUS_EPSILON);
+	}
+
+	vec2 get_2d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		uint32_t s, p;
+		pattern(pixel, sample_index, dimension, s, p);
+		s = permute(s, samples_per_pixel, p * 0x51633e2du);
+		uint32_t sx = permute(s % m, m, p * 0x68bc21ebu);
+		uint32_t sy = permute(s / m, n, p * 0x02e5be93u);
+		float jx = randfloat(s, p * 0x967a889bu);
+		float jy = randfloat(s, p * 0x368cc8b7u);
+		vec2 u = vec2((sx + (sy + jx) / n) / m, (s + jy) / samples_per_pixel);
+		return glm::min(u, vec2(ONE_MINUS_EPSILON));
+	}
+
+private:
+	uint32_t m, n; // columns and rows of the 2D strata
+
+	// every samples_per_pixel samples start a new pattern, in case a pixel takes more than planned
+	void pattern(uint32_t pixel, uint32_t sample_index, uint32_t dimension, uint32_t& s, uint32_t& p) const {
+		s = sample_index % samples_per_pixel;
+		p = hash_combine(hash_combine(pixel, dimension), sample_index / samples_per_pixel);
+	}
+};
+
+//-------- owen scrambled sobol --------
+// Burley, "Practical Hash-based Owen Scrambling", JCGT 9(4) (2020)
+
+inline uint32_t reverse_bits(uint32_t x) {
+	x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+	x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+	x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+	x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+	return (x >> 16u) | (x << 16u);
+}
+
+// only mixes bits into higher ones, so it works as an owen scramble on reversed bits
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+	return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+// the first two sobol dimensions; together they are a (0, 2) sequence
+inline uint32_t sobol_0(uint32_t index) {
+	return reverse_bits(index);
+}
+
+inline uint32_t sobol_1(uint32_t index) {
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31u; index; index >>= 1u, v ^= v >> 1u) {
+		if (index & 1u) result ^= v;
+	}
+	return result;
+}
+
+// dimension pair seeded by seed: shuffling the index decorrelates it from the other pairs
+vec2 owen_sobol_2d(uint32_t sample_index, uint32_t seed) {
+	uint32_t index = nested_uniform_scramble(sample_index, seed);
+	uint32_t x = nested_uniform_scramble(sobol_0(index), hash_combine(seed, 0));
+	uint32_t y = nested_uniform_scramble(sobol_1(index), hash_combine(seed, 1));
+	return vec2(to_unit_float(x), to_unit_float(y));
+}
+
+float owen_sobol_1d(uint32_t sample_index, uint32_t seed) {
+	uint32_t index = nested_uniform_scramble(sample_index, seed);
+	return to_unit_float(nested_uniform_scramble(sobol_0(index), hash_combine(seed, 0)));
+}
+
+class SobolSampler : public Sampler {
+public:
+	SobolSampler(uint32_t spp, uint32_t w) : Sampler(Sobol, spp, w) {}
+
+	float get_1d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		return owen_sobol_1d(sample_index, hash_combine(pixel, dimension));
+	}
+	vec2 get_2d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		return owen_sobol_2d(sample_index, hash_combine(pixel, dimension));
+	}
+};
+
+//-------- blue noise dithered --------
+
+// void-and-cluster (Ulichney 1993): every pixel gets a rank such that the first k pixels by rank are evenly
+// spread for any k. Returns ranks normalized to [0, 1). Phase 3 keeps filling voids instead of inverting.
+std::vector<float> generate_blue_noise() {
+	const int size = BLUE_NOISE_SIZE;
+	const int mask = size - 1;
+	const int num_pixels = size * size;
+	const float sigma = 1.9f;
+	const int radius = 6; // of the gaussian kernel, in pixels (wrapping around)
+
+	std::vector<uint8_t> on(num_pixels, 0);
+	std::vector<float> energy(num_pixels, 0.0f);
+	std::vector<float> kernel((2 * radius + 1) * (2 * radius + 1));
+	for (int dy = -radius; dy <= radius; dy++) {
+		for (int dx = -radius; dx <= radius; dx++) {
+			kernel[(dy + radius) * (2 * radius + 1) + dx + radius] = std::exp(-float(dx * dx + dy * dy) / (2 * sigma * sigma));
+		}
+	}
+	auto toggle = [&](int p) {
+		on[p] ^= 1;
+		float sign = on[p] ? 1.0f : -1.0f;
+		int px = p % size, py = p / size;
+		for (int dy = -radius; dy <= radius; dy++) {
+			for (int dx = -radius; dx <= radius; dx++) {
+				int q = ((py + dy) & mask) * size + ((px + dx) & mask);
+				energy[q] += sign * kernel[(dy + radius) * (2 * radius + 1) + dx + radius];
+			}
+		}
+	};
+	auto tightest_cluster = [&]() {
+		int best = -1;
+		for (int p = 0; p < num_pixels; p++) if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+		return best;
+	};
+	auto largest_void = [&]() {
+		int best = -1;
+		for (int p = 0; p < num_pixels; p++) if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+		return best;
+	};
+
+	// initial pattern: about a tenth of the pixels at random...
+	int num_on = 0;
+	for (int i = 0; i < num_pixels / 10; i++) {
+		int p = int(hash_u32(i) % num_pixels);
+		if (!on[p]) { toggle(p); num_on++; }
+	}
+	// ...then moved from clusters into voids until that changes nothing
+	for (;;) {
+		int c = tightest_cluster();
+		toggle(c);
+		int v = largest_void();
+		toggle(v);
+		if (v == c) break;
+	}
+
+	std::vector<float> result(num_pixels);
+	auto initial_on = on;
+	auto initial_energy = energy;
+	// phase 1: ranks below num_on, removing clusters
+	for (int rank = num_on - 1; rank >= 0; rank--) {
+		int c = tightest_cluster();
+		toggle(c);
+		result[c] = float(rank);
+	}
+	// phases 2 & 3: the rest, filling voids
+	on = initial_on;
+	energy = initial_energy;
+	for (int rank = num_on; rank < num_pixels; rank++) {
+		int v = largest_void();
+		toggle(v);
+		result[v] = float(rank);
+	}
+	for (auto& r : result) r = (r + 0.5f) / float(num_pixels);
+	return result;
+}
+
+class BlueNoiseSampler : public Sampler {
+public:
+	BlueNoiseSampler(uint32_t spp, uint32_t w) : Sampler(BlueNoise, spp, w) {
+		// made once, on first use
+		static const std::vector<float> generated = generate_blue_noise();
+		blue_noise = &generated;
+	}
+
+	float get_1d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		uint32_t seed = hash_u32(dimension);
+		float u = owen_sobol_1d(sample_index, seed) + rotation(pixel, hash_combine(seed, 0));
+		return std::min(u - std::floor(u), ONE_MINUS_EPSILON);
+	}
+
+	vec2 get_2d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const override {
+		uint32_t seed = hash_u32(dimension);
+		vec2 u = owen_sobol_2d(sample_index, seed)
+			+ vec2(rotation(pixel, hash_combine(seed, 0)), rotation(pixel, hash_combine(seed, 1)));
+		return glm::min(u - glm::floor(u), vec2(ONE_MINUS_EPSILON));
+	}
+
+private:
+	const std::vector<float>* blue_noise;
+
+	// the mask, shifted by an offset picked by seed so that dimensions don't share rotations
+	float rotation(uint32_t pixel, uint32_t seed) const {
+		uint32_t x = pixel % image_width + seed;
+		uint32_t y = pixel / image_width + (seed >> 16u);
+		return (*blue_noise)[(y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE + x % BLUE_NOISE_SIZE];
+	}
+};
+
+}
+
+Sampler* Sampler::create(Type type, uint32_t samples_per_pixel, uint32_t image_width) {
+	samples_per_pixel = std::max(1u, samples_per_pixel);
+	switch (type) {
+		case CMJ: return new CMJSampler(samples_per_pixel, image_width);
+		case Sobol: return new SobolSampler(samples_per_pixel, image_width);
+		case BlueNoise: return new BlueNoiseSampler(samples_per_pixel, image_width);
+		case Independent: return new IndependentSampler(samples_per_pixel, image_width);
+		default:
+			WARN("unknown sampler type %d, using independent sampling", int(type))
+			return new IndependentSampler(samples_per_pixel, image_width);
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+
+// supplies the random numbers of every camera path: sample sample_index of pixel, for dimension 0, 1, 2, ...
+// in the order the path consumes them. Samplers are stateless (the position along the path lives in SampleStream),
+// so one instance is shared by all raytrace threads.
+class Sampler {
+public:
+	enum Type {
+		// a PCG32 stream per (pixel, sample), see myn::sample::seed. Camera offsets come from pixel_offsets
+		// if UseJitteredSampling, so this is the renderer as it was before samplers
+		Independent = 0,
+		// correlated multi-jittered (Kensler 2013): stratified in 2D and in both 1D projections, per dimension pair
+		CMJ = 1,
+		// first two Sobol dimensions with hash based Owen scrambling, padded with a differently shuffled
+		// and scrambled copy per dimension pair (Burley 2020)
+		Sobol = 2,
+		// one scrambled Sobol sequence shared by all pixels, rotated (Cranley-Patterson) by a blue noise
+		// mask per pixel: same error per pixel count, but spread as blue noise (Georgiev & Fajardo 2016)
+		BlueNoise = 3
+	};
+
+	static Sampler* create(Type type, uint32_t samples_per_pixel, uint32_t image_width);
+	virtual ~Sampler() = default;
+
+	// in [0, 1)
+	virtual float get_1d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const = 0;
+	// in [0, 1)^2
+	virtual glm::vec2 get_2d(uint32_t pixel, uint32_t sample_index, uint32_t dimension) const = 0;
+
+	Type type;
+	uint32_t samples_per_pixel;
+	uint32_t image_width;
+
+protected:
+	Sampler(Type _type, uint32_t _samples_per_pixel, uint32_t _image_width)
+		: type(_type), samples_per_pixel(_samples_per_pixel), image_width(_image_width) {}
+};
+
+// the position of one camera path in its sampler: each draw, 1D or 2D, takes the next dimension
+struct SampleStream {
+	const Sampler* sampler = nullptr;
+	uint32_t pixel = 0;
+	uint32_t sample_index = 0;
+	uint32_t dimension = 0;
+
+	float get_1d() { return sampler->get_1d(pixel, sample_index, dimension++); }
+	glm::vec2 get_2d() { return sampler->get_2d(pixel, sample_index, dimension++); }
+};
@@ -0,0 +1,648 @@
+#include "SceneBVH.hpp"
+#include "Render/Mesh.h"
+#include "Utils/myn/Log.h"
+#include "Utils/myn/Timer.h"
+#include "Utils/myn/JobSystem.h"
+#include <algorithm>
+#include <map>
+#include <bit>
+#include <xmmintrin.h>
+
+// an instance costs a transform plus its own BVH's root test, so keep top level leaves small
+#define SCENE_BVH_MAX_LEAF_SIZE 2
+#define SCENE_BVH_INSTANCE_COST 2.0f
+#define SCENE_BVH_LOCAL_STACK_SIZE 64
+// refitting moved instances is fine until the top level gets this much worse than when it was built
+#define SCENE_BVH_MAX_REFIT_DEGRADATION 2.0f
+
+namespace
+{
+// glTF nodes instancing the same mesh each get their own Mesh, but with the same vertex & index ranges
+using MeshDataKey = std::tuple<const Vertex*, uint32_t, const VERTEX_INDEX_TYPE*, uint32_t>;
+
+// unique mesh data in order of first use, and which of those each desc uses
+void find_unique_meshes(const std::vector<MeshInstanceDesc>& descs,
+						std::vector<const Mesh*>& unique, std::vector<uint32_t>& mesh_index)
+{
+	std::map<MeshDataKey, uint32_t> indices;
+	for (const auto& desc : descs) {
+		const Mesh* m = desc.mesh;
+		auto [it, inserted] = indices.try_emplace(
+			MeshDataKey{m->get_vertices(), m->get_num_vertices(), m->get_indices(), m->get_num_indices()}, unique.size());
+		if (inserted) unique.push_back(m);
+		mesh_index.push_back(it->second);
+	}
+}
+
+// FNV-1a over the positions and indices, 32 bits at a time
+uint64_t hash_mesh_data(const Mesh* mesh)
+{
+	uint64_t h = 14695981039346656037ull;
+	auto add = [&h](uint32_t word) { h = (h ^ word) * 1099511628211ull; };
+	add(mesh->get_num_vertices());
+	add(mesh->get_num_indices());
+	for (uint32_t i = 0; i < mesh->get_num_vertices(); i++) {
+		const vec3& p = mesh->get_vertices()[i].position;
+		for (int a = 0; a < 3; a++) {
+			add(std::bit_cast<uint32_t>(p[a]));
+		}
+	}
+	for (uint32_t i = 0; i < mesh->get_num_indices(); i++) add(mesh->get_indices()[i]);
+	return h;
+}
+
+inline float half_area(const LinearBVHNode& node) {
+	vec3 d = glm::max(node.max - node.min, vec3(0));
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+}
+
+MeshBVH::~MeshBVH() {
+	delete bvh;
+	delete wide_bvh;
+}
+
+void MeshBVH::build(const BVHBuildOptions& options) {
+	content_hash = hash_mesh_data(mesh);
+	triangles.clear();
+	triangles.reserve(mesh->get_num_vertices(), mesh->get_num_indices() / 3);
+	triangles.add_mesh(mat4(1), mesh, 0);
+
+	BVH root(&triangles, 0);
+	root.primitives_start = 0;
+	root.primitives_count = triangles.size();
+	root.expand_bvh(options);
+	min = root.min;
+	max = root.max;
+
+	delete bvh;
+	delete wide_bvh;
+	bvh = new LinearBVH(&root);
+	wide_bvh = new WideBVH(*bvh);
+}
+
+int MeshBVH::intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh, bool use_wide_bvh) const {
+	if (use_bvh && use_wide_bvh) return wide_bvh->intersect_primitives(ray, t, n);
+	return bvh->intersect_primitives(ray, t, n, use_bvh);
+}
+
+bool MeshBVH::occluded(const Ray& ray, bool use_bvh, bool use_wide_bvh) const {
+	if (use_bvh && use_wide_bvh) return wide_bvh->occluded(ray);
+	return bvh->occluded(ray, use_bvh);
+}
+
+MeshInstance::MeshInstance(const MeshBVH* _mesh, const BSDF* _bsdf, const mat4& _object_to_world)
+	: mesh(_mesh), bsdf(_bsdf), min(INF), max(-INF)
+{
+	set_transform(_object_to_world);
+}
+
+void MeshInstance::set_transform(const mat4& o2w) {
+	object_to_world = o2w;
+	world_to_object = inverse(o2w);
+	// cross(M a, M b) = det(M) * inverse(transpose(M)) * cross(a, b)
+	mat3 m(o2w);
+	normal_to_world = transpose(inverse(m)) * (determinant(m) < 0 ? -1.0f : 1.0f);
+}
+
+void MeshInstance::update_bounds() {
+	min = vec3(INF);
+	max = vec3(-INF);
+	for (int i = 0; i < 8; i++) {
+		vec3 corner((i & 1) ? mesh->max.x : mesh->min.x, (i & 2) ? mesh->max.y : mesh->min.y, (i & 4) ? mesh->max.z : mesh->min.z);
+		vec3 p = vec3(object_to_world * vec4(corner, 1));
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+}
+
+Ray MeshInstance::to_object(const Ray& ray) const {
+	Ray local(vec3(world_to_object * vec4(ray.o, 1)), mat3(world_to_object) * ray.d);
+	local.tmin = ray.tmin;
+	local.tmax = ray.tmax;
+	return local;
+}
+
+SceneBVH::~SceneBVH() {
+	for (auto* m : meshes) delete m;
+}
+
+void SceneBVH::build(const std::vector<MeshInstanceDesc>& descs, const BVHBuildOptions& options)
+{
+	TIMER_BEGIN
+
+	std::vector<const Mesh*> unique_meshes;
+	std::vector<uint32_t> mesh_index;
+	find_unique_meshes(descs, unique_meshes, mesh_index);
+	for (auto* m : meshes) delete m;
+	meshes.clear();
+	for (const Mesh* m : unique_meshes) meshes.push_back(new MeshBVH(m));
+
+	// big meshes get all threads for their own build; the small ones are built side by side, one thread each
+	uint num_threads = glm::max(1u, options.num_threads);
+	std::vector<MeshBVH*> small_meshes;
+	for (auto* m : meshes) {
+		if (m->mesh->get_num_indices() / 3 >= BVH_MIN_PARALLEL_BUILD_SIZE) {
+			m->build(options);
+		} else {
+			small_meshes.push_back(m);
+		}
+	}
+	std::stable_sort(small_meshes.begin(), small_meshes.end(), [](const MeshBVH* a, const MeshBVH* b) {
+		return a->mesh->get_num_indices() > b->mesh->get_num_indices();
+	});
+	BVHBuildOptions small_options = options;
+	small_options.num_threads = 1;
+	small_options.report = false;
+	auto build_small = [&](uint32_t first, uint32_t last) {
+		for (uint32_t i = first; i < last; i++) small_meshes[i]->build(small_options);
+	};
+	if (num_threads > 1) myn::jobs::parallel_for(0, small_meshes.size(), 1, build_small);
+	else build_small(0, small_meshes.size());
+
+	instances.clear();
+	instances.reserve(descs.size());
+	instance_slots.resize(descs.size());
+	for (uint32_t i = 0; i < descs.size(); i++) {
+		instances.emplace_back(meshes[mesh_index[i]], descs[i].bsdf, descs[i].object_to_world);
+		instance_slots[i] = i;
+	}
+	build_top_level();
+
+	TIMER_END(duration)
+	TRACE("built scene BVH in %.3fs: %zu instances of %zu meshes, %u triangles (%u with instances flattened), top level depth %u",
+		  duration, instances.size(), meshes.size(), num_unique_triangles(), num_instanced_triangles(), max_depth)
+}
+
+bool SceneBVH::update(const std::vector<MeshInstanceDesc>& descs, uint32_t& num_moved)
+{
+	num_moved = 0;
+	std::vector<const Mesh*> unique_meshes;
+	std::vector<uint32_t> mesh_index;
+	find_unique_meshes(descs, unique_meshes, mesh_index);
+	if (unique_meshes.size() != meshes.size() || descs.size() != instances.size()) return false;
+	// (the old Mesh objects are gone after a reload, so compare by content)
+	for (uint32_t j = 0; j < meshes.size(); j++) {
+		if (hash_mesh_data(unique_meshes[j]) != meshes[j]->content_hash) return false;
+	}
+	for (uint32_t i = 0; i < descs.size(); i++) {
+		if (instances[instance_slots[i]].mesh != meshes[mesh_index[i]]) return false;
+	}
+
+	for (uint32_t j = 0; j < meshes.size(); j++) {
+		meshes[j]->mesh = unique_meshes[j];
+	}
+	for (uint32_t i = 0; i < descs.size(); i++) {
+		MeshInstance& instance = instances[instance_slots[i]];
+		instance.bsdf = descs[i].bsdf;
+		if (instance.object_to_world != descs[i].object_to_world) {
+			instance.set_transform(descs[i].object_to_world);
+			num_moved++;
+		}
+	}
+	if (num_moved > 0) refit_top_level();
+	return true;
+}
+
+void SceneBVH::build_top_level()
+{
+	nodes.clear();
+	max_depth = 0;
+	uint32_t num_instances = instances.size();
+	if (num_instances == 0) return;
+
+	std::vector<vec3> box_min(num_instances), box_max(num_instances);
+	for (uint32_t i = 0; i < num_instances; i++) {
+		instances[i].update_bounds();
+		box_min[i] = instances[i].min;
+		box_max[i] = instances[i].max;
+	}
+	BVHBuildOptions top_options;
+	top_options.max_leaf_size = SCENE_BVH_MAX_LEAF_SIZE;
+	top_options.intersection_cost = SCENE_BVH_INSTANCE_COST;
+	BVH root(nullptr, 0);
+	root.primitives_count = num_instances;
+	std::vector<uint32_t> order;
+	root.expand_bvh(box_min, box_max, top_options, order);
+
+	std::vector<MeshInstance> sorted;
+	std::vector<uint32_t> new_slot(num_instances);
+	sorted.reserve(num_instances);
+	for (uint32_t k = 0; k < num_instances; k++) {
+		sorted.push_back(instances[order[k]]);
+		new_slot[order[k]] = k;
+	}
+	instances = std::move(sorted);
+	for (auto& slot : instance_slots) slot = new_slot[slot];
+
+	LinearBVH flattened(&root);
+	nodes = std::move(flattened.nodes);
+	max_depth = flattened.max_depth;
+	built_top_level_cost = top_level_cost();
+}
+
+void SceneBVH::refit_top_level()
+{
+	for (auto& instance : instances) instance.update_bounds();
+	// children always come after their parent in nodes
+	for (size_t k = nodes.size(); k-- > 0;) {
+		LinearBVHNode& node = nodes[k];
+		node.min = vec3(INF);
+		node.max = vec3(-INF);
+		if (node.is_leaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+				node.min = glm::min(node.min, instances[i].min);
+				node.max = glm::max(node.max, instances[i].max);
+			}
+		} else {
+			node.min = glm::min(nodes[node.offset].min, nodes[node.offset + 1].min);
+			node.max = glm::max(nodes[node.offset].max, nodes[node.offset + 1].max);
+		}
+	}
+	float cost = top_level_cost();
+	if (cost > built_top_level_cost * SCENE_BVH_MAX_REFIT_DEGRADATION) {
+		TRACE("refitting made the top level BVH worse (cost %.2f -> %.2f), rebuilding it", built_top_level_cost, cost)
+		build_top_level();
+	}
+}
+
+float SceneBVH::top_level_cost() const
+{
+	if (nodes.empty()) return 0;
+	float root_area = half_area(nodes[0]);
+	if (root_area <= 0) return 0;
+	double sum = 0;
+	for (const auto& node : nodes) sum += half_area(node);
+	return float(sum / root_area);
+}
+
+namespace
+{
+struct TraversalEntry {
+	uint32_t index;
+	float tnear;
+};
+}
+
+int SceneBVH::intersect_primitives(Ray& ray, double& t, vec3& n, uint32_t& instance,
+								   bool use_bvh, bool use_wide_bvh) const
+{
+	int primitive = -1;
+	// t and n only get written on hits, and each hit shrinks ray.tmax, so the last one is the closest
+	auto intersect_instance = [&](uint32_t i) {
+		Ray local = instances[i].to_object(ray);
+		int hit = instances[i].mesh->intersect_primitives(local, t, n, use_bvh, use_wide_bvh);
+		if (hit >= 0) {
+			primitive = hit;
+			instance = i;
+			ray.tmax = local.tmax;
+		}
+	};
+
+	if (!use_bvh) {
+		for (uint32_t i = 0; i < instances.size(); i++) intersect_instance(i);
+	} else if (!nodes.empty()) {
+		vec3 inv_d = 1.0f / ray.d;
+
+		TraversalEntry local_stack[SCENE_BVH_LOCAL_STACK_SIZE];
+		std::vector<TraversalEntry> heap_stack;
+		TraversalEntry* st = local_stack;
+		if (max_depth + 2 > SCENE_BVH_LOCAL_STACK_SIZE) {
+			heap_stack.resize(max_depth + 2);
+			st = heap_stack.data();
+		}
+		int top = 0;
+
+		float tnear;
+		if (intersect_node(nodes[0], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) st[top++] = {0, tnear};
+
+		while (top > 0) {
+			TraversalEntry entry = st[--top];
+			if (entry.tnear > ray.tmax) continue;
+
+			const LinearBVHNode& node = nodes[entry.index];
+			if (node.is_leaf()) {
+				for (uint32_t i = node.offset; i < node.offset + node.count; i++) intersect_instance(i);
+				continue;
+			}
+
+			float tnear_l, tnear_r;
+			bool hit_l = intersect_node(nodes[node.offset], ray.o, inv_d, ray.tmin, ray.tmax, tnear_l);
+			bool hit_r = intersect_node(nodes[node.offset + 1], ray.o, inv_d, ray.tmin, ray.tmax, tnear_r);
+			if (hit_l && hit_r) {
+				if (tnear_l <= tnear_r) {
+					st[top++] = {node.offset + 1, tnear_r};
+					st[top++] = {node.offset, tnear_l};
+				} else {
+					st[top++] = {node.offset, tnear_l};
+					st[top++] = {node.offset + 1, tnear_r};
+				}
+			} else if (hit_l) {
+				st[top++] = {node.offset, tnear_l};
+			} else if (hit_r) {
+				st[top++] = {node.offset + 1, tnear_r};
+			}
+		}
+	}
+
+	if (primitive >= 0) {
+		n = normalize(instances[instance].normal_to_world * n);
+	}
+	return primitive;
+}
+
+bool SceneBVH::occluded(const Ray& ray, bool use_bvh, bool use_wide_bvh) const
+{
+	auto occluded_by = [&](uint32_t i) {
+		return instances[i].mesh->occluded(instances[i].to_object(ray), use_bvh, use_wide_bvh);
+	};
+
+	if (!use_bvh) {
+		for (uint32_t i = 0; i < instances.size(); i++) {
+			if (occluded_by(i)) return true;
+		}
+		return false;
+	}
+	if (nodes.empty()) return false;
+
+	vec3 inv_d = 1.0f / ray.d;
+
+	uint32_t local_stack[SCENE_BVH_LOCAL_STACK_SIZE];
+	std::vector<uint32_t> heap_stack;
+	uint32_t* st = local_stack;
+	if (max_depth + 2 > SCENE_BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		st = heap_stack.data();
+	}
+	int top = 0;
+
+	float tnear;
+	if (!intersect_node(nodes[0], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) return false;
+	st[top++] = 0;
+
+	while (top > 0) {
+		const LinearBVHNode& node = nodes[st[--top]];
+		if (node.is_leaf()) {
+			for (uint32_t i = node.offset; i < node.offset + node.count; i++) {
+				if (occluded_by(i)) return true;
+			}
+			continue;
+		}
+		if (intersect_node(nodes[node.offset + 1], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) st[top++] = node.offset + 1;
+		if (intersect_node(nodes[node.offset], ray.o, inv_d, ray.tmin, ray.tmax, tnear)) st[top++] = node.offset;
+	}
+	return false;
+}
+
+namespace
+{
+// rays of a RayPacket during traversal of one BVH, in that BVH's space. Struct of arrays, so that SSE tests
+// 4 rays against a node at once. Which rays take part is a bit mask (bit i: ray i)
+struct PacketRays {
+	uint32_t size = 0;
+	alignas(16) float o[3][RAY_PACKET_SIZE];
+	alignas(16) float d[3][RAY_PACKET_SIZE];
+	alignas(16) float inv_d[3][RAY_PACKET_SIZE];
+	alignas(16) float tmax[RAY_PACKET_SIZE];
+
+	// bounds of the origins and inverse directions of some rays, for interval tests. Only usable if every axis'
+	// inverse directions are finite and of the same sign; otherwise nodes get tested ray by ray
+	bool coherent = false;
+	vec3 o_min, o_max, inv_d_min, inv_d_max;
+	float max_tmax = INF;
+
+	void set(uint32_t i, const vec3& _o, const vec3& _d, float _tmax) {
+		for (int a = 0; a < 3; a++) {
+			o[a][i] = _o[a];
+			d[a][i] = _d[a];
+			inv_d[a][i] = 1.0f / _d[a];
+		}
+		tmax[i] = _tmax;
+	}
+	vec3 origin(uint32_t i) const { return vec3(o[0][i], o[1][i], o[2][i]); }
+	vec3 direction(uint32_t i) const { return vec3(d[0][i], d[1][i], d[2][i]); }
+
+	// (lanes past size still get tested in groups of 4, so give them harmless values)
+	void pad() {
+		for (uint32_t i = size; i < (size + 3) / 4 * 4; i++) set(i, vec3(0), vec3(1), -INF);
+	}
+
+	void update_bounds(uint64_t mask) {
+		o_min = inv_d_min = vec3(INF);
+		o_max = inv_d_max = vec3(-INF);
+		for (uint64_t m = mask; m; m &= m - 1) {
+			uint32_t i = std::countr_zero(m);
+			for (int a = 0; a < 3; a++) {
+				o_min[a] = std::min(o_min[a], o[a][i]);
+				o_max[a] = std::max(o_max[a], o[a][i]);
+				inv_d_min[a] = std::min(inv_d_min[a], inv_d[a][i]);
+				inv_d_max[a] = std::max(inv_d_max[a], inv_d[a][i]);
+			}
+		}
+		coherent = true;
+		for (int a = 0; a < 3; a++) {
+			coherent = coherent && std::isfinite(inv_d_min[a]) && std::isfinite(inv_d_max[a]) &&
+				(inv_d_min[a] > 0 || inv_d_max[a] < 0);
+		}
+		update_max_tmax(mask);
+	}
+	void update_max_tmax(uint64_t mask) {
+		max_tmax = 0;
+		for (uint64_t m = mask; m; m &= m - 1) max_tmax = std::max(max_tmax, tmax[std::countr_zero(m)]);
+	}
+
+	// false only if none of the rays the bounds were taken over can hit node. The slab distances (b - o) * inv_d of
+	// each ray lie within the interval products below, and float rounding is monotonic, so this never disagrees
+	// with the ray's own test
+	bool may_hit(const LinearBVHNode& node) const {
+		if (!coherent) return true;
+		float entry = 0, exit = max_tmax;
+		for (int a = 0; a < 3; a++) {
+			float lo0, hi0, lo1, hi1;
+			slab_interval(node.min[a], a, lo0, hi0);
+			slab_interval(node.max[a], a, lo1, hi1);
+			entry = std::max(entry, std::min(lo0, lo1));
+			exit = std::min(exit, std::max(hi0, hi1) * BVH_SLAB_TFAR_SCALE);
+		}
+		return entry <= exit;
+	}
+
+	// which rays of mask hit node: the slab test of intersect_node, 4 rays at a time
+	uint64_t hit_mask(const LinearBVHNode& node, uint64_t mask) const {
+		uint64_t hits = 0;
+		__m128 min_x = _mm_set1_ps(node.min.x), min_y = _mm_set1_ps(node.min.y), min_z = _mm_set1_ps(node.min.z);
+		__m128 max_x = _mm_set1_ps(node.max.x), max_y = _mm_set1_ps(node.max.y), max_z = _mm_set1_ps(node.max.z);
+		for (uint32_t i = 0; i < size; i += 4) {
+			if (((mask >> i) & 0xf) == 0) continue;
+			__m128 ox = _mm_load_ps(o[0] + i), oy = _mm_load_ps(o[1] + i), oz = _mm_load_ps(o[2] + i);
+			__m128 idx = _mm_load_ps(inv_d[0] + i), idy = _mm_load_ps(inv_d[1] + i), idz = _mm_load_ps(inv_d[2] + i);
+			__m128 t0x = _mm_mul_ps(_mm_sub_ps(min_x, ox), idx);
+			__m128 t1x = _mm_mul_ps(_mm_sub_ps(max_x, ox), idx);
+			__m128 t0y = _mm_mul_ps(_mm_sub_ps(min_y, oy), idy);
+			__m128 t1y = _mm_mul_ps(_mm_sub_ps(max_y, oy), idy);
+			__m128 t0z = _mm_mul_ps(_mm_sub_ps(min_z, oz), idz);
+			__m128 t1z = _mm_mul_ps(_mm_sub_ps(max_z, oz), idz);
+			__m128 tnear = _mm_max_ps(
+				_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+				_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_setzero_ps()));
+			__m128 tfar = _mm_mul_ps(
+				_mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z)),
+				_mm_set1_ps(BVH_SLAB_TFAR_SCALE));
+			tfar = _mm_min_ps(tfar, _mm_load_ps(tmax + i));
+			hits |= uint64_t(_mm_movemask_ps(_mm_cmple_ps(tnear, tfar))) << i;
+		}
+		return hits & mask;
+	}
+
+private:
+	void slab_interval(float b, int a, float& lo, float& hi) const {
+		float d_lo = b - o_max[a], d_hi = b - o_min[a];
+		float p0 = d_lo * inv_d_min[a], p1 = d_lo * inv_d_max[a];
+		float p2 = d_hi * inv_d_min[a], p3 = d_hi * inv_d_max[a];
+		lo = std::min(std::min(p0, p1), std::min(p2, p3));
+		hi = std::max(std::max(p0, p1), std::max(p2, p3));
+	}
+};
+
+struct PacketEntry {
+	uint32_t index;
+	uint64_t mask; // rays that hit the parent
+};
+
+// near-first traversal of nodes by the rays of mask, together. leaf(node, hits) tests the rays hits of a leaf
+template<typename LeafFn>
+void traverse_packet(const std::vector<LinearBVHNode>& nodes, uint max_depth, PacketRays& rays, uint64_t mask, LeafFn&& leaf)
+{
+	if (nodes.empty() || mask == 0) return;
+	rays.update_bounds(mask);
+
+	PacketEntry local_stack[SCENE_BVH_LOCAL_STACK_SIZE];
+	std::vector<PacketEntry> heap_stack;
+	PacketEntry* st = local_stack;
+	if (max_depth + 2 > SCENE_BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		st = heap_stack.data();
+	}
+	int top = 0;
+	st[top++] = {0, mask};
+
+	while (top > 0) {
+		PacketEntry entry = st[--top];
+		const LinearBVHNode& node = nodes[entry.index];
+		// (tested on pop rather than on push, so that hits found in the meantime cull it)
+		if (!rays.may_hit(node)) continue;
+		uint64_t hits = rays.hit_mask(node, entry.mask);
+		if (hits == 0) continue;
+
+		if (node.is_leaf()) {
+			leaf(node, hits);
+			continue;
+		}
+		// children are split along node.axis: the first active ray's direction says which one is nearer
+		bool left_first = rays.d[node.axis][std::countr_zero(hits)] >= 0;
+		st[top++] = {left_first ? node.offset + 1 : node.offset, hits};
+		st[top++] = {left_first ? node.offset : node.offset + 1, hits};
+	}
+}
+}
+
+void SceneBVH::intersect_packet(RayPacket& packet, bool use_bvh) const
+{
+	for (uint32_t i = 0; i < packet.size; i++) packet.primitive[i] = -1;
+
+	if (!use_bvh) {
+		for (uint32_t i = 0; i < packet.size; i++) {
+			Ray ray(packet.o[i], packet.d[i]);
+			double t; vec3 n;
+			packet.primitive[i] = intersect_primitives(ray, t, n, packet.instance[i], false, false);
+			packet.t[i] = float(t);
+			packet.n[i] = n;
+		}
+		return;
+	}
+
+	PacketRays rays;
+	rays.size = packet.size;
+	for (uint32_t i = 0; i < packet.size; i++) rays.set(i, packet.o[i], packet.d[i], INF);
+	rays.pad();
+	uint64_t all = packet.size == 64 ? ~0ull : (1ull << packet.size) - 1;
+
+	PacketRays local;
+	local.size = rays.size;
+	local.pad();
+	TriangleRay tri_rays[RAY_PACKET_SIZE];
+	static_assert(RAY_PACKET_SIZE <= 64, "packets keep a bit per ray");
+
+	auto intersect_instance = [&](uint32_t inst, uint64_t mask) {
+		const MeshInstance& instance = instances[inst];
+		const MeshBVH* mesh = instance.mesh;
+		LinearBVHNode bounds{};
+		bounds.min = instance.min;
+		bounds.max = instance.max;
+		mask = rays.hit_mask(bounds, mask);
+		if (mask == 0) return;
+
+		// the rays in object space (only those of mask are valid)
+		for (uint64_t m = mask; m; m &= m - 1) {
+			uint32_t i = std::countr_zero(m);
+			Ray ray = instance.to_object(Ray(rays.origin(i), rays.direction(i)));
+			local.set(i, ray.o, ray.d, rays.tmax[i]);
+		}
+		uint64_t has_tri_ray = 0; // (only rays that reach a leaf need one)
+
+		traverse_packet(mesh->bvh->nodes, mesh->bvh->max_depth, local, mask, [&](const LinearBVHNode& node, uint64_t hits) {
+			for (uint64_t m = hits; m; m &= m - 1) {
+				uint32_t i = std::countr_zero(m);
+				if (!(has_tri_ray & (1ull << i))) {
+					tri_rays[i] = TriangleRay(Ray(local.origin(i), local.direction(i)));
+					has_tri_ray |= 1ull << i;
+				}
+				int hit = mesh->triangles.intersect_leaf(tri_rays[i], node.offset, node.count, local.tmax[i]);
+				if (hit >= 0) {
+					packet.primitive[i] = hit;
+					packet.instance[i] = inst;
+				}
+			}
+			local.update_max_tmax(mask);
+		});
+
+		for (uint64_t m = mask; m; m &= m - 1) {
+			uint32_t i = std::countr_zero(m);
+			rays.tmax[i] = local.tmax[i];
+		}
+	};
+
+	traverse_packet(nodes, max_depth, rays, all, [&](const LinearBVHNode& node, uint64_t hits) {
+		for (uint32_t i = node.offset; i < node.offset + node.count; i++) intersect_instance(i, hits);
+		rays.update_max_tmax(all);
+	});
+
+	for (uint32_t i = 0; i < packet.size; i++) {
+		if (packet.primitive[i] < 0) continue;
+		const MeshInstance& instance = instances[packet.instance[i]];
+		packet.t[i] = rays.tmax[i];
+		packet.n[i] = normalize(instance.normal_to_world * instance.mesh->triangles.normal(packet.primitive[i]));
+	}
+}
+
+uint32_t SceneBVH::num_unique_triangles() const {
+	uint32_t count = 0;
+	for (auto* m : meshes) count += m->triangles.num_unique();
+	return count;
+}
+
+uint32_t SceneBVH::num_instanced_triangles() const {
+	uint32_t count = 0;
+	for (auto& inst : instances) count += inst.mesh->triangles.num_unique();
+	return count;
+}
+
+size_t SceneBVH::memory_bytes() const {
+	size_t bytes = nodes.capacity() * sizeof(LinearBVHNode) + instances.capacity() * sizeof(MeshInstance);
+	for (auto* m : meshes) {
+		bytes += m->triangles.memory_bytes()
+			+ m->bvh->nodes.capacity() * sizeof(LinearBVHNode)
+			+ m->wide_bvh->nodes.capacity() * sizeof(WideBVHNode);
+	}
+	return bytes;
+}
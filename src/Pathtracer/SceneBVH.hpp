@@ -0,0 +1,118 @@
+#pragma once
+#include "WideBVH.hpp"
+
+// bottom level of the scene BVH: the triangles of one piece of mesh data, in its object space.
+// glTF nodes that instance the same mesh each get their own Mesh, but those share vertex & index ranges
+// (Mesh::cpu_data), and with them a single MeshBVH.
+struct MeshBVH
+{
+	explicit MeshBVH(const Mesh* _mesh) : mesh(_mesh) {}
+	~MeshBVH();
+
+	// loads the triangles and builds both BVHs
+	void build(const BVHBuildOptions& options);
+
+	const Mesh* mesh; // any one of the meshes sharing this data
+	uint64_t content_hash = 0; // of positions & indices, to recognize the same data after a scene reload
+	TriangleStore triangles; // no materials here, those come from the instances
+	LinearBVH* bvh = nullptr;
+	WideBVH* wide_bvh = nullptr;
+	vec3 min = vec3(INF);
+	vec3 max = vec3(-INF);
+
+	int intersect_primitives(Ray& ray, double& t, vec3& n, bool use_bvh, bool use_wide_bvh) const;
+	bool occluded(const Ray& ray, bool use_bvh, bool use_wide_bvh) const;
+};
+
+struct MeshInstance
+{
+	MeshInstance(const MeshBVH* _mesh, const BSDF* _bsdf, const mat4& _object_to_world);
+
+	const MeshBVH* mesh;
+	const BSDF* bsdf;
+	mat4 object_to_world;
+	mat4 world_to_object;
+	// inverse transpose, negated for mirroring transforms so normals keep following the world space winding
+	mat3 normal_to_world;
+	vec3 min, max; // world space bounds, once mesh is built
+
+	void set_transform(const mat4& o2w);
+	void update_bounds();
+	// direction isn't renormalized, so distances along the ray stay the same in both spaces
+	Ray to_object(const Ray& ray) const;
+	vec3 vertex(uint32_t tri, int k) const { return vec3(object_to_world * vec4(mesh->triangles.vertex(tri, k), 1)); }
+};
+
+// rays traced through the BVHs together, see SceneBVH::intersect_packet
+#define RAY_PACKET_SIZE 64
+
+// up to RAY_PACKET_SIZE coherent rays, like the camera rays of neighboring pixels. All start at tmin 0, tmax INF.
+struct RayPacket
+{
+	uint32_t size = 0;
+	vec3 o[RAY_PACKET_SIZE];
+	vec3 d[RAY_PACKET_SIZE];
+
+	// closest hit of each ray, as from SceneBVH::intersect_primitives: primitive is -1 on a miss
+	int primitive[RAY_PACKET_SIZE];
+	float t[RAY_PACKET_SIZE];
+	vec3 n[RAY_PACKET_SIZE];
+	uint32_t instance[RAY_PACKET_SIZE];
+
+	void add(const Ray& ray) {
+		o[size] = ray.o;
+		d[size] = ray.d;
+		size++;
+	}
+};
+
+// a MeshObject as the pathtracer sees it
+struct MeshInstanceDesc
+{
+	const Mesh* mesh;
+	const BSDF* bsdf;
+	mat4 object_to_world;
+};
+
+// the pathtracer's scene: a top level BVH over mesh instances, each pointing to a shared MeshBVH.
+// Memory and build time scale with unique geometry rather than with the number of instances.
+struct SceneBVH
+{
+	~SceneBVH();
+
+	// builds a MeshBVH per unique mesh data (in parallel where they are small), then the top level
+	void build(const std::vector<MeshInstanceDesc>& descs, const BVHBuildOptions& options);
+
+	// applies a reloaded scene in place, if it instances the same mesh data (by content) in the same order:
+	// then only transforms (refitting the top level) and materials can have changed. Returns false, changing nothing,
+	// if it needs a full build instead. num_moved receives the number of instances whose transform changed.
+	// Nothing may be tracing against this BVH (or the BSDFs it points to) while it runs.
+	bool update(const std::vector<MeshInstanceDesc>& descs, uint32_t& num_moved);
+
+	std::vector<MeshBVH*> meshes; // in order of first use by descs
+	std::vector<MeshInstance> instances; // in top level leaf order
+	std::vector<uint32_t> instance_slots; // desc index -> index into instances
+	std::vector<LinearBVHNode> nodes; // leaves index into instances
+	uint max_depth = 0;
+
+	// returns index of the closest triangle within instances[instance].mesh, -1 if none. n is in world space.
+	int intersect_primitives(Ray& ray, double& t, vec3& n, uint32_t& instance,
+							 bool use_bvh = true, bool use_wide_bvh = true) const;
+	bool occluded(const Ray& ray, bool use_bvh = true, bool use_wide_bvh = true) const;
+	// closest hits of all rays of the packet. Both levels get traversed by the whole packet at once, through the
+	// binary BVHs: a node costs one interval test for all rays, unless that can't rule it out, and rays only get
+	// tested one by one from the first one that hits it on.
+	void intersect_packet(RayPacket& packet, bool use_bvh = true) const;
+
+	uint32_t num_unique_triangles() const;
+	uint32_t num_instanced_triangles() const; // what flattening all instances would have given
+	size_t memory_bytes() const;
+
+private:
+	void build_top_level();
+	// recomputes node bounds bottom-up after instances moved; rebuilds the top level instead if that got much worse
+	void refit_top_level();
+	// sum of node surface areas relative to the root's, which grows as refitting lets boxes overlap more
+	float top_level_cost() const;
+	float built_top_level_cost = 0;
+};
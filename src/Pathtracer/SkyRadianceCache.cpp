@@ -0,0 +1,80 @@
+#include "SkyRadianceCache.hpp"
+#include "CpuSkyAtmosphere/CpuSkyAtmosphere.h"
+#include "Utils/myn/JobSystem.h"
+#include "Utils/myn/Log.h"
+#include "Utils/myn/Timer.h"
+#include <cmath>
+#include <algorithm>
+
+using namespace glm;
+
+namespace {
+
+inline vec2 sign_not_zero(const vec2& v) {
+	return vec2(v.x >= 0 ? 1.0f : -1.0f, v.y >= 0 ? 1.0f : -1.0f);
+}
+
+// unit direction <-> [0, 1]^2, upper hemisphere in the inner diamond, lower one folded out into the corners
+inline vec2 octahedral_encode(vec3 d) {
+	d /= std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+	vec2 p = vec2(d.x, d.y);
+	if (d.z < 0) p = (vec2(1) - abs(vec2(p.y, p.x))) * sign_not_zero(p);
+	return p * 0.5f + 0.5f;
+}
+
+inline vec3 octahedral_decode(const vec2& uv) {
+	vec2 p = uv * 2.0f - 1.0f;
+	vec3 d = vec3(p, 1 - std::abs(p.x) - std::abs(p.y));
+	if (d.z < 0) {
+		vec2 folded = (vec2(1) - abs(vec2(d.y, d.x))) * sign_not_zero(vec2(d.x, d.y));
+		d.x = folded.x;
+		d.y = folded.y;
+	}
+	return normalize(d);
+}
+
+}
+
+void SkyRadianceCache::clear() {
+	sky = nullptr;
+	resolution = 0;
+	texture = myn::CpuTexture();
+}
+
+void SkyRadianceCache::build(myn::sky::CpuSkyAtmosphere* in_sky, uint32_t in_resolution) {
+	sky = in_sky;
+	// (at least 2 texels across, see below)
+	resolution = in_resolution == 0 ? 0 : std::max(2u, in_resolution);
+	texture = myn::CpuTexture();
+	if (resolution == 0) return;
+
+	TIMER_BEGIN
+	const auto& params = sky->renderingParams;
+	dir2sun = params.dir2sun;
+	cos_sun_radius = std::cos(params.sunAngularRadius);
+	sun_radiance = sky->sampleSkyColor(dir2sun) - sky->sampleSkyColor(dir2sun, false);
+
+	// texel (x, y) holds the sky at uv (x, y) / (resolution - 1), so that the corners and edges (where the
+	// octahedron folds) are baked exactly rather than blended with a clamped neighbor
+	texture = myn::CpuTexture(resolution, resolution);
+	float texel_to_uv = 1.0f / float(resolution - 1);
+	myn::jobs::parallel_for(0, resolution, 8, [&](uint32_t begin, uint32_t end) {
+		for (uint32_t y = begin; y < end; y++) {
+			for (uint32_t x = 0; x < resolution; x++) {
+				vec3 d = octahedral_decode(vec2(x, y) * texel_to_uv);
+				texture.storeTexel(x, y, vec4(sky->sampleSkyColor(d, false), 1));
+			}
+		}
+	});
+	TIMER_END(duration)
+	TRACE("baked sky radiance cache (%ux%u) in %.1fms", resolution, resolution, duration * 1000)
+}
+
+vec3 SkyRadianceCache::radiance(const vec3& d) const {
+	if (resolution == 0) return sky->sampleSkyColor(d);
+	// (sampleBilinear puts texel x at u = x / resolution)
+	vec2 uv = octahedral_encode(d) * (float(resolution - 1) / float(resolution));
+	vec3 L = texture.sampleBilinear(uv, myn::CpuTexture::WM_Clamp);
+	if (dot(d, dir2sun) > cos_sun_radius) L += sun_radiance;
+	return L;
+}
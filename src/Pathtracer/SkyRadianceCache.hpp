@@ -0,0 +1,30 @@
+#pragma once
+#include "Utils/myn/CpuTexture.h"
+#include <glm/glm.hpp>
+#include <cstdint>
+
+namespace myn::sky { class CpuSkyAtmosphere; }
+
+// the CPU sky baked into an octahedral map (+z up) once, so that a miss costs one bilinear fetch instead of
+// evaluating the sky view LUT. The sun disk is too small for any reasonable resolution, so it stays analytic:
+// a dot product against a precomputed cosine, plus a precomputed radiance.
+// Only valid for the renderingParams it was built with; whoever changes them has to build it again.
+class SkyRadianceCache {
+public:
+	// resolution 0 keeps evaluating the sky itself
+	void build(myn::sky::CpuSkyAtmosphere* sky, uint32_t resolution);
+	void clear();
+	bool empty() const { return sky == nullptr; }
+	uint32_t get_resolution() const { return resolution; }
+
+	// what a ray leaving the scene in direction d sees
+	glm::vec3 radiance(const glm::vec3& d) const;
+
+private:
+	myn::sky::CpuSkyAtmosphere* sky = nullptr;
+	uint32_t resolution = 0;
+	myn::CpuTexture texture;
+	glm::vec3 dir2sun = glm::vec3(0, 0, 1);
+	float cos_sun_radius = 1;
+	glm::vec3 sun_radiance = glm::vec3(0);
+};
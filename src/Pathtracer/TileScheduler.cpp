@@ -0,0 +1,175 @@
+#include "TileScheduler.hpp"
+#include "Utils/myn/Log.h"
+#include "Utils/myn/Misc.h"
+#include <chrono>
+#include <string>
+
+namespace {
+
+// distance d along the Hilbert curve filling an n * n grid (n a power of two) -> grid position
+void hilbert_d2xy(uint32_t n, uint32_t d, uint32_t& x, uint32_t& y) {
+	x = y = 0;
+	for (uint32_t s = 1; s < n; s *= 2) {
+		uint32_t rx = 1 & (d / 2);
+		uint32_t ry = 1 & (d ^ rx);
+		if (ry == 0) { // rotate the quadrant
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+}
+
+std::vector<uint32_t> hilbert_tile_order(uint32_t tiles_x, uint32_t tiles_y) {
+	uint32_t n = 1;
+	while (n < tiles_x || n < tiles_y) n *= 2;
+	std::vector<uint32_t> order;
+	order.reserve(tiles_x * tiles_y);
+	for (uint32_t d = 0; d < n * n; d++) {
+		uint32_t x, y;
+		hilbert_d2xy(n, d, x, y);
+		if (x < tiles_x && y < tiles_y) order.push_back(y * tiles_x + x);
+	}
+	return order;
+}
+
+TileScheduler::TileScheduler(uint32_t _width, uint32_t _height, uint32_t _tile_size, uint32_t _num_threads)
+	: width(_width), height(_height), tile_size(std::max(1u, _tile_size)), num_threads(std::max(1u, _num_threads)),
+	  busy_ns(num_threads, 0)
+{
+	tiles_x = (width + tile_size - 1) / tile_size;
+	tiles_y = (height + tile_size - 1) / tile_size;
+	order = hilbert_tile_order(tiles_x, tiles_y);
+	cost = std::vector<std::atomic<uint64_t>>(tiles_x * tiles_y);
+	last_cost.resize(tiles_x * tiles_y, 0);
+}
+
+void TileScheduler::begin_pass(const std::function<bool(uint32_t)>& has_work) {
+	tiles.clear();
+	next_tile = 0;
+	for (auto& c : cost) c = 0;
+
+	// split what took long last pass, so that no tile is a big share of the whole pass
+	double target = INF;
+	if (has_last_cost) {
+		double total = 0;
+		for (uint64_t c : last_cost) total += double(c);
+		target = total / double(num_threads * TILE_SCHEDULER_TILES_PER_THREAD);
+	}
+
+	for (uint32_t base : order) {
+		uint32_t x = (base % tiles_x) * tile_size;
+		uint32_t y = (base / tiles_x) * tile_size;
+		add_tile(x, y, std::min(tile_size, width - x), std::min(tile_size, height - y), base,
+				 has_last_cost ? double(last_cost[base]) : 0.0, target, has_work);
+	}
+}
+
+void TileScheduler::add_tile(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t base, double estimate, double target,
+							 const std::function<bool(uint32_t)>& has_work)
+{
+	if (has_work) {
+		bool any = false;
+		for (uint32_t j = y; j < y + h && !any; j++) {
+			for (uint32_t i = x; i < x + w && !any; i++) any = has_work(j * width + i);
+		}
+		if (!any) return;
+	}
+
+	uint32_t half_w = w / 2, half_h = h / 2;
+	if (estimate > target && half_w >= TILE_SCHEDULER_MIN_TILE_SIZE && half_h >= TILE_SCHEDULER_MIN_TILE_SIZE) {
+		// quarters in the order of the curve's first step, assuming cost is spread evenly within the tile
+		add_tile(x, y, half_w, half_h, base, estimate * 0.25, target, has_work);
+		add_tile(x, y + half_h, half_w, h - half_h, base, estimate * 0.25, target, has_work);
+		add_tile(x + half_w, y + half_h, w - half_w, h - half_h, base, estimate * 0.25, target, has_work);
+		add_tile(x + half_w, y, w - half_w, half_h, base, estimate * 0.25, target, has_work);
+		return;
+	}
+	tiles.emplace_back(x, y, w, h, base);
+}
+
+bool TileScheduler::claim_rows(Tile*& tile, uint32_t& row, uint32_t& count, uint32_t max_pixels) {
+	auto claim = [&](Tile& t) {
+		uint32_t rows = std::max(1u, max_pixels / t.w);
+		row = t.next_row.fetch_add(rows);
+		if (row >= t.h) return false;
+		tile = &t;
+		count = std::min(rows, t.h - row);
+		return true;
+	};
+	// untouched tiles first
+	while (next_tile.load() < tiles.size()) {
+		uint32_t i = next_tile.fetch_add(1);
+		if (i >= tiles.size()) break;
+		if (claim(tiles[i])) return true;
+	}
+	// then help out with whichever has the most rows left
+	for (;;) {
+		Tile* best = nullptr;
+		uint32_t best_rows_left = 0;
+		for (auto& t : tiles) {
+			uint32_t next = t.next_row.load();
+			if (next < t.h && t.h - next > best_rows_left) {
+				best = &t;
+				best_rows_left = t.h - next;
+			}
+		}
+		if (!best) return false;
+		if (claim(*best)) return true;
+	}
+}
+
+void TileScheduler::trace_tile(uint32_t tid, Tile* tile, uint32_t row, uint32_t count, uint32_t max_pixels,
+							   const std::function<void(uint32_t, uint32_t, uint32_t, uint32_t)>& trace_rows,
+							   const std::function<bool()>& stop)
+{
+	auto begin = std::chrono::high_resolution_clock::now();
+	uint32_t rows = std::max(1u, max_pixels / tile->w);
+	do {
+		trace_rows(tile->x, tile->y + row, tile->w, count);
+		if (stop && stop()) break;
+		row = tile->next_row.fetch_add(rows);
+		count = row < tile->h ? std::min(rows, tile->h - row) : 0;
+	} while (row < tile->h);
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - begin).count();
+	cost[tile->base] += ns;
+	busy_ns[tid] += ns;
+}
+
+void TileScheduler::run(uint32_t tid, const std::function<void(uint32_t, uint32_t, uint32_t, uint32_t)>& trace_rows,
+						const std::function<bool()>& stop, uint32_t max_pixels)
+{
+	Tile* tile;
+	uint32_t row, count;
+	while ((!stop || !stop()) && claim_rows(tile, row, count, max_pixels)) {
+		trace_tile(tid, tile, row, count, max_pixels, trace_rows, stop);
+	}
+}
+
+void TileScheduler::end_pass(double seconds) {
+	total_seconds += seconds;
+	for (uint32_t i = 0; i < cost.size(); i++) last_cost[i] = cost[i].load();
+	has_last_cost = true;
+}
+
+void TileScheduler::report_utilization() const {
+	if (total_seconds <= 0) return;
+	double sum = 0, lowest = 1, highest = 0;
+	std::string per_thread;
+	for (uint32_t tid = 0; tid < num_threads; tid++) {
+		double u = double(busy_ns[tid]) * 1e-9 / total_seconds;
+		sum += u;
+		lowest = std::min(lowest, u);
+		highest = std::max(highest, u);
+		per_thread += std::to_string(int(u * 100.0 + 0.5)) + (tid + 1 < num_threads ? " " : "");
+	}
+	TRACE("thread utilization over %.2f seconds: %.1f%% average, %.1f%% min, %.1f%% max (%u tiles last pass)\n\tper thread (%%): %s",
+		  total_seconds, 100.0 * sum / num_threads, 100.0 * lowest, 100.0 * highest, uint32_t(tiles.size()), per_thread.c_str())
+}
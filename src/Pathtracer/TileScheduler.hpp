@@ -0,0 +1,73 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+// expensive tiles get split (in quarters, recursively) until their estimated cost fits this many per thread
+#define TILE_SCHEDULER_TILES_PER_THREAD 8
+#define TILE_SCHEDULER_MIN_TILE_SIZE 8
+
+// order of the tiles of a tiles_x * tiles_y grid (tile index = y * tiles_x + x) along a Hilbert curve,
+// so consecutive tiles are neighbors and share more scene data in cache
+std::vector<uint32_t> hilbert_tile_order(uint32_t tiles_x, uint32_t tiles_y);
+
+// hands out the pixels of one pass over an image to any number of threads, a tile row (or a few) at a time.
+// 2D tiles go out in Hilbert order; once there are no untouched tiles left, idle threads join the in-flight tile
+// with the most rows left. So a pass doesn't end with one thread finishing an expensive tile while the rest wait.
+// Tile costs measured in a pass decide how finely the next pass splits them.
+class TileScheduler {
+public:
+	TileScheduler(uint32_t _width, uint32_t _height, uint32_t _tile_size, uint32_t _num_threads);
+
+	// lays out the next pass. has_work(pixel index), if given, says which pixels the pass traces;
+	// tiles without any are skipped. Not thread safe: call while no thread is in run()
+	void begin_pass(const std::function<bool(uint32_t)>& has_work = nullptr);
+
+	// calls trace_rows(x, y, w, h) for rows of tiles, pixels [x, x + w) of rows [y, y + h), until the pass is done or
+	// stop() says so. h is 1 unless max_pixels is given: then it is as many rows of the tile as fit that many pixels.
+	// Call from num_threads threads at once, each with its own tid
+	void run(uint32_t tid, const std::function<void(uint32_t, uint32_t, uint32_t, uint32_t)>& trace_rows,
+			 const std::function<bool()>& stop = nullptr, uint32_t max_pixels = 0);
+
+	// call once all threads returned from run(): accounts the pass' wall time for utilization
+	void end_pass(double seconds);
+
+	// TRACEs how busy each thread was over all passes so far
+	void report_utilization() const;
+
+	uint32_t num_tiles() const { return tiles.size(); }
+
+private:
+	struct Tile {
+		Tile(uint32_t _x, uint32_t _y, uint32_t _w, uint32_t _h, uint32_t _base)
+			: x(_x), y(_y), w(_w), h(_h), base(_base) {}
+		uint32_t x, y, w, h;
+		uint32_t base; // index of the TileSize grid tile it belongs to, which costs are tracked for
+		std::atomic<uint32_t> next_row{0};
+	};
+
+	uint32_t width, height, tile_size, num_threads;
+	uint32_t tiles_x, tiles_y;
+	std::vector<uint32_t> order; // of grid tiles
+
+	std::deque<Tile> tiles; // of this pass, in the order they go out
+	std::atomic<uint32_t> next_tile{0};
+
+	// nanoseconds spent per grid tile: being measured, and from the previous pass
+	std::vector<std::atomic<uint64_t>> cost;
+	std::vector<uint64_t> last_cost;
+	bool has_last_cost = false;
+
+	std::vector<uint64_t> busy_ns; // per thread, over all passes
+	double total_seconds = 0;
+
+	void add_tile(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t base, double estimate, double target,
+				  const std::function<bool(uint32_t)>& has_work);
+	// claims up to (max_pixels / tile width) consecutive rows, at least one
+	bool claim_rows(Tile*& tile, uint32_t& row, uint32_t& count, uint32_t max_pixels);
+	void trace_tile(uint32_t tid, Tile* tile, uint32_t row, uint32_t count, uint32_t max_pixels,
+					const std::function<void(uint32_t, uint32_t, uint32_t, uint32_t)>& trace_rows,
+					const std::function<bool()>& stop);
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <vector>
+#include <cstdint>
+#include "Sampler.hpp"
+
+// the wavefront integrator (Integrator: 1, see PathtracerWavefront.cpp) traces a whole batch of camera paths a stage
+// at a time: generate camera rays, extend all live paths to their closest hit, shade the hits (grouped by BSDF type),
+// then test all shadow rays that shading queued. Path state is kept as a structure of arrays, one array per field,
+// so each stage is a plain loop over the few fields it touches.
+// (ispc would run the same stages as one foreach each, over the same arrays)
+
+// #paths per batch, at most. Pixels get split across batches, never their samples
+#define WAVEFRONT_MAX_BATCH_PATHS (1u << 14)
+
+// paths are laid out pixel by pixel, each pixel's samples next to each other
+struct WavefrontPaths {
+	void resize(uint32_t n) {
+		ray_o.resize(n);
+		ray_d.resize(n);
+		receive_le.resize(n);
+		bsdf_pdf.resize(n);
+		contribution.resize(n);
+		output.resize(n);
+		samples.resize(n);
+		hit_primitive.resize(n);
+		hit_t.resize(n);
+		hit_n.resize(n);
+		hit_instance.resize(n);
+		first_albedo.resize(n);
+		first_normal.resize(n);
+		first_depth.resize(n);
+		direct.resize(n);
+	}
+
+	// current ray of each path (tmin 0, tmax INF)
+	std::vector<glm::vec3> ray_o;
+	std::vector<glm::vec3> ray_d;
+	std::vector<uint8_t> receive_le;
+	std::vector<float> bsdf_pdf; // see Ray
+
+	std::vector<glm::vec3> contribution;
+	std::vector<glm::vec3> output;
+	std::vector<SampleStream> samples;
+
+	// closest hit of the current ray, from extend. hit_primitive is -1 on a miss
+	std::vector<int> hit_primitive;
+	std::vector<float> hit_t;
+	std::vector<glm::vec3> hit_n;
+	std::vector<uint32_t> hit_instance;
+
+	// AOVs, see RayTask
+	std::vector<glm::vec3> first_albedo;
+	std::vector<glm::vec3> first_normal;
+	std::vector<float> first_depth;
+	std::vector<glm::vec3> direct;
+};
+
+// shadow rays queued by shade, each with what its path gets if nothing is in the way
+struct WavefrontShadowRays {
+	void clear() {
+		o.clear(); d.clear();
+		tmin.clear(); tmax.clear();
+		contribution.clear();
+		path.clear();
+	}
+	uint32_t size() const { return path.size(); }
+
+	std::vector<glm::vec3> o;
+	std::vector<glm::vec3> d;
+	std::vector<double> tmin;
+	std::vector<double> tmax;
+	std::vector<glm::vec3> contribution;
+	std::vector<uint32_t> path;
+};
+
+// everything one thread needs to trace batches; kept around so the arrays only grow once
+struct WavefrontBatch {
+	WavefrontPaths paths;
+	WavefrontShadowRays shadow_rays;
+	std::vector<uint32_t> live; // paths that still have a ray to extend, in pixel order
+	std::vector<uint32_t> next_live;
+	std::vector<uint32_t> hits; // live paths that hit something, sorted by BSDF type
+};
@@ -0,0 +1,253 @@
+#include "WideBVH.hpp"
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define WIDE_BVH_SSE 1
+#include <xmmintrin.h>
+#else
+#define WIDE_BVH_SSE 0
+#endif
+
+namespace
+{
+inline float half_area(const LinearBVHNode& node) {
+	vec3 d = node.max - node.min;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+}
+
+WideBVH::WideBVH(const LinearBVH& binary) : triangles(binary.triangles)
+{
+	if (binary.nodes.empty()) return;
+	const auto& bnodes = binary.nodes;
+
+	// (binary node, wide node it becomes, depth)
+	struct Item { uint32_t binary_index; uint32_t wide_index; uint depth; };
+	std::vector<Item> st;
+	nodes.emplace_back();
+	st.push_back({0, 0, 0});
+	while (!st.empty()) {
+		Item item = st.back(); st.pop_back();
+		max_depth = glm::max(max_depth, item.depth);
+
+		// gather up to 4 children
+		std::vector<uint32_t> children;
+		const LinearBVHNode& bnode = bnodes[item.binary_index];
+		if (bnode.is_leaf()) {
+			children.push_back(item.binary_index); // (only happens if the root is a leaf)
+		} else {
+			children.push_back(bnode.offset);
+			children.push_back(bnode.offset + 1);
+		}
+		while (children.size() < WIDE_BVH_WIDTH) {
+			int best = -1;
+			float best_area = -1;
+			for (int i = 0; i < children.size(); i++) {
+				const LinearBVHNode& c = bnodes[children[i]];
+				if (!c.is_leaf() && half_area(c) > best_area) {
+					best = i;
+					best_area = half_area(c);
+				}
+			}
+			if (best < 0) break;
+			uint32_t opened = children[best];
+			children[best] = bnodes[opened].offset;
+			children.insert(children.begin() + best + 1, bnodes[opened].offset + 1);
+		}
+
+		WideBVHNode node{};
+		node.num_children = children.size();
+		for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+			if (i >= children.size()) {
+				// unused slot: masked out by num_children during traversal anyway
+				node.min_x[i] = node.min_y[i] = node.min_z[i] = INF;
+				node.max_x[i] = node.max_y[i] = node.max_z[i] = -INF;
+				continue;
+			}
+			const LinearBVHNode& c = bnodes[children[i]];
+			node.min_x[i] = c.min.x; node.min_y[i] = c.min.y; node.min_z[i] = c.min.z;
+			node.max_x[i] = c.max.x; node.max_y[i] = c.max.y; node.max_z[i] = c.max.z;
+			if (c.is_leaf()) {
+				node.child[i] = c.offset;
+				node.count[i] = c.count;
+			} else {
+				node.child[i] = nodes.size();
+				node.count[i] = 0;
+				nodes.emplace_back();
+				st.push_back({children[i], node.child[i], item.depth + 1});
+			}
+		}
+		nodes[item.wide_index] = node;
+	}
+}
+
+namespace
+{
+struct TraversalEntry {
+	uint32_t index; // node index, or first primitive of a leaf
+	uint32_t count; // 0 for nodes
+	float tnear;
+};
+#define WIDE_BVH_LOCAL_STACK_SIZE 256
+
+#if WIDE_BVH_SSE
+struct RaySSE {
+	__m128 ox, oy, oz;
+	__m128 idx, idy, idz;
+	explicit RaySSE(const vec3& o, const vec3& inv_d) {
+		ox = _mm_set1_ps(o.x); oy = _mm_set1_ps(o.y); oz = _mm_set1_ps(o.z);
+		idx = _mm_set1_ps(inv_d.x); idy = _mm_set1_ps(inv_d.y); idz = _mm_set1_ps(inv_d.z);
+	}
+};
+
+// slab test against all 4 child boxes at once; returns a bit mask of hit children
+inline int intersect_children(const WideBVHNode& node, const RaySSE& r, float tmin, float tmax, float* tnear_out)
+{
+	__m128 t0x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_x), r.ox), r.idx);
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_x), r.ox), r.idx);
+	__m128 t0y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_y), r.oy), r.idy);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_y), r.oy), r.idy);
+	__m128 t0z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.min_z), r.oz), r.idz);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.max_z), r.oz), r.idz);
+
+	__m128 tnear = _mm_max_ps(
+		_mm_max_ps(_mm_min_ps(t0x, t1x), _mm_min_ps(t0y, t1y)),
+		_mm_max_ps(_mm_min_ps(t0z, t1z), _mm_set1_ps(tmin)));
+	__m128 tfar = _mm_mul_ps(
+		_mm_min_ps(_mm_min_ps(_mm_max_ps(t0x, t1x), _mm_max_ps(t0y, t1y)), _mm_max_ps(t0z, t1z)),
+		_mm_set1_ps(BVH_SLAB_TFAR_SCALE));
+	tfar = _mm_min_ps(tfar, _mm_set1_ps(tmax));
+
+	_mm_storeu_ps(tnear_out, tnear);
+	return _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) & ((1 << node.num_children) - 1);
+}
+#else
+// scalar fallback for targets without SSE
+inline int intersect_children(const WideBVHNode& node, const vec3& o, const vec3& inv_d, float tmin, float tmax, float* tnear_out)
+{
+	int mask = 0;
+	for (int i = 0; i < node.num_children; i++) {
+		vec3 t0 = (vec3(node.min_x[i], node.min_y[i], node.min_z[i]) - o) * inv_d;
+		vec3 t1 = (vec3(node.max_x[i], node.max_y[i], node.max_z[i]) - o) * inv_d;
+		vec3 tsmall = glm::min(t0, t1);
+		vec3 tbig = glm::max(t0, t1);
+		float tnear = glm::max(glm::max(tsmall.x, tsmall.y), glm::max(tsmall.z, tmin));
+		float tfar = glm::min(glm::min(glm::min(tbig.x, tbig.y), tbig.z) * BVH_SLAB_TFAR_SCALE, tmax);
+		tnear_out[i] = tnear;
+		if (tnear <= tfar) mask |= 1 << i;
+	}
+	return mask;
+}
+#endif
+}
+
+int WideBVH::intersect_primitives(Ray& ray, double& t, vec3& n) const
+{
+	if (nodes.empty()) return -1;
+	int primitive = -1;
+	TriangleRay tri_ray(ray);
+	float tmax = ray.tmax;
+
+	vec3 inv_d = 1.0f / ray.d;
+#if WIDE_BVH_SSE
+	RaySSE ray_sse(ray.o, inv_d);
+#endif
+
+	// each level pops one entry and pushes at most 4
+	TraversalEntry local_stack[WIDE_BVH_LOCAL_STACK_SIZE];
+	std::vector<TraversalEntry> heap_stack;
+	TraversalEntry* st = local_stack;
+	if ((max_depth + 1) * (WIDE_BVH_WIDTH - 1) + 1 > WIDE_BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize((max_depth + 1) * (WIDE_BVH_WIDTH - 1) + 1);
+		st = heap_stack.data();
+	}
+	int top = 0;
+	st[top++] = {0, 0, -INF};
+
+	while (top > 0) {
+		TraversalEntry entry = st[--top];
+		if (entry.tnear > ray.tmax) continue;
+
+		if (entry.count > 0) {
+			int hit = triangles->intersect_leaf(tri_ray, entry.index, entry.count, tmax);
+			if (hit >= 0) {
+				primitive = hit;
+				ray.tmax = tmax;
+			}
+			continue;
+		}
+
+		const WideBVHNode& node = nodes[entry.index];
+		alignas(16) float tnear[WIDE_BVH_WIDTH];
+#if WIDE_BVH_SSE
+		int mask = intersect_children(node, ray_sse, ray.tmin, ray.tmax, tnear);
+#else
+		int mask = intersect_children(node, ray.o, inv_d, ray.tmin, ray.tmax, tnear);
+#endif
+		if (mask == 0) continue;
+
+		// order hit children far to near, so the nearest is popped first
+		int order[WIDE_BVH_WIDTH];
+		int num_hits = 0;
+		for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+			if (!(mask & (1 << i))) continue;
+			int j = num_hits++;
+			while (j > 0 && tnear[order[j - 1]] < tnear[i]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+		for (int k = 0; k < num_hits; k++) {
+			int i = order[k];
+			st[top++] = {node.child[i], node.count[i], tnear[i]};
+		}
+	}
+	if (primitive >= 0) {
+		t = tmax;
+		n = triangles->normal(primitive);
+	}
+	return primitive;
+}
+
+bool WideBVH::occluded(const Ray& ray) const
+{
+	if (nodes.empty()) return false;
+	TriangleRay tri_ray(ray);
+
+	vec3 inv_d = 1.0f / ray.d;
+#if WIDE_BVH_SSE
+	RaySSE ray_sse(ray.o, inv_d);
+#endif
+
+	TraversalEntry local_stack[WIDE_BVH_LOCAL_STACK_SIZE];
+	std::vector<TraversalEntry> heap_stack;
+	TraversalEntry* st = local_stack;
+	if ((max_depth + 1) * (WIDE_BVH_WIDTH - 1) + 1 > WIDE_BVH_LOCAL_STACK_SIZE) {
+		heap_stack.resize((max_depth + 1) * (WIDE_BVH_WIDTH - 1) + 1);
+		st = heap_stack.data();
+	}
+	int top = 0;
+	st[top++] = {0, 0, -INF};
+
+	while (top > 0) {
+		TraversalEntry entry = st[--top];
+
+		if (entry.count > 0) {
+			if (triangles->occludes_leaf(tri_ray, entry.index, entry.count, ray.tmax)) return true;
+			continue;
+		}
+
+		const WideBVHNode& node = nodes[entry.index];
+		alignas(16) float tnear[WIDE_BVH_WIDTH];
+#if WIDE_BVH_SSE
+		int mask = intersect_children(node, ray_sse, ray.tmin, ray.tmax, tnear);
+#else
+		int mask = intersect_children(node, ray.o, inv_d, ray.tmin, ray.tmax, tnear);
+#endif
+		// any hit terminates the query, so don't bother sorting children
+		for (int i = WIDE_BVH_WIDTH - 1; i >= 0; i--) {
+			if (mask & (1 << i)) st[top++] = {node.child[i], node.count[i], tnear[i]};
+		}
+	}
+	return false;
+}
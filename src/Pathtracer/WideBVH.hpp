@@ -0,0 +1,29 @@
+#pragma once
+#include "BVH.hpp"
+
+#define WIDE_BVH_WIDTH 4
+
+// node of the 4-wide BVH: boxes of all children are stored SoA so they can be tested in one SIMD pass.
+struct alignas(64) WideBVHNode
+{
+	float min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+	float max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+	uint32_t child[WIDE_BVH_WIDTH]; // interior child: index of its node; leaf child: index of first primitive
+	uint16_t count[WIDE_BVH_WIDTH]; // number of primitives of a leaf child, 0 for interior children
+	uint32_t num_children; // slots [num_children, WIDE_BVH_WIDTH) are unused
+};
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should be 2 cache lines");
+
+struct WideBVH
+{
+	// collapses a binary BVH by repeatedly opening the interior child with the largest surface area
+	explicit WideBVH(const LinearBVH& binary);
+
+	std::vector<WideBVHNode> nodes;
+	const TriangleStore* triangles;
+	uint max_depth = 0;
+
+	// returns index of the closest triangle, -1 if none
+	int intersect_primitives(Ray& ray, double& t, vec3& n) const;
+	bool occluded(const Ray& ray) const;
+};
@@ -0,0 +1,52 @@
+#include "AliasTable.h"
+#include <algorithm>
+
+// the largest float below 1
+#define ONE_MINUS_EPSILON 0x1.fffffep-1f
+
+namespace myn {
+
+AliasTable::AliasTable(const std::vector<float>& weights) {
+	uint32_t n = weights.size();
+	bins.resize(n);
+	if (n == 0) return;
+
+	double sum = 0;
+	for (float w : weights) sum += w;
+	total = float(sum);
+	for (uint32_t i = 0; i < n; i++) bins[i].pmf = sum > 0 ? float(weights[i] / sum) : 1.0f / float(n);
+
+	// scaled so that the average bin holds 1; small ones get topped up from large ones
+	std::vector<uint32_t> small, large;
+	std::vector<double> scaled(n);
+	for (uint32_t i = 0; i < n; i++) {
+		scaled[i] = double(bins[i].pmf) * n;
+		(scaled[i] < 1 ? small : large).push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		uint32_t s = small.back(); small.pop_back();
+		uint32_t l = large.back(); large.pop_back();
+		bins[s].q = float(scaled[s]);
+		bins[s].alias = l;
+		scaled[l] -= 1 - scaled[s];
+		(scaled[l] < 1 ? small : large).push_back(l);
+	}
+	// whatever is left is 1 up to rounding
+	for (uint32_t i : small) { bins[i].q = 1; bins[i].alias = i; }
+	for (uint32_t i : large) { bins[i].q = 1; bins[i].alias = i; }
+}
+
+uint32_t AliasTable::sample(float u, float* u_remapped) const {
+	float scaled = u * float(bins.size());
+	uint32_t i = std::min(uint32_t(scaled), uint32_t(bins.size()) - 1);
+	float up = std::min(scaled - float(i), ONE_MINUS_EPSILON);
+	const Bin& bin = bins[i];
+	if (up < bin.q) {
+		if (u_remapped) *u_remapped = std::min(up / bin.q, ONE_MINUS_EPSILON);
+		return i;
+	}
+	if (u_remapped) *u_remapped = std::min((up - bin.q) / (1 - bin.q), ONE_MINUS_EPSILON);
+	return bin.alias;
+}
+
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+namespace myn {
+
+	// picks index i with probability weights[i] / sum(weights) in constant time, whatever the distribution
+	// (Walker's alias method, built with Vose's algorithm)
+	class AliasTable {
+	public:
+		AliasTable() = default;
+		// weights must be non-negative; if they're all 0, every index is equally likely
+		explicit AliasTable(const std::vector<float>& weights);
+
+		// u in [0, 1). u_remapped (if not null) receives a fresh uniform [0, 1) sample left over from u,
+		// for placing a continuous sample within the picked bin
+		uint32_t sample(float u, float* u_remapped = nullptr) const;
+
+		float pmf(uint32_t i) const { return bins[i].pmf; }
+		uint32_t size() const { return bins.size(); }
+		bool empty() const { return bins.empty(); }
+		float sum() const { return total; }
+
+	private:
+		struct Bin {
+			float q = 1; // probability of keeping this bin's own index ...
+			uint32_t alias = 0; // ... otherwise it's this one
+			float pmf = 0;
+		};
+		std::vector<Bin> bins;
+		float total = 0;
+	};
+
+}
@@ -0,0 +1,185 @@
+#include "JobSystem.h"
+#include "Log.h"
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+
+namespace myn::jobs {
+
+	struct Task {
+		std::function<void()> fn;
+		TaskGroup* group = nullptr;
+
+		void execute() {
+			fn();
+			group->pending.fetch_sub(1, std::memory_order_release);
+		}
+	};
+
+namespace {
+
+	struct TaskDeque {
+		std::mutex m;
+		std::deque<Task> tasks;
+	};
+
+	struct Pool {
+		// deques[0] is shared by threads outside the pool, deques[i] belongs to worker i
+		std::vector<TaskDeque*> deques;
+		std::vector<std::thread> workers;
+		std::atomic<uint32_t> num_queued{0};
+		std::atomic<bool> running{false};
+		std::mutex sleep_mutex;
+		std::condition_variable sleep_cv;
+	};
+
+	Pool pool;
+	std::once_flag started;
+	bool initialized_explicitly = false;
+	thread_local uint32_t this_thread_index = 0;
+
+	bool pop_own(Task& out) {
+		TaskDeque& d = *pool.deques[this_thread_index];
+		std::lock_guard<std::mutex> lock(d.m);
+		if (d.tasks.empty()) return false;
+		// workers take their newest task (the one whose data is still in cache), others take the oldest
+		if (this_thread_index == 0) {
+			out = std::move(d.tasks.front());
+			d.tasks.pop_front();
+		} else {
+			out = std::move(d.tasks.back());
+			d.tasks.pop_back();
+		}
+		pool.num_queued--;
+		return true;
+	}
+
+	bool steal(Task& out) {
+		uint32_t n = pool.deques.size();
+		for (uint32_t i = 1; i <= n; i++) {
+			TaskDeque& d = *pool.deques[(this_thread_index + i) % n];
+			std::lock_guard<std::mutex> lock(d.m);
+			if (d.tasks.empty()) continue;
+			out = std::move(d.tasks.front());
+			d.tasks.pop_front();
+			pool.num_queued--;
+			return true;
+		}
+		return false;
+	}
+
+	bool find_task(Task& out) {
+		if (pool.num_queued.load() == 0) return false;
+		return pop_own(out) || steal(out);
+	}
+
+	void worker_loop(uint32_t index) {
+		this_thread_index = index;
+		while (pool.running) {
+			Task task;
+			if (find_task(task)) {
+				task.execute();
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(pool.sleep_mutex);
+			pool.sleep_cv.wait(lock, [] { return !pool.running || pool.num_queued.load() > 0; });
+		}
+	}
+
+	void start(uint32_t num_threads) {
+		if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+		for (uint32_t i = 0; i < num_threads; i++) pool.deques.push_back(new TaskDeque());
+		pool.running = true;
+		for (uint32_t i = 1; i < num_threads; i++) pool.workers.emplace_back(worker_loop, i);
+		std::atexit(shutdown);
+		LOG("job system: %u threads", num_threads)
+	}
+
+	void submit(Task&& task) {
+		{
+			TaskDeque& d = *pool.deques[this_thread_index];
+			std::lock_guard<std::mutex> lock(d.m);
+			d.tasks.push_back(std::move(task));
+			pool.num_queued++;
+		}
+		// (taking the lock makes sure a worker that just found nothing is either asleep already or sees num_queued)
+		{ std::lock_guard<std::mutex> lock(pool.sleep_mutex); }
+		pool.sleep_cv.notify_one();
+	}
+
+}
+
+	void initialize(uint32_t num_threads) {
+		bool first = false;
+		std::call_once(started, [&] { start(num_threads); first = true; });
+		if (first) initialized_explicitly = true;
+		else if (initialized_explicitly) WARN("job system is already initialized; the thread count can only be set once")
+		else WARN("job system already started with the default thread count; initialize it before first use")
+	}
+
+	void shutdown() {
+		if (!pool.running) return;
+		{
+			std::lock_guard<std::mutex> lock(pool.sleep_mutex);
+			pool.running = false;
+		}
+		pool.sleep_cv.notify_all();
+		for (auto& t : pool.workers) t.join();
+		pool.workers.clear();
+		for (auto* d : pool.deques) delete d;
+		pool.deques.clear();
+	}
+
+	uint32_t num_threads() {
+		std::call_once(started, [] { start(0); });
+		return pool.deques.size();
+	}
+
+	uint32_t thread_index() {
+		return this_thread_index;
+	}
+
+	void TaskGroup::run(std::function<void()> task) {
+		std::call_once(started, [] { start(0); });
+		pending.fetch_add(1, std::memory_order_relaxed);
+		submit(Task{std::move(task), this});
+	}
+
+	void TaskGroup::wait() {
+		while (pending.load(std::memory_order_acquire) > 0) {
+			Task task;
+			if (find_task(task)) task.execute();
+			else std::this_thread::yield();
+		}
+	}
+
+	void parallel_for(uint32_t begin, uint32_t end, uint32_t grain_size,
+					  const std::function<void(uint32_t, uint32_t)>& body)
+	{
+		if (end <= begin) return;
+		grain_size = std::max(1u, grain_size);
+		uint64_t num_chunks = (uint64_t(end - begin) + grain_size - 1) / grain_size;
+		uint32_t num_helpers = uint32_t(std::min(uint64_t(num_threads()), num_chunks)) - 1;
+		if (num_helpers == 0) {
+			body(begin, end);
+			return;
+		}
+
+		std::atomic<uint64_t> next{begin};
+		auto work = [&]() {
+			uint64_t b;
+			while ((b = next.fetch_add(grain_size)) < end) {
+				body(uint32_t(b), uint32_t(std::min(uint64_t(end), b + grain_size)));
+			}
+		};
+		TaskGroup group;
+		for (uint32_t i = 0; i < num_helpers; i++) group.run(work);
+		work();
+		group.wait();
+	}
+
+} // namespace myn::jobs
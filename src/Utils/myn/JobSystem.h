@@ -0,0 +1,60 @@
+#pragma once
+
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+namespace myn::jobs {
+
+	// the process-wide thread pool: num_threads - 1 persistent workers, plus whichever thread is waiting on work,
+	// which runs tasks too. Each worker owns a deque it pushes to and pops from at the back; idle threads steal
+	// from the front of the others'. Threads outside the pool share one more deque.
+
+	// sets the thread count; 0 means one per hardware thread. Only the first call has an effect (later ones WARN),
+	// and the pool starts itself with the default on first use if nobody called this before.
+	void initialize(uint32_t num_threads = 0);
+
+	// joins the workers; runs by itself at exit
+	void shutdown();
+
+	// threads that work on a parallel_for, including the calling one
+	uint32_t num_threads();
+
+	// 1 .. num_threads - 1 on pool workers, 0 on any other thread
+	uint32_t thread_index();
+
+	// tasks that can be waited on together. A task can itself run() more tasks, into its own group or this one.
+	// wait() runs queued tasks (of any group) instead of blocking, so waiting from inside a task is safe,
+	// and nested parallel_for / groups don't deadlock no matter how many threads the pool has.
+	class TaskGroup {
+	public:
+		TaskGroup() = default;
+		TaskGroup(const TaskGroup&) = delete;
+		~TaskGroup() { wait(); }
+
+		void run(std::function<void()> task);
+		void wait();
+		// no task of the group is queued or running (tasks may still add more until then)
+		bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+
+	private:
+		std::atomic<uint32_t> pending{0};
+		friend struct Task;
+	};
+
+	// lets whoever started some tasks ask them to stop early; tasks poll it between units of work. Hand it to tasks
+	// as a std::shared_ptr, so that a new batch can get a fresh token while the old one is still winding down.
+	class CancellationToken {
+	public:
+		void cancel() { cancelled_flag.store(true, std::memory_order_relaxed); }
+		bool cancelled() const { return cancelled_flag.load(std::memory_order_relaxed); }
+	private:
+		std::atomic<bool> cancelled_flag{false};
+	};
+
+	// calls body(chunk_begin, chunk_end) over chunks of [begin, end) of (at most) grain_size, on all threads of the pool,
+	// and returns once all are done. Chunks go out from a shared counter, so uneven chunks still balance out.
+	void parallel_for(uint32_t begin, uint32_t end, uint32_t grain_size,
+					  const std::function<void(uint32_t, uint32_t)>& body);
+
+} // namespace myn::jobs
@@ -5,62 +5,107 @@ namespace myn {
 
 using namespace glm;
 
+namespace {
+
+// PCG32 (O'Neill, pcg-random.org): 64 bit LCG state, xorshift + random rotation output
+struct PCG32
+{
+	uint64_t state = 0x853c49e6748fea9bull;
+	uint64_t inc = 0xda3e39cb94b95bdbull;
+
+	uint32_t next() {
+		uint64_t old = state;
+		state = old * 6364136223846793005ull + inc;
+		uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = uint32_t(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((32u - rot) & 31u));
+	}
+
+	void seed(uint64_t initstate, uint64_t sequence) {
+		state = 0;
+		inc = (sequence << 1u) | 1u;
+		next();
+		state += initstate;
+		next();
+	}
+};
+
+// per thread, so no locking (libc rand() makes all threads take turns on one lock)
+thread_local PCG32 rng;
+
+// splitmix64 finalizer, so that neighboring pixels & samples get unrelated states
+inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30u)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27u)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31u);
+}
+
+}
+
+void sample::seed(uint32_t pixel, uint32_t sample_index, uint32_t dimension) {
+	uint64_t key = mix64((uint64_t(pixel) << 32u) | sample_index);
+	rng.seed(mix64(key + 0x9e3779b97f4a7c15ull * (dimension + 1)), key);
+}
+
+uint32_t sample::rand_u32() {
+	return rng.next();
+}
+
 float sample::rand01() {
-	return float(rand()) / float(RAND_MAX);
+	// top 24 bits: exactly representable, so the result never rounds up to 1
+	return float(rng.next() >> 8u) * (1.0f / 16777216.0f);
 }
 
 vec2 sample::unit_square_uniform() {
 	return vec2(rand01(), rand01());
 }
 
-vec2 sample::unit_disc_uniform() {
-	float x = rand01() - 0.5f;
-	float y = rand01() - 0.5f;
-	while(length(vec2(x, y)) > 0.5f) {
-		x = rand01() - 0.5f;
-		y = rand01() - 0.5f;
+vec2 sample::unit_disc_uniform(vec2 u) {
+	vec2 o = u * 2.0f - 1.0f;
+	if (o.x == 0 && o.y == 0) return vec2(0);
+	// squares around the center map to circles, so nearby u stay nearby
+	float r, theta;
+	if (abs(o.x) > abs(o.y)) {
+		r = o.x;
+		theta = 0.25f * PI * (o.y / o.x);
+	} else {
+		r = o.y;
+		theta = HALF_PI - 0.25f * PI * (o.x / o.y);
 	}
-	return vec2(x, y) * 2.0f;
+	return r * vec2(cos(theta), sin(theta));
+}
+
+vec2 sample::unit_disc_uniform() {
+	return unit_disc_uniform(unit_square_uniform());
+}
+
+vec3 sample::hemisphere_uniform(vec2 u) {
+	float z = u.x;
+	float r = sqrt(std::max(0.0f, 1.0f - z * z));
+	float phi = TWO_PI * u.y;
+	return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 vec3 sample::hemisphere_uniform() {
-	float x = rand01() - 0.5f;
-	float y = rand01() - 0.5f;
-	float z = rand01() - 0.5f;
-	while (length(vec3(x, y, z)) > 0.5f) {
-		x = rand01() - 0.5f;
-		y = rand01() - 0.5f;
-		z = rand01() - 0.5f;
-	}
-	return normalize(vec3(x, y, abs(z)));
+	return hemisphere_uniform(unit_square_uniform());
+}
+
+vec3 sample::hemisphere_cos_weighed(vec2 u) {
+	vec2 d = unit_disc_uniform(u);
+	float z = sqrt(std::max(0.0f, 1.0f - dot(d, d)));
+	return vec3(d, z);
 }
 
-// ehh.... significantly slower than uniform sampling..
-// see: https://bobobobo.wordpress.com/2012/06/11/cosine-weighted-hemisphere-sampling/
 vec3 sample::hemisphere_cos_weighed() {
-#if 1
-	float x = rand01() - 0.5f;
-	float y = rand01() - 0.5f;
-	while(length(vec2(x, y)) > 0.5f) {
-		x = rand01() - 0.5f;
-		y = rand01() - 0.5f;
-	}
-	x *= 2.0f; y *= 2.0f;
-	float l = length(vec2(x, y));
-	float z = sqrt(1.0f - l * l);
-
-	return vec3(x, y, z);
-#else // too slow....
-	float r1 = rand01();
-	float r2 = rand01();
-	float phi = r1 * TWO_PI;
-	float cos_theta = sqrt(r2);
-	float sin_theta = sqrt(1.0f - r2);
-	float cos_phi = cos(phi);
-	float sin_phi = sqrt(1.0f - pow(cos_phi, 2));
-	return vec3(cos_phi * sin_theta, sin_phi * sin_theta, cos_theta);
-#endif
+	return hemisphere_cos_weighed(unit_square_uniform());
 }
+
+vec2 sample::triangle_uniform(vec2 u) {
+	// unlike folding the square in half, this keeps u's stratification
+	float su = sqrt(u.x);
+	return vec2(1.0f - su, u.y * su);
+}
+
 vec3 sample::tex::tex2D_float3_point(const float* texels_raw, uint32_t width, uint32_t height, glm::ivec2 coord) {
 	uint32_t i = (width * coord.y + coord.x) * 3;
 	return {
@@ -4,16 +4,37 @@
 
 namespace myn::sample {
 
+	// all sampling below draws from a per-thread PCG32 stream. seed() restarts the calling thread's stream at a state
+	// that only depends on (pixel, sample_index, dimension), so a pixel's samples come out the same no matter which
+	// thread traces it. dimension picks one of several independent streams for the same sample.
+	void seed(uint32_t pixel, uint32_t sample_index, uint32_t dimension = 0);
+
+	// uniform in [0, 1)
 	float rand01();
 
+	// raw 32 bit output of the calling thread's stream
+	uint32_t rand_u32();
+
 	glm::vec2 unit_square_uniform();
 
+	// the warps below map u in [0, 1)^2 in closed form (one 2D sample each, no rejection), so stratified or
+	// low discrepancy u stay well distributed. The overloads without u draw it from rand01.
+
+	// concentric mapping (Shirley & Chiu 1997)
+	glm::vec2 unit_disc_uniform(glm::vec2 u);
 	glm::vec2 unit_disc_uniform();
 
+	// around +z
+	glm::vec3 hemisphere_uniform(glm::vec2 u);
 	glm::vec3 hemisphere_uniform();
 
+	// around +z; pdf = z / pi. Projects the concentric disc sample up (Malley's method)
+	glm::vec3 hemisphere_cos_weighed(glm::vec2 u);
 	glm::vec3 hemisphere_cos_weighed();
 
+	// barycentric weights (b1, b2) of v1 and v2, uniform over the triangle's area
+	glm::vec2 triangle_uniform(glm::vec2 u);
+
 	namespace tex {
 
 		glm::vec3 tex2D_float3_point(const float* texels_raw, uint32_t width, uint32_t height, glm::ivec2 coord);
@@ -2,8 +2,8 @@
 // Created by miyehn on 11/10/2022.
 //
 
-#include <thread>
 #include "ShaderSimulator.h"
+#include "JobSystem.h"
 #include "Log.h"
 
 namespace myn {
@@ -22,25 +22,16 @@ void ShaderSimulator::runSim() {
 void ShaderSimulator::dispatchShader(const std::function<vec4(uint32_t, uint32_t)> &kernel) {
 
 #define SHADERSIM_MULTITHREADED 1
-#define SHADERSIM_NUM_THREADS 16
 
 #if SHADERSIM_MULTITHREADED
-	std::thread threads[SHADERSIM_NUM_THREADS];
-	uint32_t rowsPerThread = (output->getHeight() + SHADERSIM_NUM_THREADS - 1) / SHADERSIM_NUM_THREADS;
-	for (int tid = 0; tid < SHADERSIM_NUM_THREADS; tid++) {
-		auto startRow = rowsPerThread * tid;
-		auto endRow = glm::min(rowsPerThread * (tid + 1), uint32_t(output->getHeight()));
-		threads[tid] = std::thread([this, startRow, endRow, kernel](int tid){
-			for (auto h = startRow; h < endRow; h++) {
-				for (auto w = 0; w < output->getWidth(); w++) {
-					output->storeTexel(w, h, kernel(w, h));
-				}
+	// rows go out one at a time on the job system's threads, so rows of uneven cost still balance out
+	jobs::parallel_for(0, output->getHeight(), 1, [&](uint32_t startRow, uint32_t endRow) {
+		for (auto h = startRow; h < endRow; h++) {
+			for (auto w = 0; w < output->getWidth(); w++) {
+				output->storeTexel(w, h, kernel(w, h));
 			}
-		}, tid);
-	}
-	for (int tid = 0; tid < SHADERSIM_NUM_THREADS; tid++) {
-		threads[tid].join();
-	}
+		}
+	});
 #else
 	for (auto h = 0; h < output->getHeight(); h++) {
 		for (auto w = 0; w < output->getWidth(); w++) {
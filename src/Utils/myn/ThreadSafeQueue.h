@@ -1,41 +1,126 @@
 #pragma once
 
 #include <vector>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 
 namespace myn
 {
 	//--------------- thread-safe queue -----------------------
+	// bounded lock-free multi-producer multi-consumer FIFO (Vyukov's bounded MPMC queue): a ring of cells, each with a
+	// sequence number that says whose turn it is. A cell at position pos is free for the producer at pos if its
+	// sequence is pos, and holds data for the consumer at pos if it's pos + 1. So producers only contend on
+	// enqueue_pos and consumers on dequeue_pos, with a single CAS per operation and no locks.
 	template <typename T>
 	struct ThreadSafeQueue {
 
+		explicit ThreadSafeQueue(size_t capacity = 1024) { reserve(capacity); }
+		ThreadSafeQueue(const ThreadSafeQueue&) = delete;
+
+		// rounds capacity up to a power of two and empties the queue. Not thread safe
+		void reserve(size_t capacity) {
+			size_t n = 2;
+			while (n < capacity) n *= 2;
+			cells = std::vector<Cell>(n);
+			for (size_t i = 0; i < n; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+			mask = n - 1;
+			enqueue_pos.store(0, std::memory_order_relaxed);
+			dequeue_pos.store(0, std::memory_order_relaxed);
+		}
+
+		size_t capacity() const { return mask + 1; }
+
+		// only a snapshot while other threads are using the queue
 		size_t size() {
-			std::lock_guard<std::mutex> lock(queue_mutex);
-			return queue.size();
+			size_t d = dequeue_pos.load(std::memory_order_relaxed);
+			size_t e = enqueue_pos.load(std::memory_order_relaxed);
+			return e > d ? e - d : 0;
+		}
+
+		// false (and nothing queued) if the queue is full
+		bool enqueue(T task) {
+			Cell* cell;
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell = &cells[pos & mask];
+				intptr_t diff = intptr_t(cell->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+				if (diff == 0) {
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				} else if (diff < 0) {
+					return false; // the consumer a lap behind hasn't freed this cell yet
+				} else {
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			cell->data = std::move(task);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
 		}
 
 		bool dequeue(T& out_task) {
-			std::lock_guard<std::mutex> lock(queue_mutex);
-			if (queue.size() == 0) return false;
-			out_task = queue.back();
-			queue.pop_back();
+			Cell* cell;
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell = &cells[pos & mask];
+				intptr_t diff = intptr_t(cell->sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+				if (diff == 0) {
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				} else if (diff < 0) {
+					return false; // empty
+				} else {
+					pos = dequeue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			out_task = std::move(cell->data);
+			cell->sequence.store(pos + mask + 1, std::memory_order_release);
 			return true;
 		}
 
-		void enqueue(T task) {
-			std::lock_guard<std::mutex> lock(queue_mutex);
-			queue.insert(queue.begin(), task);
+		// takes up to max_count tasks at once: claims every filled cell in a row from the front with one CAS,
+		// so a consumer grabbing a batch contends on dequeue_pos once instead of per task. Returns how many it took
+		size_t dequeue_n(T* out_tasks, size_t max_count) {
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			size_t count;
+			while (true) {
+				count = 0;
+				while (count < max_count && count <= mask) {
+					size_t sequence = cells[(pos + count) & mask].sequence.load(std::memory_order_acquire);
+					if (sequence != pos + count + 1) break;
+					count++;
+				}
+				if (count == 0) {
+					intptr_t diff = intptr_t(cells[pos & mask].sequence.load(std::memory_order_acquire)) - intptr_t(pos + 1);
+					if (diff < 0) return 0; // empty
+					pos = dequeue_pos.load(std::memory_order_relaxed); // someone else took the front
+					continue;
+				}
+				if (dequeue_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) break;
+			}
+			for (size_t i = 0; i < count; i++) {
+				Cell& cell = cells[(pos + i) & mask];
+				out_tasks[i] = std::move(cell.data);
+				cell.sequence.store(pos + i + mask + 1, std::memory_order_release);
+			}
+			return count;
 		}
 
 		void clear() {
-			std::lock_guard<std::mutex> lock(queue_mutex);
-			queue.clear();
+			T task;
+			while (dequeue(task)) {}
 		}
 
 	private:
-		std::vector<T> queue;
-		std::mutex queue_mutex;
+		struct Cell {
+			std::atomic<size_t> sequence{0};
+			T data{};
+		};
+
+		std::vector<Cell> cells;
+		size_t mask = 0;
+		// (on separate cache lines, so producers and consumers don't slow each other down)
+		alignas(64) std::atomic<size_t> enqueue_pos{0};
+		alignas(64) std::atomic<size_t> dequeue_pos{0};
 	};
 
 } // namespace myn
-